@@ -0,0 +1,211 @@
+# Copyright (c) 2014 Fastly, Inc.
+# All rights reserved.
+#
+# Author: Devon H. O'Dell <dho@fastly.com>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+package KimiScript;
+
+# Shared by the tools that generate and run Kimi scripts: a structural
+# parser and printer for scripts, and a runner that compiles a script with
+# kimi and runs a command against it.
+
+use strict;
+use warnings;
+
+use Exporter qw(import);
+use FindBin;
+use IO::File;
+use POSIX;
+
+our @EXPORT = qw(
+	INVALID
+	parse_script
+	format_script
+	count_lines
+	copy_script
+	candidate_spawn
+	candidate_fails
+);
+
+# Exit status of a candidate that kimi refused to compile.
+use constant INVALID => 125;
+
+# A script is a preamble of defines, followed by epochs. Each epoch is a list
+# of items: single-line commands, or when blocks with their ranges. Blank and
+# comment-only lines are not kept.
+sub parse_script {
+	my ($file) = @_;
+
+	my $infd = new IO::File "< $file";
+	die "Could not open $file" if !defined $infd;
+
+	my $script = { pre => [], epochs => [] };
+	my $epoch;
+	my $when;
+
+	while (<$infd>) {
+		chomp;
+		next if m/^\s*(#|$)/;
+		s/^\s+//;
+
+		if (defined $when) {
+			if (m/^end\s*(#|$)/) {
+				$when->{'end'} = $_;
+				undef $when;
+			} else {
+				push @{$when->{'ranges'}}, $_;
+			}
+		} elsif (m/^t(n)?\[\d+\]\s*(#|$)/) {
+			$epoch = { head => $_, items => [] };
+			push @{$script->{'epochs'}}, $epoch;
+		} elsif (!defined $epoch) {
+			push @{$script->{'pre'}}, $_;
+		} elsif (m/^when\s/) {
+			$when = { head => $_, ranges => [] };
+			push @{$epoch->{'items'}}, $when;
+		} else {
+			push @{$epoch->{'items'}}, $_;
+		}
+	}
+
+	die "$file has no epochs" if !@{$script->{'epochs'}};
+	return $script;
+}
+
+sub format_script {
+	my ($script) = @_;
+	my $out = '';
+
+	$out .= "$_\n" for @{$script->{'pre'}};
+
+	# Epochs are numbered in order, whatever was dropped or merged.
+	my $n = 0;
+	for my $epoch (@{$script->{'epochs'}}) {
+		(my $head = $epoch->{'head'}) =~ s/\[\d+\]/[$n]/;
+		$out .= "\n$head\n";
+		$n++;
+		for my $item (@{$epoch->{'items'}}) {
+			if (!ref $item) {
+				$out .= "\t$item\n";
+				next;
+			}
+
+			$out .= "\t$item->{'head'}\n";
+			$out .= "\t\t$_\n" for @{$item->{'ranges'}};
+			$out .= "\t$item->{'end'}\n";
+		}
+	}
+
+	return $out;
+}
+
+sub count_lines {
+	my ($script) = @_;
+	my $text = format_script($script);
+
+	return scalar(() = $text =~ m/^\S|^\t/mg);
+}
+
+sub copy_script {
+	my ($script) = @_;
+
+	return {
+		pre	=> [ @{$script->{'pre'}} ],
+		epochs	=> [ map { {
+			head	=> $_->{'head'},
+			items	=> [ map { ref $_ ? {
+				head	=> $_->{'head'},
+				ranges	=> [ @{$_->{'ranges'}} ],
+				end	=> $_->{'end'},
+			} : $_ } @{$_->{'items'}} ],
+		} } @{$script->{'epochs'}} ],
+	};
+}
+
+sub expand {
+	my ($run, $slot) = @_;
+	my $workdir = $run->{'workdir'};
+	my %subst = (
+		k	=> "$workdir/$slot.km",
+		f	=> "$workdir/$slot.fi",
+		p	=> $run->{'port'} + $slot,
+		'%'	=> '%',
+	);
+
+	(my $cmd = $run->{'command'}) =~ s/%([kfp%])/$subst{$1}/g;
+	return $cmd;
+}
+
+# Compile and run a candidate in its own process group, so that everything
+# the command starts can be killed once it is done or out of time. Any extra
+# environment is set for the command only.
+sub candidate_spawn {
+	my ($run, $slot, $text, %env) = @_;
+	my $workdir = $run->{'workdir'};
+
+	my $kmfd = new IO::File "> $workdir/$slot.km";
+	die "Could not write $workdir/$slot.km" if !defined $kmfd;
+	print $kmfd $text;
+	$kmfd->close();
+
+	my $pid = fork();
+	die "fork: $!" if !defined $pid;
+	return $pid if $pid;
+
+	setpgrp(0, 0);
+	open STDOUT, '>', "$workdir/$slot.out";
+	open STDERR, '>&', \*STDOUT;
+	open STDIN, '<', '/dev/null';
+
+	my @kimi = ($^X, "$FindBin::Bin/kimi.pl", '-i', "$workdir/$slot.km",
+	    '-o', "$workdir/$slot.fi");
+	push @kimi, '--compact' if $run->{'compact'};
+	POSIX::_exit(INVALID) if system(@kimi) != 0;
+
+	$ENV{$_} = $env{$_} for keys %env;
+	{ exec '/bin/sh', '-c', expand($run, $slot) };
+	POSIX::_exit(INVALID);
+}
+
+# A candidate fails if it exits non-zero or is killed by a signal, other
+# than by running out of time (status -1), and its output matches.
+sub candidate_fails {
+	my ($run, $slot, $status) = @_;
+	my $workdir = $run->{'workdir'};
+	my $match = $run->{'match'};
+
+	return 0 if $status == -1;
+	return 0 if ($status >> 8) == INVALID and !($status & 127);
+	return 0 if $status == 0;
+	return 1 if !defined $match;
+
+	my $outfd = new IO::File "< $workdir/$slot.out";
+	return 0 if !defined $outfd;
+	local $/;
+	my $out = <$outfd>;
+
+	return $out =~ m/$match/;
+}
+
+1;
@@ -32,17 +32,24 @@ use warnings;
 use Getopt::Long;
 use IO::File;
 use IO::Socket::INET;
+use IO::Socket::UNIX;
 use Pod::Usage;
 
-my $infile = 'out.fi';
+my @infiles;
 my $addr = '127.0.0.1:28806';
+my $stream = 0;
+my $compact = 0;
+my $notify = 0;
 my $help = 0;
 my $man = 0;
 my $verbose = 0;
 
 GetOptions(
-	'infile=s'	=> \$infile,
+	'infile=s'	=> \@infiles,
 	'addr=s'	=> \$addr,
+	'stream'	=> \$stream,
+	'compact'	=> \$compact,
+	'notify'	=> \$notify,
 	'help|?'	=> \$help,
 	'man'		=> \$man,
 	'verbose'	=> \$verbose,
@@ -50,15 +57,25 @@ GetOptions(
 pod2usage(1) if $help;
 pod2usage(-exitval => 0, -verbose => 2) if $man;
 
-local $/;
-my $infd = new IO::File "< $infile";
-$infd->binmode();
-my $data = <$infd>;
+@infiles = ('out.fi') if !@infiles;
+die "Only the streaming dialect takes more than one file" if @infiles > 1 and !$stream;
+die "Notifications can't be combined with streaming" if $notify and $stream;
+
+my @data;
+for my $infile (@infiles) {
+	local $/;
+	my $infd = new IO::File "< $infile";
+	die "Could not open $infile" if !defined $infd;
+	$infd->binmode();
+	push @data, <$infd>;
+}
 
 my $i = 0;
 test:
 sleep 1;
-my $s = IO::Socket::INET->new(
+# Anything with a slash in it is the path of a local socket.
+my $s = $addr =~ m{/} ? IO::Socket::UNIX->new(Peer => $addr) :
+    IO::Socket::INET->new(
 	PeerAddr	=> $addr,
 	Proto		=> 'tcp',
 );
@@ -66,7 +83,8 @@ goto test if !defined $s and $i++ < 10;
 die "Couldn't connect" if !defined $s;
 
 # Say hello.
-print $s "hei\x00\x00";
+print $s "hei";
+print $s pack("n", ($stream ? 0x0001 : 0) | ($compact ? 0x0002 : 0));
 $s->flush();
 
 my $joo = "";
@@ -74,18 +92,38 @@ $s->recv($joo, 2);
 die "Hei -> ei" if ($joo eq "ei");
 $s->recv($joo, 1);
 
-print $s "ota se";
-print $s pack("NN", length($data), 0);
-$s->flush();
-print $s $data;
-$s->flush();
-print $s "loppu";
-$s->flush();
-
-$s->recv($joo, 3);
-die "Bad joo" if ($joo ne "joo");
+# In the streaming dialect, the server holds back joo while we are too far
+# ahead of it; waiting for it before sending more is all the flow control
+# we need.
+for my $data (@data) {
+	print $s "ota se";
+	print $s pack("NN", length($data), 0);
+	$s->flush();
+	print $s $data;
+	$s->flush();
+	print $s "loppu";
+	$s->flush();
+
+	$s->recv($joo, 3);
+	die "Bad joo" if ($joo ne "joo");
+}
+
+# With notifications, every epoch waits for us; let each one go as soon as
+# it is announced, until the program goes away.
+if ($notify) {
+	my $vaihtaa;
+	while ($s->read($vaihtaa, 11) == 11) {
+		die "Expected vaihtaa" if substr($vaihtaa, 0, 7) ne "vaihtaa";
+		print "t[" . unpack("N", substr($vaihtaa, 7)) . "]\n" if $verbose;
+		print $s "jatka";
+		$s->flush();
+	}
+	$s->close();
+	exit 0;
+}
 
 print $s "hei hei";
+$s->flush();
 my $r;
 $s->recv($r, 7);
 $s->close();
@@ -102,7 +140,11 @@ fi_client [options]
 
  Options:
    --addr, -a		Address of Räikkönen scheduler
-   --infile, -i		Bytecode to send
+   --infile, -i		Bytecode to send; may be repeated with --stream
+   --stream, -s		Use the streaming dialect
+   --compact, -c	Bytecode is in the compact dialect
+   --notify, -n		Answer epoch notifications
+   --verbose, -v	Print notified epochs
    --help		Short help message
    --man		Full documentation
 
@@ -112,13 +154,31 @@ fi_client [options]
 
 =item B<--addr>, B<-a>
 
-TCP address of the listener for the server. Specified in full IP:Port form.
+TCP address of the listener for the server. Specified in full IP:Port form,
+or as the path of a local socket.
 
 =item B<--infile>, B<-i>
 
 Path to Finnish bytecode to send to the server. Defaults to a file called
 'out.fi' in the current directory.
 
+=item B<--stream>, B<-s>
+
+Speak the streaming dialect. Every B<--infile> is sent in its own C<ota se>
+request, in order, while the schedule runs. Files after the first should be
+compiled with C<kimi --partial>.
+
+=item B<--compact>, B<-c>
+
+The bytecode was compiled with C<kimi --compact>. May be combined with
+B<--stream>.
+
+=item B<--notify>, B<-n>
+
+The script has C<tn> epochs. Answer each C<vaihtaa> with C<jatka> straight
+away, until the program closes the connection. With B<--verbose>, print each
+epoch as it starts. Can't be combined with B<--stream>.
+
 =item B<--help> and B<--man>
 
 If you need help for these options, you need more help for other things.
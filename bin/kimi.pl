@@ -44,6 +44,8 @@ use constant {
 my $infile = 'in.km';
 my $outfile = 'out.fi';
 
+my $partial = 0;
+my $compact = 0;
 my $help = 0;
 my $man = 0;
 my $verbose = 0;
@@ -51,6 +53,8 @@ my $verbose = 0;
 GetOptions(
 	'infile=s'	=> \$infile,
 	'outfile=s'	=> \$outfile,
+	'partial'	=> \$partial,
+	'compact'	=> \$compact,
 	'help|?'	=> \$help,
 	'man'		=> \$man,
 	'verbose'	=> \$verbose,
@@ -58,6 +62,8 @@ GetOptions(
 pod2usage(1) if $help;
 pod2usage(-exitval => 0, -verbose => 2) if $man;
 
+my $slice_open = 0;
+
 sub parse_file {
 	my $parse_state = STATE_FIND_TIMESLICE;
 	my $states = {};
@@ -116,7 +122,11 @@ sub parse_file {
 				die "Undefined state: $1 on line $lineno" if (!defined $states->{$1});
 
 				my ($start, $end) = get_range($states->{$1}, $2);
-				die "Invalid range: $2 on line $lineno" if (!defined $states->{$1}->{'ranges'}->{"$start-$end"});
+
+				# A continuation may resume a state armed by an earlier part;
+				# the server checks those.
+				die "Invalid range: $2 on line $lineno" if (!defined $states->{$1}->{'ranges'}->{"$start-$end"} and
+					!($partial and $states->{$1}->{'maxtid'} == 0));
 
 				print " --> Handling: resume command\n" if $verbose;
 				write_resume($outfd, $states->{$1}->{'id'}, $start, $end);
@@ -128,15 +138,34 @@ sub parse_file {
 				print " --> Handling: timeout command\n" if $verbose;
 				write_timeout($outfd, $1, $spec);
 				next;
+			} elsif (m/^\s*waitstate\s+(\w+)\[(\d+-\d+|\d+)\]\s*(#|$)/) {
+				die "Undefined state: $1 on line $lineno" if (!defined $states->{$1});
+
+				my ($start, $end) = get_range($states->{$1}, $2);
+				die "Invalid range: $2 on line $lineno" if (!defined $states->{$1}->{'ranges'}->{"$start-$end"} and
+					!($partial and $states->{$1}->{'maxtid'} == 0));
+
+				print " --> Handling: waitstate for range\n" if $verbose;
+				write_waitrange($outfd, $states->{$1}->{'id'}, $start, $end);
+				next;
 			} elsif (m/^\s*waitstate\s*(#|$)/) {
 				print " --> Handling: waitstate\n" if $verbose;
 				write_waitstate($outfd);
 				next;
-			} elsif (m/^\s*when\s+(\w+)\s*(#|$)/) {
+			} elsif (m/^\s*when\s+(\w+)(?:\[key=(\w+|\*)\])?\s*(.*?)\s*(#|$)/) {
 				die "Undefined state: $1 on line $lineno" if (!defined $states->{$1}->{'id'});
+				# key=* counts every key's ordinals separately.
+				my $per_key = defined $2 && $2 eq '*';
+				my $key = defined $2 && !$per_key ? parse_key($2, $lineno) : undef;
+				my $sample = parse_when_sample($3, $lineno);
 				print " --> Handling: when prologue\n" if $verbose;
-				write_when_prologue($outfd, $states->{$1}->{'id'});
+				write_when_prologue($outfd, $states->{$1}->{'id'}, $sample, $key,
+				    $per_key);
 				$curstate = $states->{$1};
+
+				# Each when block arms the state afresh.
+				$curstate->{'maxtid'} = 0;
+				$curstate->{'ranges'} = {};
 				$parse_state = STATE_WHEN_BODY;
 				next;
 			} else {
@@ -146,7 +175,7 @@ sub parse_file {
 		
 		if ($parse_state == STATE_WHEN_BODY) {
 			die "State machine error: no when state found in when body on line $lineno" if !defined $curstate;
-			if (m/^\s*(N|\d+-\d+|\d+):\s*(callback|continue|panic|sleep|wait)\s+(.*?)\s*(#|$)/) {
+			if (m/^\s*(N|\d+-\d+|\d+):\s*(callback|continue|panic|sleep|wait-until|wait|spin|jitter|pin-same|pin-far|pin|evict)\s+(.*?)\s*(#|$)/) {
 				# If we already saw a range to N, we must find an "end" marker next.
 				die "Invalid range specification '$_' on line $lineno" if ($curstate->{'maxtid'} == N_VALUE);
 
@@ -184,7 +213,8 @@ sub parse_file {
 	}
 
 	# Close out final timeslice.
-	print $outfd "\xde\xad\x76\x00";
+	flush_resume($outfd);
+	print $outfd ($compact ? "\x02" : "\xde\xad\x76\x00");
 }
 
 sub get_range {
@@ -196,7 +226,7 @@ sub get_range {
 	if ($range eq 'N') {
 		$start = $state->{'maxtid'} + 1;
 		$end = N_VALUE;
-	} elsif ($range =~ m/'(\d+)-(\d+)'/) {
+	} elsif ($range =~ m/^(\d+)-(\d+)$/) {
 		$start = $1;
 		$end = $2;
 	} else {
@@ -207,15 +237,90 @@ sub get_range {
 	return (int($start), int($end));
 }
 
+# Durations for spin and jitter are in nanoseconds unless given a unit.
+sub get_ns {
+	my $arg = shift;
+
+	die "Invalid duration: $arg" if $arg !~ m/^(\d+)(s|ms|μs|us|ns)?$/;
+	my $spec = $2 || 'ns';
+	my $ns = $1 * ($spec eq 's' ? 1000000000 : $spec eq 'ms' ? 1000000 :
+	    $spec eq 'ns' ? 1 : 1000);
+	die "Duration too long: $arg" if $ns > N_VALUE;
+
+	return $ns;
+}
+
+# Keys are 64-bit, in decimal or hex.
+sub parse_key {
+	my ($key, $lineno) = @_;
+
+	if ($key =~ m/^0x([0-9a-fA-F]{1,16})$/) {
+		return hex($1);
+	}
+	die "Invalid key '$key' on line $lineno" if $key !~ m/^\d+$/ or
+	    $key > 18446744073709551615;
+	return $key + 0;
+}
+
+# A sampling policy follows the state of a when as any of
+# `every K`, `skip M` and `sample P [seed S]`. P is a fraction, and is kept
+# as a threshold out of 2^32.
+sub parse_when_sample {
+	my ($opts, $lineno) = @_;
+
+	return undef if $opts eq '';
+
+	my $sample = { every => 0, skip => 0, p => 0, seed => 0 };
+	my @words = split(/\s+/, $opts);
+	while (@words) {
+		my $opt = shift @words;
+		my $val = shift @words;
+		die "Missing value for '$opt' on line $lineno" if !defined $val;
+
+		if ($opt eq 'every' or $opt eq 'skip' or $opt eq 'seed') {
+			die "Invalid $opt '$val' on line $lineno" if $val !~ m/^\d+$/ or $val >= 2**32;
+			$sample->{$opt} = $val;
+		} elsif ($opt eq 'sample') {
+			die "Invalid probability '$val' on line $lineno" if
+			    $val !~ m/^(\d+(\.\d*)?|\.\d+)$/ or $val <= 0 or $val > 1;
+			# All of them, which needs no draw at all.
+			next if $val == 1;
+			$sample->{'p'} = int($val * 2**32);
+			die "Probability '$val' too small on line $lineno" if $sample->{'p'} == 0;
+		} else {
+			die "Unknown when option '$opt' on line $lineno";
+		}
+	}
+
+	return $sample;
+}
+
 sub parse_when_command {
 	my ($state_table, $command, $arg) = @_;
 
 	my $bc_command = "";
 	my $bc_arg = "";
+	my $value = 0;
+	my $unit = 0;
+	my $b = 0;
+	my $seed = 0;
+	my ($ref_start, $ref_end) = (0, 0);
+
+	# evict on its own continues; after any other action it modifies it.
+	my $evict = 0;
+	if ($command eq 'evict') {
+		die "Invalid evict: $arg" if $arg ne '';
+		$command = 'continue';
+		$evict = 1;
+	} elsif ($arg =~ s/(^|\s+)evict$//) {
+		$evict = 1;
+	}
+
 	if ($command eq 'callback') {
 		die "Invalid callback: $arg" if !defined $state_table->{$arg};
 		$bc_command = pack('n', 0);
-		$bc_arg = $state_table->{$arg}->{'id'};
+		$bc_arg = pack('N', $state_table->{$arg}->{'id'});
+		$value = $state_table->{$arg}->{'id'};
 	} elsif ($command eq 'continue') {
 		$bc_command = pack('n', 1);
 		$bc_arg = "";
@@ -239,23 +344,171 @@ sub parse_when_command {
 		}
 
 		$bc_command = pack('n', 4);
-		$bc_arg = pack("Cn", $spec, $1);
+		$bc_arg = pack("CN", $spec, $1);
+		$unit = $spec;
+		$value = $1;
+	} elsif ($command eq 'wait' and $arg ne '') {
+		# A bounded wait; units as for sleep.
+		die "Invalid wait: $arg" if $arg !~ m/^(\d+)(s|ms|μs|us|ns)?$/;
+		my %units = (s => 0, ms => 1, us => 2, 'μs' => 2, ns => 3);
+		$unit = $units{$2 || 's'};
+		$value = $1;
+		die "Invalid wait: $arg" if $value == 0 or $value > N_VALUE;
+
+		$bc_command = pack('n', 0x200);
+		$bc_arg = pack("CN", $unit, $value);
+		$command = 'wait-for';
 	} elsif ($command eq 'wait') {
 		$bc_command = pack('n', 8);
 		$bc_arg = "";
+	} elsif ($command eq 'spin') {
+		$value = get_ns($arg);
+		$bc_command = pack('n', 0x10);
+		$bc_arg = pack("N", $value);
+	} elsif ($command eq 'jitter') {
+		# jitter uniform MIN MAX [seed N] or jitter exp MEAN [seed N]
+		if ($arg =~ m/^uniform\s+(\S+)\s+(\S+)(\s+seed\s+(\d+))?$/) {
+			$unit = 0;
+			$value = get_ns($1);
+			$b = get_ns($2);
+			die "Empty jitter range: $arg" if $value > $b;
+			$seed = $4 || 0;
+		} elsif ($arg =~ m/^exp\s+(\S+)(\s+seed\s+(\d+))?$/) {
+			$unit = 1;
+			$value = get_ns($1);
+			$seed = $3 || 0;
+		} else {
+			die "Invalid jitter: $arg";
+		}
+
+		$bc_command = pack('n', 0x20);
+		$bc_arg = pack("CNNN", $unit, $value, $b, $seed);
+	} elsif ($command eq 'pin') {
+		die "Invalid CPU: $arg" if $arg !~ m/^(\d+)$/;
+		$value = $1;
+		$bc_command = pack('n', 0x40);
+		$bc_arg = pack("N", $value);
+	} elsif ($command eq 'pin-same' or $command eq 'pin-far') {
+		die "Invalid pin reference: $arg" if $arg !~ m/^(\w+)\[(\d+-\d+|\d+|N)\]$/;
+		die "Undefined state: $1" if !defined $state_table->{$1};
+
+		# The reference must be a range armed by an earlier when block.
+		my $ref = $state_table->{$1};
+		($ref_start, $ref_end) = get_range($ref, $2);
+		die "Invalid range: $2" if (!defined $ref->{'ranges'}->{"$ref_start-$ref_end"} and
+			!($partial and $ref->{'maxtid'} == 0));
+
+		$value = $ref->{'id'};
+		$bc_command = pack('n', $command eq 'pin-same' ? 0x80 : 0x100);
+		$bc_arg = pack("NNN", $value, $ref_start, $ref_end);
+	} elsif ($command eq 'wait-until') {
+		die "Invalid wait-until reference: $arg" if $arg !~ m/^(\w+)\[(\d+-\d+|\d+)\]$/;
+		die "Undefined state: $1" if !defined $state_table->{$1};
+
+		# As for pins, but the range has to end.
+		my $ref = $state_table->{$1};
+		($ref_start, $ref_end) = get_range($ref, $2);
+		die "Invalid range: $2" if (!defined $ref->{'ranges'}->{"$ref_start-$ref_end"} and
+			!($partial and $ref->{'maxtid'} == 0));
+
+		$value = $ref->{'id'};
+		$bc_command = pack('n', 0x400);
+		$bc_arg = pack("NNN", $value, $ref_start, $ref_end);
 	} else {
 		die "Invalid command $command";
 	}
 
+	$bc_command = chr(ord($bc_command) | 0x80) . substr($bc_command, 1) if $evict;
+
 	return {
 		command	=> $bc_command,
 		arg	=> $bc_arg,
+		action	=> $command,
+		unit	=> $unit,
+		value	=> $value,
+		b	=> $b,
+		seed	=> $seed,
+		ref_start => $ref_start,
+		ref_end	=> $ref_end,
+		evict	=> $evict,
 	};
 }
 
+# Compact dialect helpers. Integers are unsigned LEB128.
+my %compact_actions = (
+	callback	=> 0x01,
+	continue	=> 0x02,
+	panic		=> 0x03,
+	sleep		=> 0x04,
+	wait		=> 0x05,
+	spin		=> 0x06,
+	jitter		=> 0x07,
+	pin		=> 0x08,
+	'pin-same'	=> 0x09,
+	'pin-far'	=> 0x0a,
+	'wait-for'	=> 0x0b,
+	'wait-until'	=> 0x0c,
+);
+
+sub uleb {
+	my $v = shift;
+	my $out = "";
+
+	do {
+		my $b = $v & 0x7f;
+		$v >>= 7;
+		$b |= 0x80 if $v;
+		$out .= chr($b);
+	} while ($v);
+
+	return $out;
+}
+
+# Spans count the ordinals in a range; 0 means the range runs to N.
+sub span {
+	my ($start, $end) = @_;
+
+	return $end == N_VALUE ? 0 : $end - $start + 1;
+}
+
+# Consecutive single-ordinal resumes of the same state are sent as one run.
+my $pending_resume = undef;
+
+sub flush_resume {
+	my $fd = shift;
+
+	return if !defined $pending_resume;
+
+	my ($state_id, $start, $end) = @$pending_resume;
+	if ($start == $end) {
+		print $fd "\x04", uleb($state_id), uleb($start), uleb(1);
+	} else {
+		print $fd "\x05", uleb($state_id), uleb($start), uleb($end - $start + 1);
+	}
+	$pending_resume = undef;
+}
+
 sub write_resume {
 	my ($fd, $state_id, $start, $end) = @_;
 
+	if ($compact) {
+		if ($start == $end and $end != N_VALUE) {
+			if (defined $pending_resume and $pending_resume->[0] == $state_id and
+			    $pending_resume->[2] + 1 == $start) {
+				$pending_resume->[2] = $start;
+				return;
+			}
+
+			flush_resume($fd);
+			$pending_resume = [$state_id, $start, $end];
+			return;
+		}
+
+		flush_resume($fd);
+		print $fd "\x04", uleb($state_id), uleb($start), uleb(span($start, $end));
+		return;
+	}
+
 	# Prologue
 	print $fd "\x6a\x04\x61\x00";
 	
@@ -266,8 +519,13 @@ sub write_resume {
 sub write_timeout {
 	my ($fd, $timeout, $spec) = @_;
 
-	# Prologue
-	print $fd "\x75\x6e\x69\x00";
+	if ($compact) {
+		flush_resume($fd);
+		print $fd "\x06";
+	} else {
+		# Prologue
+		print $fd "\x75\x6e\x69\x00";
+	}
 
 	# Unit specifier
 	if ($spec eq 's') {
@@ -281,16 +539,25 @@ sub write_timeout {
 	}
 
 	# Value
-	print $fd pack("N", $timeout);
+	print $fd ($compact ? uleb($timeout) : pack("N", $timeout));
 }
 
 sub write_timeslice {
 	my ($fd, $notify, $slice_id) = @_;
 
-	# Close the preceding timeslice, if it's not the first one.
-	if ($slice_id > 0) {
+	if ($compact) {
+		flush_resume($fd);
+		print $fd "\x02" if $slice_open;
+		$slice_open = 1;
+		print $fd "\x01", uleb($slice_id), (defined $notify ? "\x01" : "\x00");
+		return;
+	}
+
+	# Close the preceding timeslice, if this isn't the first one we write.
+	if ($slice_open) {
 		print $fd "\xde\xad\x76\x00";
 	}
+	$slice_open = 1;
 
 	# Prologue
 	print $fd "\x76\x04\x6c\x00";
@@ -307,23 +574,108 @@ sub write_timeslice {
 sub write_waitstate {
 	my $fd = shift;
 
+	if ($compact) {
+		flush_resume($fd);
+		print $fd "\x07";
+		return;
+	}
+
 	print $fd "\x6f\x05\x61\x00";
 }
 
+sub write_waitrange {
+	my ($fd, $state_id, $start, $end) = @_;
+
+	if ($compact) {
+		flush_resume($fd);
+		print $fd "\x08", uleb($state_id), uleb($start), uleb(span($start, $end));
+		return;
+	}
+
+	print $fd "\x6f\x05\x61\x01";
+	print $fd pack("NNN", $state_id, $start, $end);
+}
+
 sub write_when_prologue {
-	my ($fd, $state_id) = @_;
+	my ($fd, $state_id, $sample, $key, $per_key) = @_;
+
+	my @policy = defined $sample ?
+	    map { $sample->{$_} } qw(every skip p seed) : ();
+	my @key = defined $key ? ($key >> 32, $key & 0xffffffff) : ();
+	my $flags = (@policy ? 0x01 : 0) | (@key ? 0x02 : 0) |
+	    ($per_key ? 0x04 : 0);
+
+	if ($compact) {
+		flush_resume($fd);
+		if ($flags == 0) {
+			print $fd "\x03", uleb($state_id);
+			return;
+		}
+		print $fd "\x09", uleb($state_id), chr($flags);
+		print $fd map { uleb($_) } @policy, reverse @key;
+		return;
+	}
 
 	# Prologue
 	print $fd "\x6a\x6f\x73\x00";
 	# State ID, big endian
 	print $fd pack("N", $state_id);
-	# Epilogue
+	# Flags, then the sampling policy and key if there are any
+	print $fd chr($flags);
+	print $fd pack("N*", @policy, @key);
+}
+
+sub compact_action_args {
+	my $hr = shift;
+
+	return uleb($hr->{'value'}) if $hr->{'action'} eq 'callback';
+	return chr($hr->{'unit'}) . uleb($hr->{'value'}) if $hr->{'action'} =~ m/^(sleep|wait-for)$/;
+	return uleb($hr->{'value'}) if $hr->{'action'} eq 'spin';
+	return chr($hr->{'unit'}) . uleb($hr->{'value'}) . uleb($hr->{'b'}) .
+	    uleb($hr->{'seed'}) if $hr->{'action'} eq 'jitter';
+	return uleb($hr->{'value'}) if $hr->{'action'} eq 'pin';
+	return uleb($hr->{'value'}) . uleb($hr->{'ref_start'}) .
+	    uleb(span($hr->{'ref_start'}, $hr->{'ref_end'})) if $hr->{'action'} =~ m/^(pin-|wait-until)/;
+	return "";
+}
+
+# Ranges are written in order, each relative to the end of the one before.
+# Neighbouring single ordinals with the same action collapse into a run.
+sub write_compact_when_body {
+	my ($fd, $state) = @_;
+
+	my @ranges = sort { $a->{'start'} <=> $b->{'start'} } values %{ $state->{'ranges'} };
+	my $next = 1;
+	while (@ranges) {
+		my $hr = shift @ranges;
+		my $args = compact_action_args($hr);
+		my $end = $hr->{'end'};
+
+		if ($hr->{'start'} == $end) {
+			while (@ranges and $ranges[0]->{'start'} == $end + 1 and
+			    $ranges[0]->{'start'} == $ranges[0]->{'end'} and
+			    $ranges[0]->{'action'} eq $hr->{'action'} and
+			    $ranges[0]->{'evict'} == $hr->{'evict'} and
+			    compact_action_args($ranges[0]) eq $args) {
+				$end = (shift @ranges)->{'end'};
+			}
+		}
+
+		my $op = $compact_actions{$hr->{'action'}};
+		$op |= 0x40 if $hr->{'evict'};
+		$op |= 0x80 if $end != $hr->{'end'};
+		print $fd chr($op), uleb($hr->{'start'} - $next), uleb(span($hr->{'start'}, $end)), $args;
+		$next = $end + 1;
+	}
+
 	print $fd "\x00";
 }
 
 sub write_when_body {
 	my ($fd, $state) = @_;
 
+	return write_compact_when_body($fd, $state) if $compact;
+
 	foreach my $range (sort keys %{ $state->{'ranges'} }) {
 		my $hr = $state->{'ranges'}->{$range};
 		print $fd pack("NN", $hr->{'start'}, $hr->{'end'});
@@ -349,6 +701,8 @@ kimi [options]
  Options:
    --infile, -i		Kimi script to compile
    --outfile, -o	Kimi bytecode output file
+   --partial, -p	Script continues one sent earlier
+   --compact, -c	Emit the compact dialect
    --help		Short help message
    --man		Full documentation
 
@@ -366,6 +720,18 @@ bytecode. Defaults to a file called 'in.km' in the current directory.
 Output file name to store Finnish bytecode. Defaults to a file called
 'out.fi' in the current directory.
 
+=item B<--partial>, B<-p>
+
+The script continues a schedule that is already running, for clients using
+the streaming dialect. Its first epoch does not have to be C<t[0]>, and
+C<resume> may refer to ranges of states armed by an earlier part. State and
+callback definitions still have to be repeated.
+
+=item B<--compact>, B<-c>
+
+Emit bytecode for the compact dialect, which must then be sent with
+C<fi_client --compact>.
+
 =item B<--help> and B<--man>
 
 If you need help for these options, you need more help for other things.
@@ -0,0 +1,286 @@
+#!/usr/bin/env perl
+
+# Copyright (c) 2014 Fastly, Inc.
+# All rights reserved.
+#
+# Author: Devon H. O'Dell <dho@fastly.com>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use strict;
+use warnings;
+
+
+use File::Path qw(remove_tree);
+use FindBin;
+use Getopt::Long;
+use IO::File;
+use IO::Select;
+use IO::Socket::INET;
+use IO::Socket::UNIX;
+use Socket qw(IPPROTO_TCP TCP_NODELAY);
+use Pod::Usage;
+
+my $infile = 'in.km';
+my $workdir;
+my $compact = 0;
+my $timeout = 0;
+my $verbose = 0;
+my $help = 0;
+my $man = 0;
+
+GetOptions(
+	'infile=s'	=> \$infile,
+	'workdir=s'	=> \$workdir,
+	'compact'	=> \$compact,
+	'timeout=i'	=> \$timeout,
+	'verbose'	=> \$verbose,
+	'help|?'	=> \$help,
+	'man'		=> \$man,
+) or pod2usage(2);
+pod2usage(1) if $help;
+pod2usage(-exitval => 0, -verbose => 2) if $man;
+
+# Split the script by process. Every process gets every epoch, so that all
+# of them stop at every boundary; lines go to whichever process the last
+# `on` named.
+my %procs;
+my @order;
+my $cur;
+my $in_when = 0;
+my $n_epochs = 0;
+
+my $infd = new IO::File "< $infile";
+die "Could not open $infile" if !defined $infd;
+
+while (<$infd>) {
+	my $lineno = $.;
+	next if m/^\s*(#|$)/;
+
+	if (m/^\s*process\s+(\w+)\s+(\S+)\s*(#|$)/) {
+		die "process must come before the first epoch on line $lineno" if $n_epochs;
+		die "Process $1 declared twice on line $lineno" if defined $procs{$1};
+		$procs{$1} = { name => $1, addr => $2, text => "" };
+		push @order, $1;
+	} elsif (m/^\s*on\s+(\w+)\s*(#|$)/) {
+		die "on inside a when block on line $lineno" if $in_when;
+		die "Undeclared process $1 on line $lineno" if !defined $procs{$1};
+		$cur = $procs{$1};
+	} elsif (m/^\s*tn?\[(\d+)\]\s*(#|$)/) {
+		die "Epoch out of order on line $lineno" if $1 != $n_epochs;
+		$_->{'text'} .= "tn[$1]\n" for values %procs;
+		$n_epochs++;
+	} else {
+		die "No process selected on line $lineno" if !defined $cur;
+		$in_when = 1 if m/^\s*when\s/;
+		$in_when = 0 if m/^\s*end\s*(#|$)/;
+		$cur->{'text'} .= $_;
+	}
+}
+$infd->close();
+
+die "No processes declared in $infile" if !@order;
+die "No epochs in $infile" if !$n_epochs;
+
+my $own_workdir = !defined $workdir;
+$workdir = "rk_coordinate.$$" if $own_workdir;
+
+# Also when we give up on a process.
+END {
+	remove_tree($workdir) if $own_workdir and defined $workdir;
+}
+
+mkdir $workdir if !-d $workdir;
+die "Could not create $workdir" if !-d $workdir;
+
+for my $name (@order) {
+	my $p = $procs{$name};
+	my $km = "$workdir/$name.km";
+
+	my $fd = new IO::File "> $km";
+	die "Could not open $km" if !defined $fd;
+	print $fd $p->{'text'};
+	$fd->close();
+
+	my @kimi = ($^X, "$FindBin::Bin/kimi.pl", '-i', $km, '-o', "$workdir/$name.fi");
+	push @kimi, '--compact' if $compact;
+	die "kimi failed for process $name" if system(@kimi) != 0;
+
+	local $/;
+	$fd = new IO::File "< $workdir/$name.fi";
+	die "Could not open $workdir/$name.fi" if !defined $fd;
+	$fd->binmode();
+	$p->{'bytecode'} = <$fd>;
+	$fd->close();
+}
+
+sub connect_proc {
+	my ($p) = @_;
+
+	for (1 .. 10) {
+		# Anything with a slash in it is the path of a local socket.
+		my $s = $p->{'addr'} =~ m{/} ?
+		    IO::Socket::UNIX->new(Peer => $p->{'addr'}) :
+		    IO::Socket::INET->new(PeerAddr => $p->{'addr'}, Proto => 'tcp');
+		if (defined $s) {
+			$s->autoflush(1);
+			$s->setsockopt(IPPROTO_TCP, TCP_NODELAY, 1) if $p->{'addr'} !~ m{/};
+			return $s;
+		}
+		sleep 1;
+	}
+
+	die "Couldn't connect to $p->{'name'} at $p->{'addr'}";
+}
+
+# Unbuffered, so that select sees everything that hasn't been read yet.
+sub read_all {
+	my ($s, $len) = @_;
+	my $buf = "";
+
+	while (length($buf) < $len) {
+		my $n = sysread($s, $buf, $len - length($buf), length($buf));
+		last if !$n;
+	}
+
+	return $buf;
+}
+
+sub expect {
+	my ($p, $want) = @_;
+
+	my $got = read_all($p->{'sock'}, length($want));
+	die "$p->{'name'}: expected $want, got '$got'" if $got ne $want;
+}
+
+# Load every process. Each then announces t[0] and waits for us.
+for my $name (@order) {
+	my $p = $procs{$name};
+
+	$p->{'sock'} = connect_proc($p);
+	print { $p->{'sock'} } "hei", pack("n", $compact ? 0x0002 : 0);
+	expect($p, "joo");
+	print { $p->{'sock'} } "ota se", pack("NN", length($p->{'bytecode'}), 0),
+	    $p->{'bytecode'}, "loppu";
+	expect($p, "joo");
+}
+
+# Global epochs: no process starts t[N] until every process has finished
+# t[N-1], so a waitstate in one gates whatever another does next.
+my %by_sock = map { $procs{$_}->{'sock'} => $procs{$_} } @order;
+for my $epoch (0 .. $n_epochs - 1) {
+	my $sel = IO::Select->new(map { $procs{$_}->{'sock'} } @order);
+
+	while ($sel->count()) {
+		my @ready = $sel->can_read($timeout || undef);
+		if (!@ready) {
+			die "Timed out at t[$epoch] waiting for " .
+			    join(", ", map { $by_sock{$_}->{'name'} } $sel->handles()) . "\n";
+		}
+
+		for my $s (@ready) {
+			my $p = $by_sock{$s};
+			my $vaihtaa = read_all($s, 11);
+			die "$p->{'name'} went away before t[$epoch]\n" if length($vaihtaa) != 11;
+			die "$p->{'name'}: expected vaihtaa" if substr($vaihtaa, 0, 7) ne "vaihtaa";
+			die "$p->{'name'} is at t[" . unpack("N", substr($vaihtaa, 7)) .
+			    "], expected t[$epoch]" if unpack("N", substr($vaihtaa, 7)) != $epoch;
+			$sel->remove($s);
+		}
+	}
+
+	print "t[$epoch]\n" if $verbose;
+	print { $procs{$_}->{'sock'} } "jatka" for @order;
+}
+
+$procs{$_}->{'sock'}->close() for @order;
+
+__END__
+
+=head1 NAME
+
+rk_coordinate - Drive one Kimi schedule across several processes
+
+=head1 SYNOPSIS
+
+rk_coordinate [options]
+
+ Options:
+   --infile, -i		Kimi script naming the processes
+   --compact, -c	Use the compact dialect
+   --timeout, -t	Seconds to wait for an epoch before giving up
+   --workdir, -w	Where to keep the per-process scripts
+   --verbose, -v	Print each epoch as it starts
+   --help		Short help message
+   --man		Full documentation
+
+=head1 OPTIONS
+
+=over 8
+
+=item B<--infile>, B<-i>
+
+Kimi script to run. Defaults to 'in.km' in the current directory.
+
+=item B<--compact>, B<-c>
+
+Compile and send the per-process scripts in the compact dialect.
+
+=item B<--timeout>, B<-t>
+
+If some process has not finished an epoch after this many seconds, name the
+processes still running it and exit. By default, wait forever.
+
+=item B<--workdir>, B<-w>
+
+Directory for the per-process scripts and their bytecode. It is kept if
+given; otherwise a temporary one is used and removed afterwards.
+
+=item B<--help> and B<--man>
+
+If you need help for these options, you need more help for other things.
+
+=back
+
+=head1 DESCRIPTION
+
+The script declares each process, with the address its Räikkönen listens on
+(C<IP:Port>, or the path of a local socket), before the first epoch:
+
+    process cache /tmp/cache.sock
+    process origin 127.0.0.1:28807
+
+The rest is ordinary Kimi, except that C<on NAME> says which process the
+lines after it belong to, up to the next C<on>. Defines are given per
+process, since every process numbers its own states.
+
+B<rk_coordinate> compiles a script for each process that has every epoch,
+with notifications, and only its own lines in them. It loads them all, and
+then at every epoch boundary waits for all of the processes to announce the
+epoch before letting any of them start it. A C<waitstate> in one process
+therefore holds back every command in the next epoch, in every process.
+
+=head1 AUTHOR
+
+Devon H. O'Dell <dho@fastly.com>
+
+=cut
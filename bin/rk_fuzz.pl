@@ -0,0 +1,485 @@
+#!/usr/bin/env perl
+
+# Copyright (c) 2014 Fastly, Inc.
+# All rights reserved.
+#
+# Author: Devon H. O'Dell <dho@fastly.com>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use strict;
+use warnings;
+
+use FindBin;
+use Getopt::Long;
+use IO::File;
+use IPC::SysV qw(IPC_PRIVATE IPC_CREAT IPC_RMID);
+use POSIX qw(:sys_wait_h);
+use Pod::Usage;
+use Time::HiRes qw(sleep time);
+
+use lib $FindBin::Bin;
+use KimiScript;
+
+# Must match RK_FUZZ_MAP_SIZE in raikkonen_internal.h.
+use constant MAP_SIZE => 1 << 16;
+
+my @infiles;
+my $outdir = 'fuzz';
+my $command;
+my $match;
+my $jobs = 0;
+my $port = 28806;
+my $timeout = 10;
+my $runs = 0;
+my $compact = 0;
+my $help = 0;
+my $man = 0;
+my $verbose = 0;
+
+GetOptions(
+	'infile=s'	=> \@infiles,
+	'outdir=s'	=> \$outdir,
+	'command|c=s'	=> \$command,
+	'match|m=s'	=> \$match,
+	'jobs=i'	=> \$jobs,
+	'port=i'	=> \$port,
+	'timeout=i'	=> \$timeout,
+	'runs=i'	=> \$runs,
+	'compact'	=> \$compact,
+	'help|?'	=> \$help,
+	'man'		=> \$man,
+	'verbose'	=> \$verbose,
+) or pod2usage(2);
+pod2usage(1) if $help;
+pod2usage(-exitval => 0, -verbose => 2) if $man;
+pod2usage("--command is required") if !defined $command;
+
+@infiles = ('in.km') if !@infiles;
+
+if ($jobs <= 0) {
+	$jobs = `getconf _NPROCESSORS_ONLN 2>/dev/null` || 1;
+	chomp $jobs;
+}
+
+for my $dir ($outdir, "$outdir/queue", "$outdir/crashes", "$outdir/work") {
+	mkdir $dir if !-d $dir;
+	die "Could not create $dir" if !-d $dir;
+}
+
+my $run = {
+	workdir	=> "$outdir/work",
+	command	=> $command,
+	port	=> $port,
+	compact	=> $compact,
+	match	=> $match,
+};
+
+# One coverage map per slot, removed however we exit, along with anything
+# still running.
+my @shm;
+my %running;
+END {
+	kill 'KILL', -$_ for keys %running;
+	shmctl($_, IPC_RMID, 0) for @shm;
+}
+$SIG{'INT'} = $SIG{'TERM'} = sub { exit 1; };
+
+for my $slot (0 .. $jobs - 1) {
+	my $id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | 0600);
+	die "shmget: $!" if !defined $id;
+	push @shm, $id;
+}
+
+# Hit counts are bucketed as in AFL, so that a loop running a few more times
+# is not news but a different order of magnitude is.
+my @bucket = (0, 1, 2, 4, (8) x 4, (16) x 8, (32) x 16, (64) x 96,
+    (128) x 128);
+
+my $virgin = "\xff" x MAP_SIZE;
+my $virgin_crash = "\xff" x MAP_SIZE;
+
+# Fold a run's map into a virgin map, and return how many new bits it had.
+sub new_bits {
+	my ($map, $virgin) = @_;
+	my $new = 0;
+
+	while ($map =~ m/[^\0]/g) {
+		my $i = pos($map) - 1;
+		my $bit = $bucket[ord(substr($map, $i, 1))];
+		my $v = ord(substr($virgin, $i, 1));
+
+		next if !($v & $bit);
+		substr($virgin, $i, 1) = chr($v & ~$bit);
+		$new++;
+	}
+
+	$_[1] = $virgin;
+	return $new;
+}
+
+sub pick {
+	return $_[int(rand(@_))];
+}
+
+# All resume commands, as [ epoch, item ] pairs.
+sub resumes {
+	my ($s) = @_;
+	my @r;
+
+	for my $e (0 .. $#{$s->{'epochs'}}) {
+		my $items = $s->{'epochs'}->[$e]->{'items'};
+		for my $i (0 .. $#$items) {
+			push @r, [ $e, $i ] if !ref $items->[$i] and
+			    $items->[$i] =~ m/^resume\s/;
+		}
+	}
+
+	return @r;
+}
+
+# All when ranges other than N, as [ epoch, item, range ] triples.
+sub ranges {
+	my ($s) = @_;
+	my @r;
+
+	for my $e (0 .. $#{$s->{'epochs'}}) {
+		my $items = $s->{'epochs'}->[$e]->{'items'};
+		for my $i (0 .. $#$items) {
+			next if !ref $items->[$i];
+			my $ranges = $items->[$i]->{'ranges'};
+			for my $r (0 .. $#$ranges) {
+				push @r, [ $e, $i, $r ] if $ranges->[$r] !~ m/^N:/;
+			}
+		}
+	}
+
+	return @r;
+}
+
+# Mutators change a script in place and return false if they found nothing
+# to change.
+my @mutators = (
+	# Swap two resumes, changing the order in which threads are released.
+	sub {
+		my ($s) = @_;
+		my @r = resumes($s);
+		return 0 if @r < 2;
+
+		my ($x, $y) = (pick(@r), pick(@r));
+		my $ia = \$s->{'epochs'}->[$x->[0]]->{'items'}->[$x->[1]];
+		my $ib = \$s->{'epochs'}->[$y->[0]]->{'items'}->[$y->[1]];
+		($$ia, $$ib) = ($$ib, $$ia);
+		return 1;
+	},
+
+	# Scale a sleep or timeout.
+	sub {
+		my ($s) = @_;
+		my @t;
+
+		for my $epoch (@{$s->{'epochs'}}) {
+			for my $item (@{$epoch->{'items'}}) {
+				if (!ref $item) {
+					push @t, \$item if $item =~ m/^timeout\s/;
+					next;
+				}
+				for my $range (@{$item->{'ranges'}}) {
+					push @t, \$range if $range =~ m/:\s*sleep\s/;
+				}
+			}
+		}
+		return 0 if !@t;
+
+		my $t = pick(@t);
+		my $scale = pick(0, 0.5, 2, 10);
+		$$t =~ s/(timeout|sleep)\s+(\d+)/"$1 " . int($2 * $scale)/e;
+		return 1;
+	},
+
+	# Make a range wait, and resume it somewhere after its when block; or
+	# stop it waiting, and drop its resumes.
+	sub {
+		my ($s) = @_;
+		my @r = ranges($s);
+		return 0 if !@r;
+
+		my ($e, $i, $r) = @{pick(@r)};
+		my $when = $s->{'epochs'}->[$e]->{'items'}->[$i];
+		my ($state) = $when->{'head'} =~ m/^when\s+(\w+)/;
+		my ($spec, $action) = $when->{'ranges'}->[$r] =~
+		    m/^(\d+-\d+|\d+):\s*(\w+)/;
+		my $resume = "resume $state\[$spec\]";
+
+		if ($action eq 'wait') {
+			$when->{'ranges'}->[$r] = "$spec: continue";
+			for my $epoch (@{$s->{'epochs'}}) {
+				@{$epoch->{'items'}} = grep {
+					ref $_ or $_ !~ m/^\Q$resume\E\s*(#|$)/
+				} @{$epoch->{'items'}};
+			}
+			return 1;
+		}
+
+		$when->{'ranges'}->[$r] = "$spec: wait";
+
+		my @after = map { [ $e, $_ ] }
+		    ($i + 1 .. @{$s->{'epochs'}->[$e]->{'items'}});
+		for my $f ($e + 1 .. $#{$s->{'epochs'}}) {
+			push @after, map { [ $f, $_ ] }
+			    (0 .. @{$s->{'epochs'}->[$f]->{'items'}});
+		}
+
+		my ($f, $at) = @{pick(@after)};
+		splice @{$s->{'epochs'}->[$f]->{'items'}}, $at, 0, $resume;
+		return 1;
+	},
+
+	# Move a resume to another place in its epoch or a later one.
+	sub {
+		my ($s) = @_;
+		my @r = resumes($s);
+		return 0 if !@r;
+
+		my ($e, $i) = @{pick(@r)};
+		my ($resume) = splice @{$s->{'epochs'}->[$e]->{'items'}}, $i, 1;
+		my $f = $e + int(rand(@{$s->{'epochs'}} - $e));
+		my $at = int(rand(@{$s->{'epochs'}->[$f]->{'items'}} + 1));
+		splice @{$s->{'epochs'}->[$f]->{'items'}}, $at, 0, $resume;
+		return 1;
+	},
+);
+
+sub mutate {
+	my ($script) = @_;
+	my $s = copy_script($script);
+	my $n = 1 + int(rand(4));
+
+	for (1 .. 16) {
+		last if $n == 0;
+		$n-- if pick(@mutators)->($s);
+	}
+
+	return $s;
+}
+
+my @queue = map { parse_script($_) } @infiles;
+my ($n_runs, $n_queued, $n_crashes, $n_hangs) = (0, 0, 0, 0);
+my $last_status = 0;
+
+sub save {
+	my ($dir, $n, $text) = @_;
+
+	my $fd = new IO::File "> $outdir/$dir/$n.km";
+	die "Could not write $outdir/$dir/$n.km" if !defined $fd;
+	print $fd $text;
+	$fd->close();
+}
+
+sub status {
+	my $edges = ($virgin =~ tr/\xff//c);
+
+	printf "%u runs, %u queued, %u crashes, %u hangs, %u map bytes hit\n",
+	    $n_runs, scalar(@queue), $n_crashes, $n_hangs, $edges;
+}
+
+# Seeds run first, unmutated, so that their coverage is the baseline.
+my @seeds = @queue;
+
+while (1) {
+	while (keys(%running) < $jobs and ($runs == 0 or $n_runs < $runs)) {
+		my %busy = map { $_->{'slot'} => 1 } values %running;
+		my ($slot) = grep { !$busy{$_} } 0 .. $jobs - 1;
+
+		my $s = @seeds ? shift @seeds : mutate(pick(@queue));
+		my $text = format_script($s);
+
+		shmwrite($shm[$slot], "\0" x MAP_SIZE, 0, MAP_SIZE) or
+		    die "shmwrite: $!";
+		my $pid = candidate_spawn($run, $slot, $text,
+		    RK_FUZZ_SHM => $shm[$slot]);
+		$running{$pid} = {
+			slot		=> $slot,
+			script		=> $s,
+			text		=> $text,
+			deadline	=> time() + $timeout,
+		};
+		$n_runs++;
+	}
+
+	last if !%running;
+
+	my $reaped = 0;
+	for my $pid (keys %running) {
+		my $r = $running{$pid};
+		my $done = waitpid($pid, WNOHANG);
+		my $status = $?;
+
+		if ($done == 0 and time() >= $r->{'deadline'}) {
+			kill 'KILL', -$pid;
+			waitpid($pid, 0);
+			$status = -1;
+			$done = $pid;
+		}
+		next if $done == 0;
+
+		kill 'KILL', -$pid;
+		delete $running{$pid};
+		$reaped++;
+
+		if ($status == -1) {
+			$n_hangs++;
+			next;
+		}
+		next if ($status >> 8) == INVALID and !($status & 127);
+
+		my $map;
+		shmread($shm[$r->{'slot'}], $map, 0, MAP_SIZE) or
+		    die "shmread: $!";
+
+		# Keep a crash only if it got somewhere no earlier crash did.
+		if (candidate_fails($run, $r->{'slot'}, $status)) {
+			if (new_bits($map, $virgin_crash)) {
+				save('crashes', $n_crashes++, $r->{'text'});
+				print "Crash saved as $outdir/crashes/" .
+				    ($n_crashes - 1) . ".km\n";
+			}
+			next;
+		}
+
+		if (new_bits($map, $virgin)) {
+			push @queue, $r->{'script'};
+			save('queue', $n_queued++, $r->{'text'});
+		}
+	}
+
+	sleep 0.05 if !$reaped;
+
+	if ($reaped and ($verbose or time() - $last_status >= 10)) {
+		status();
+		$last_status = time();
+	}
+}
+
+status();
+
+__END__
+
+=head1 NAME
+
+rk_fuzz - Coverage-guided fuzzing of Räikkönen schedules
+
+=head1 SYNOPSIS
+
+rk_fuzz --command CMD [options]
+
+ Options:
+   --infile, -i		Seed Kimi script; may be repeated
+   --outdir, -o		Directory for the queue and crashes
+   --command, -c	Shell command that runs one schedule
+   --match, -m		Only count failures whose output matches this
+   --jobs, -j		Schedules to run at once
+   --port, -p		First port for %p
+   --timeout, -t	Seconds before a run is killed as a hang
+   --runs, -r		Stop after this many runs
+   --compact		Compile schedules with kimi --compact
+   --help		Short help message
+   --man		Full documentation
+
+=head1 OPTIONS
+
+=over 8
+
+=item B<--infile>, B<-i>
+
+Kimi script to start from. May be given more than once. Defaults to 'in.km'
+in the current directory. Seeds should arm the states of interest, even if
+only with C<N: continue>, so that ordinals are seen.
+
+=item B<--outdir>, B<-o>
+
+Directory in which schedules that reached new edges are saved under
+'queue', failing schedules under 'crashes', and the files of running
+schedules under 'work'. Defaults to 'fuzz'.
+
+=item B<--command>, B<-c>
+
+Shell command that runs the program under test against one schedule and
+exits non-zero if it failed, with the same substitutions as B<rk_minimize>:
+%k for the Kimi script, %f for its bytecode, %p for a port of its own and %%
+for a literal %. The program must be built with the library and run in the
+foreground, for example
+
+    ../bin/fi_client.pl -a 127.0.0.1:%p -i %f & exec ./test %p
+
+=item B<--match>, B<-m>
+
+Perl regular expression that the combined output of a failing run must
+match. Other failures are neither saved nor queued.
+
+=item B<--jobs>, B<-j>
+
+Number of schedules to run in parallel. Defaults to the number of online
+CPUs.
+
+=item B<--port>, B<-p>
+
+Runs get consecutive ports starting at this one. Defaults to 28806.
+
+=item B<--timeout>, B<-t>
+
+Runs still going after this many seconds are killed and counted as hangs.
+Defaults to 10.
+
+=item B<--runs>, B<-r>
+
+Stop after this many runs. By default, runs until interrupted.
+
+=item B<--compact>
+
+Compile schedules with C<kimi --compact>.
+
+=item B<--help> and B<--man>
+
+If you need help for these options, you need more help for other things.
+
+=back
+
+=head1 DESCRIPTION
+
+Each run gets a SysV shared memory segment whose ID is passed to the program
+in C<RK_FUZZ_SHM>. The library counts, for every thread, each edge from the
+state it entered last to the state it enters now, including a bucket of the
+ordinal it took. B<rk_fuzz> first runs the seeds, then repeatedly picks a
+queued schedule and mutates it a few times: swapping or moving resumes,
+scaling sleeps and timeouts, and making ranges wait (with a resume placed
+at random after them) or stop waiting. Schedules that hit an edge, or an
+edge count bucket, that no earlier run did are queued and saved.
+
+Crashes are saved only if they reached new edges among crashes. Pass them
+to B<rk_minimize> before filing them.
+
+=head1 AUTHOR
+
+Devon H. O'Dell <dho@fastly.com>
+
+=cut
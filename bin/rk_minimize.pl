@@ -0,0 +1,432 @@
+#!/usr/bin/env perl
+
+# Copyright (c) 2014 Fastly, Inc.
+# All rights reserved.
+#
+# Author: Devon H. O'Dell <dho@fastly.com>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use strict;
+use warnings;
+
+use File::Path qw(remove_tree);
+use FindBin;
+use Getopt::Long;
+use IO::File;
+use POSIX qw(:sys_wait_h);
+use Pod::Usage;
+use Time::HiRes qw(sleep time);
+
+use lib $FindBin::Bin;
+use KimiScript;
+
+my $infile = 'in.km';
+my $outfile = 'min.km';
+my $command;
+my $match;
+my $jobs = 0;
+my $port = 28806;
+my $timeout = 60;
+my $compact = 0;
+my $workdir;
+my $help = 0;
+my $man = 0;
+my $verbose = 0;
+
+GetOptions(
+	'infile=s'	=> \$infile,
+	'outfile=s'	=> \$outfile,
+	'command|c=s'	=> \$command,
+	'match|m=s'	=> \$match,
+	'jobs=i'	=> \$jobs,
+	'port=i'	=> \$port,
+	'timeout=i'	=> \$timeout,
+	'compact'	=> \$compact,
+	'workdir=s'	=> \$workdir,
+	'help|?'	=> \$help,
+	'man'		=> \$man,
+	'verbose'	=> \$verbose,
+) or pod2usage(2);
+pod2usage(1) if $help;
+pod2usage(-exitval => 0, -verbose => 2) if $man;
+pod2usage("--command is required") if !defined $command;
+
+if ($jobs <= 0) {
+	$jobs = `getconf _NPROCESSORS_ONLN 2>/dev/null` || 1;
+	chomp $jobs;
+}
+
+my $own_workdir = !defined $workdir;
+if ($own_workdir) {
+	$workdir = "rk_minimize.$$";
+}
+mkdir $workdir if !-d $workdir;
+die "Could not create $workdir" if !-d $workdir;
+
+my $run = {
+	workdir	=> $workdir,
+	command	=> $command,
+	port	=> $port,
+	compact	=> $compact,
+	match	=> $match,
+};
+
+# Merge range $i of a when block into the range after it, so that the ordinals
+# it covered get the next range's action instead.
+sub merge_range {
+	my ($when, $i) = @_;
+	my $ranges = $when->{'ranges'};
+
+	my ($start) = $ranges->[$i] =~ m/^(N|\d+)/;
+	if ($ranges->[$i + 1] =~ m/^(\d+-)?(\d+):(.*)$/) {
+		$ranges->[$i + 1] = "$start-$2:$3";
+	}
+
+	# A following N range starts wherever the previous one ends anyway.
+	splice @$ranges, $i, 1;
+}
+
+# Each reduction lists its units for the current script and builds a smaller
+# script with a set of them removed. Units are ordered so that removing a set
+# from last to first leaves the indices of the rest valid.
+my @reductions = (
+	{
+		name	=> 'epochs',
+		units	=> sub {
+			my ($s) = @_;
+			return @{$s->{'epochs'}} > 1 ? (0 .. $#{$s->{'epochs'}}) : ();
+		},
+		apply	=> sub {
+			my ($s, @units) = @_;
+			return undef if @units == @{$s->{'epochs'}};
+			splice @{$s->{'epochs'}}, $_, 1 for reverse @units;
+			return $s;
+		},
+	},
+	{
+		name	=> 'epoch merges',
+		units	=> sub {
+			my ($s) = @_;
+			return (1 .. $#{$s->{'epochs'}});
+		},
+		apply	=> sub {
+			my ($s, @units) = @_;
+			for my $i (reverse @units) {
+				my ($epoch) = splice @{$s->{'epochs'}}, $i, 1;
+				push @{$s->{'epochs'}->[$i - 1]->{'items'}},
+				    @{$epoch->{'items'}};
+			}
+			return $s;
+		},
+	},
+	{
+		name	=> 'commands',
+		units	=> sub {
+			my ($s) = @_;
+			my @units;
+			for my $e (0 .. $#{$s->{'epochs'}}) {
+				my $items = $s->{'epochs'}->[$e]->{'items'};
+				for my $i (0 .. $#$items) {
+					next if !ref $items->[$i] and
+					    $items->[$i] =~ m/^define\s/;
+					push @units, [ $e, $i ];
+				}
+			}
+			return @units;
+		},
+		apply	=> sub {
+			my ($s, @units) = @_;
+			for my $u (reverse @units) {
+				splice @{$s->{'epochs'}->[$u->[0]]->{'items'}},
+				    $u->[1], 1;
+			}
+			return $s;
+		},
+	},
+	{
+		name	=> 'ranges',
+		units	=> sub {
+			my ($s) = @_;
+			my @units;
+			for my $e (0 .. $#{$s->{'epochs'}}) {
+				my $items = $s->{'epochs'}->[$e]->{'items'};
+				for my $i (0 .. $#$items) {
+					next if !ref $items->[$i];
+					my $n = @{$items->[$i]->{'ranges'}};
+					push @units, [ $e, $i, $_ ] for 0 .. $n - 2;
+				}
+			}
+			return @units;
+		},
+		apply	=> sub {
+			my ($s, @units) = @_;
+			for my $u (reverse @units) {
+				merge_range($s->{'epochs'}->[$u->[0]]->{'items'}->[$u->[1]],
+				    $u->[2]);
+			}
+			return $s;
+		},
+	},
+);
+
+# Run candidates, up to $jobs at a time, and return the index of the first
+# one in order that still fails, or -1.
+sub run_batch {
+	my @texts = @_;
+	my (%running, @status);
+	my $next = 0;
+
+	while ($next < @texts or %running) {
+		while ($next < @texts and keys(%running) < $jobs) {
+			my %busy = map { $_->{'slot'} => 1 } values %running;
+			my ($slot) = grep { !$busy{$_} } 0 .. $jobs - 1;
+
+			my $pid = candidate_spawn($run, $slot, $texts[$next]);
+			$running{$pid} = {
+				slot		=> $slot,
+				index		=> $next,
+				deadline	=> time() + $timeout,
+			};
+			$next++;
+		}
+
+		my $reaped = 0;
+		for my $pid (keys %running) {
+			my $r = $running{$pid};
+			my $done = waitpid($pid, WNOHANG);
+			my $status = $?;
+
+			if ($done == 0 and time() >= $r->{'deadline'}) {
+				kill 'KILL', -$pid;
+				waitpid($pid, 0);
+				$status = -1;
+				$done = $pid;
+			}
+			next if $done == 0;
+
+			# Don't leave the program under test behind for the next
+			# candidate on this port.
+			kill 'KILL', -$pid;
+			$status[$r->{'index'}] =
+			    candidate_fails($run, $r->{'slot'}, $status);
+			delete $running{$pid};
+			$reaped++;
+		}
+
+		sleep 0.05 if !$reaped;
+
+		# Candidates after a failure only matter if an earlier one is
+		# still running.
+		for my $i (0 .. $#texts) {
+			last if !defined $status[$i];
+			if ($status[$i]) {
+				my @later = grep { $running{$_}->{'index'} > $i }
+				    keys %running;
+				for my $pid (@later) {
+					kill 'KILL', -$pid;
+					waitpid($pid, 0);
+					delete $running{$pid};
+				}
+				$next = @texts;
+				last;
+			}
+		}
+	}
+
+	for my $i (0 .. $#texts) {
+		return $i if $status[$i];
+	}
+	return -1;
+}
+
+# Delta debugging over the units of one reduction: try removing large chunks
+# first, halving the chunk size whenever no candidate at a size still fails.
+sub reduce {
+	my ($script, $red) = @_;
+	my $progress = 0;
+
+	REDUCE: {
+		my @units = $red->{'units'}->($script);
+		my $size = int((@units + 1) / 2);
+
+		while ($size >= 1 and @units) {
+			my (@cands, @texts);
+			for (my $i = 0; $i < @units; $i += $size) {
+				my $last = $i + $size - 1;
+				$last = $#units if $last > $#units;
+
+				my $c = $red->{'apply'}->(copy_script($script),
+				    @units[$i .. $last]);
+				next if !defined $c;
+				push @cands, $c;
+				push @texts, format_script($c);
+			}
+
+			my $found = @texts ? run_batch(@texts) : -1;
+			if ($found >= 0) {
+				$script = $cands[$found];
+				$progress = 1;
+				printf "Removed %s: %u lines left\n", $red->{'name'},
+				    count_lines($script) if $verbose;
+				redo REDUCE;
+			}
+
+			$size = int($size / 2);
+		}
+	}
+
+	return ($script, $progress);
+}
+
+my $script = parse_script($infile);
+my $start = count_lines($script);
+
+die "$infile does not fail as given" if run_batch(format_script($script)) != 0;
+
+my $progress;
+do {
+	$progress = 0;
+	for my $red (@reductions) {
+		my $p;
+		($script, $p) = reduce($script, $red);
+		$progress ||= $p;
+	}
+} while ($progress);
+
+my $outfd = new IO::File "> $outfile";
+die "Could not open $outfile" if !defined $outfd;
+print $outfd format_script($script);
+$outfd->close();
+
+printf "%s: %u lines, down from %u\n", $outfile, count_lines($script), $start;
+
+remove_tree($workdir) if $own_workdir;
+
+__END__
+
+=head1 NAME
+
+rk_minimize - Shrink a failing Kimi schedule
+
+=head1 SYNOPSIS
+
+rk_minimize --command CMD [options]
+
+ Options:
+   --infile, -i		Failing Kimi script
+   --outfile, -o	Where to write the reduced script
+   --command, -c	Shell command that runs one candidate
+   --match, -m		Only count failures whose output matches this
+   --jobs, -j		Candidates to run at once
+   --port, -p		First port for %p
+   --timeout, -t	Seconds before a candidate is killed
+   --compact		Compile candidates with kimi --compact
+   --workdir, -w	Directory for candidate files
+   --help		Short help message
+   --man		Full documentation
+
+=head1 OPTIONS
+
+=over 8
+
+=item B<--infile>, B<-i>
+
+Kimi script that reproduces the failure. Defaults to 'in.km' in the current
+directory.
+
+=item B<--outfile>, B<-o>
+
+Path of the reduced script. Defaults to 'min.km' in the current directory.
+
+=item B<--command>, B<-c>
+
+Shell command that runs the program under test against one candidate and
+exits non-zero if it failed. The following are replaced before it is run:
+
+    %k	the candidate Kimi script
+    %f	the candidate compiled by kimi
+    %p	a TCP port that no other running candidate is using
+    %%	a literal %
+
+Run the program itself in the foreground so that its exit status is the
+command's, for example
+
+    ../bin/fi_client.pl -a 127.0.0.1:%p -i %f & exec ./test %p
+
+=item B<--match>, B<-m>
+
+Perl regular expression that the combined output of a failing candidate must
+match. Without it, any failure counts, including a different crash or the
+watchdog firing on a schedule that was cut too far.
+
+=item B<--jobs>, B<-j>
+
+Number of candidates to run in parallel. Defaults to the number of online
+CPUs.
+
+=item B<--port>, B<-p>
+
+Candidates get consecutive ports starting at this one. Defaults to 28806.
+
+=item B<--timeout>, B<-t>
+
+Candidates still running after this many seconds are killed and count as
+passing. Defaults to 60.
+
+=item B<--compact>
+
+Compile candidates with C<kimi --compact>, for programs whose server
+expects the compact dialect.
+
+=item B<--workdir>, B<-w>
+
+Directory for candidate scripts, bytecode and output. If given, the last
+candidate run in each slot is left there. By default, a directory called
+'rk_minimize.PID' is created in the current directory and removed once the
+reduced script is written.
+
+=item B<--help> and B<--man>
+
+If you need help for these options, you need more help for other things.
+
+=back
+
+=head1 DESCRIPTION
+
+B<rk_minimize> runs delta debugging over a Kimi script. It tries, in turn,
+dropping whole epochs, merging an epoch into the one before it, dropping
+C<when>, C<resume>, C<timeout> and C<waitstate> commands, and merging a
+C<when> range into the range after it. Each kind of reduction first tries
+removing large chunks at once and halves the chunk size when nothing fails.
+Candidates run in parallel, and the first one in order that still fails is
+kept. Candidates that kimi rejects are skipped. This repeats until no
+reduction makes progress.
+
+Comments and blank lines are dropped from the output, but comments at the end
+of a command line are kept.
+
+=head1 AUTHOR
+
+Devon H. O'Dell <dho@fastly.com>
+
+=cut
@@ -0,0 +1,184 @@
+#!/usr/bin/env perl
+
+# Copyright (c) 2014 Fastly, Inc.
+# All rights reserved.
+#
+# Author: Devon H. O'Dell <dho@fastly.com>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use strict;
+use warnings;
+
+use Getopt::Long;
+use IO::File;
+use Pod::Usage;
+
+use constant {
+	HEADER_SIZE	=> 24,
+	NAME_SIZE	=> 64,
+	ENTRY_SIZE	=> 24,
+};
+
+my $infile = 'raikkonen.rec';
+my $outfile = 'replay.km';
+my $help = 0;
+my $man = 0;
+
+GetOptions(
+	'infile=s'	=> \$infile,
+	'outfile=s'	=> \$outfile,
+	'help|?'	=> \$help,
+	'man'		=> \$man,
+) or pod2usage(2);
+pod2usage(1) if $help;
+pod2usage(-exitval => 0, -verbose => 2) if $man;
+
+my $infd = new IO::File "< $infile";
+die "Could not open $infile" if !defined $infd;
+$infd->binmode();
+
+my $hdr;
+die "Short record log" if $infd->read($hdr, HEADER_SIZE) != HEADER_SIZE;
+
+# The log is a memory image of the recording process, so it is in host order.
+my ($magic, $n_states, $n_entries, $seq) = unpack("a8 L L Q", $hdr);
+die "$infile is not a Räikkönen record log" if $magic ne "rkrec001";
+
+my @names;
+for (1 .. $n_states) {
+	my $name;
+	$infd->read($name, NAME_SIZE);
+	$name =~ s/\0.*//s;
+	push @names, $name;
+}
+
+if ($seq > $n_entries) {
+	warn "$infile: log filled up; only the first $n_entries of $seq " .
+	    "entries were recorded\n";
+	$seq = $n_entries;
+}
+
+# An entry that was claimed but not finished when the program died is the
+# end of the log.
+my @events;
+for my $i (0 .. $seq - 1) {
+	my $entry;
+	last if $infd->read($entry, ENTRY_SIZE) != ENTRY_SIZE;
+
+	my ($eseq, $state, $ordinal, $tid, $epoch) = unpack("Q L L L L", $entry);
+	last if $eseq != $i + 1;
+
+	push @events, {
+		state	=> $state,
+		ordinal	=> $ordinal,
+		tid	=> $tid,
+		epoch	=> $epoch,
+	};
+}
+
+# In the replay every state is armed once, so the k-th recorded entry into a
+# state becomes ordinal k, whichever install it happened under.
+my %count;
+for my $ev (@events) {
+	$ev->{'replay'} = ++$count{$ev->{'state'}};
+}
+
+my $outfd = new IO::File "> $outfile";
+die "Could not open $outfile" if !defined $outfd;
+
+print $outfd "# Replays " . scalar(@events) . " state entries recorded in $infile.\n";
+print $outfd "# Threads pass through states in exactly the recorded order; any\n";
+print $outfd "# entries past the recording continue freely.\n";
+for my $id (0 .. $#names) {
+	print $outfd "define $names[$id] $id\n";
+}
+
+print $outfd "\nt[0]\n";
+for my $id (sort { $a <=> $b } keys %count) {
+	print $outfd "\twhen $names[$id]\n";
+	print $outfd "\t\t$_: wait\n" for 1 .. $count{$id};
+	print $outfd "\t\tN: continue\n";
+	print $outfd "\tend\n";
+}
+
+print $outfd "\nt[1]\n";
+for my $ev (@events) {
+	my $name = $names[$ev->{'state'}];
+	my $k = $ev->{'replay'};
+
+	printf $outfd "\twaitstate %s[%u]\t# tid %u, epoch %u, ordinal %u\n",
+	    $name, $k, $ev->{'tid'}, $ev->{'epoch'}, $ev->{'ordinal'};
+	print $outfd "\tresume $name\[$k\]\n";
+}
+
+$outfd->close();
+
+__END__
+
+=head1 NAME
+
+rk_replay - Turn a Räikkönen record log into a Kimi schedule
+
+=head1 SYNOPSIS
+
+rk_replay [options]
+
+ Options:
+   --infile, -i		Record log written by rk_record
+   --outfile, -o	Kimi script to write
+   --help		Short help message
+   --man		Full documentation
+
+=head1 OPTIONS
+
+=over 8
+
+=item B<--infile>, B<-i>
+
+Path of the log passed to C<rk_record>. Defaults to 'raikkonen.rec' in the
+current directory.
+
+=item B<--outfile>, B<-o>
+
+Kimi script to write. Defaults to 'replay.km' in the current directory.
+
+=item B<--help> and B<--man>
+
+If you need help for these options, you need more help for other things.
+
+=back
+
+=head1 DESCRIPTION
+
+A record log lists, in global order, every time a thread took an ordinal in
+an armed state. B<rk_replay> writes a schedule that arms each of those states
+with a C<wait> for every recorded entry, and then releases them one at a time
+in the recorded order, waiting for each to arrive first. Running the program
+again under this schedule forces the same order of threads through those
+states. The thread and ordinal of each original entry are kept in comments.
+
+=head1 AUTHOR
+
+Devon H. O'Dell <dho@fastly.com>
+
+=cut
@@ -0,0 +1,183 @@
+#!/usr/bin/env perl
+
+# Copyright (c) 2014 Fastly, Inc.
+# All rights reserved.
+#
+# Author: Devon H. O'Dell <dho@fastly.com>
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+
+use strict;
+use warnings;
+
+use Getopt::Long;
+use IO::Socket::UNIX;
+use Pod::Usage;
+use Socket;
+
+my $path = 'raikkonen.sock';
+my $once = 0;
+my $help = 0;
+my $man = 0;
+
+GetOptions(
+	'path=s'	=> \$path,
+	'once'		=> \$once,
+	'help|?'	=> \$help,
+	'man'		=> \$man,
+) or pod2usage(2);
+pod2usage(1) if $help;
+pod2usage(-exitval => 0, -verbose => 2) if $man;
+
+# The socket only appears once the program has loaded its schedule.
+my $s;
+for my $try (0 .. 50) {
+	$s = IO::Socket::UNIX->new(
+		Type	=> SOCK_STREAM,
+		Peer	=> $path,
+	);
+	last if defined $s;
+	select(undef, undef, undef, 0.1);
+}
+die "Couldn't connect to $path: $!" if !defined $s;
+
+sub read_exactly {
+	my ($len) = @_;
+	my $buf = "";
+
+	while (length($buf) < $len) {
+		my $r = $s->sysread($buf, $len - length($buf), length($buf));
+		die "Telemetry connection closed" if !$r;
+	}
+
+	return $buf;
+}
+
+my @names;
+my $last = "";
+
+while (1) {
+	my ($type, $len) = unpack("CN", read_exactly(5));
+	my $frame = read_exactly($len);
+
+	if ($type == 0x00) {
+		my $n = unpack("N", $frame);
+		my $off = 4;
+
+		@names = ();
+		for (1 .. $n) {
+			my $nl = unpack("n", substr($frame, $off, 2));
+			push @names, substr($frame, $off + 2, $nl);
+			$off += 2 + $nl;
+		}
+		next;
+	} elsif ($type != 0x01) {
+		die "Unknown telemetry frame type $type";
+	}
+
+	my ($epoch, $cmd, $threads, $blocked, $n) = unpack("N5", $frame);
+	my $off = 20;
+	my $out = "";
+
+	for my $i (0 .. $n - 1) {
+		my ($entered, $nr) = unpack("NN", substr($frame, $off, 8));
+		$off += 8;
+
+		my $name = $names[$i] // "state $i";
+		next if $nr == 0;
+
+		$out .= sprintf("  %-24s %u entered\n", $name, $entered);
+		for (1 .. $nr) {
+			my ($start, $end, $parked) = unpack("N3", substr($frame, $off, 12));
+			$off += 12;
+
+			$end = "N" if $end == 0xffffffff;
+			$out .= sprintf("    [%u-%s]%s\n", $start, $end,
+			    $parked ? " $parked parked" : "");
+		}
+	}
+
+	# Fields added since are appended after the states.
+	my ($wakeups, $mean, $max) = (0, 0, 0);
+	($wakeups, $mean, $max) = unpack("N3", substr($frame, $off, 12))
+	    if length($frame) >= $off + 12;
+	$out = "  scheduler woken $wakeups times, mean ${mean}ns, " .
+	    "max ${max}ns\n$out" if $wakeups;
+	$out = "epoch $epoch, command $cmd, $blocked/$threads threads " .
+	    "blocked\n$out";
+
+	# Only print when something changed, so a stuck schedule stays on screen.
+	if ($out ne $last) {
+		print $out, "\n";
+		$last = $out;
+	}
+
+	last if $once;
+}
+
+__END__
+
+=head1 NAME
+
+rk_top - Watch a running Räikkönen schedule
+
+=head1 SYNOPSIS
+
+rk_top [options]
+
+ Options:
+   --path, -p		Telemetry socket of the program under test
+   --once, -o		Print one sample and exit
+   --help		Short help message
+   --man		Full documentation
+
+=head1 OPTIONS
+
+=over 8
+
+=item B<--path>, B<-p>
+
+Path of the AF_UNIX socket passed to C<rk_telemetry>. Defaults to
+'raikkonen.sock' in the current directory.
+
+=item B<--once>, B<-o>
+
+Print the first sample received and exit instead of following the run.
+
+=item B<--help> and B<--man>
+
+If you need help for these options, you need more help for other things.
+
+=back
+
+=head1 DESCRIPTION
+
+Connects to the telemetry socket of a program running a Räikkönen schedule
+and prints the current epoch and command, and for every armed state how many
+threads have entered it and how many are parked in each range. A sample is
+only printed when it differs from the previous one.
+
+=head1 AUTHOR
+
+Devon H. O'Dell <dho@fastly.com>
+
+=cut
@@ -30,7 +30,12 @@
 #ifndef _FINNISH_H_
 #define _FINNISH_H_
 
-#define FI_DIALECT	0x0000
+#define FI_DIALECT		0x0000
+#define FI_DIALECT_STREAM	0x0001
+#define FI_DIALECT_COMPACT	0x0002
+
+/* How many epochs a streaming client may be ahead of the scheduler. */
+#define FI_STREAM_WINDOW	4
 
 struct fi_packet_hei {
 	uint8_t		prologue[3];
@@ -58,11 +63,29 @@ struct fi_bytecode_timeslice {
 #define FI_BYTECODE_WHEN	"\x6a\x6f\x73\x00"
 #define FI_BYTECODE_WHEN_END	"\xde\xad\x6a\x00"
 
+/* Flags in the byte after the state ID of a when. */
+#define FI_BYTECODE_WHEN_SAMPLE	0x01
+#define FI_BYTECODE_WHEN_KEY	0x02
+#define FI_BYTECODE_WHEN_PER_KEY	0x04
+
 #define FI_BYTECODE_WHENCMD_CALLBACK	"\x00\x00"
 #define FI_BYTECODE_WHENCMD_CONTINUE	"\x00\x01"
 #define FI_BYTECODE_WHENCMD_PANIC	"\x00\x02"
 #define FI_BYTECODE_WHENCMD_SLEEP	"\x00\x04"
 #define FI_BYTECODE_WHENCMD_WAIT	"\x00\x08"
+#define FI_BYTECODE_WHENCMD_SPIN	"\x00\x10"
+#define FI_BYTECODE_WHENCMD_JITTER	"\x00\x20"
+#define FI_BYTECODE_WHENCMD_PIN		"\x00\x40"
+#define FI_BYTECODE_WHENCMD_PIN_SAME	"\x00\x80"
+#define FI_BYTECODE_WHENCMD_PIN_FAR	"\x01\x00"
+#define FI_BYTECODE_WHENCMD_WAIT_FOR	"\x02\x00"
+#define FI_BYTECODE_WHENCMD_WAIT_UNTIL	"\x04\x00"
+
+/* Set in the first byte of any command to evict the caller's data after it. */
+#define FI_BYTECODE_WHENCMD_EVICT	0x80
+
+#define FI_BYTECODE_JITTER_UNIFORM	0
+#define FI_BYTECODE_JITTER_EXP		1
 
 #define FI_BYTECODE_UNIT_SECOND		0
 #define FI_BYTECODE_UNIT_MILLISECOND	1
@@ -72,7 +95,39 @@ struct fi_bytecode_timeslice {
 #define FI_BYTECODE_RESUME	"\x6a\x04\x61\x00"
 #define FI_BYTECODE_TIMEOUT	"\x75\x6e\x69\x00"
 #define FI_BYTECODE_WAITSTATE	"\x6f\x05\x61\x00"
+#define FI_BYTECODE_WAITRANGE	"\x6f\x05\x61\x01"
+
+/*
+ * Compact dialect. Opcodes are a single byte and integers are unsigned
+ * LEB128.
+ */
+#define FI_COMPACT_TIMESLICE		0x01
+#define FI_COMPACT_TIMESLICE_END	0x02
+#define FI_COMPACT_WHEN			0x03
+#define FI_COMPACT_RESUME		0x04
+#define FI_COMPACT_RESUME_RUN		0x05
+#define FI_COMPACT_TIMEOUT		0x06
+#define FI_COMPACT_WAITSTATE		0x07
+#define FI_COMPACT_WAITRANGE		0x08
+#define FI_COMPACT_WHEN_FLAGS		0x09
+
+#define FI_COMPACT_WHEN_END		0x00
+#define FI_COMPACT_CALLBACK		0x01
+#define FI_COMPACT_CONTINUE		0x02
+#define FI_COMPACT_PANIC		0x03
+#define FI_COMPACT_SLEEP		0x04
+#define FI_COMPACT_WAIT			0x05
+#define FI_COMPACT_SPIN			0x06
+#define FI_COMPACT_JITTER		0x07
+#define FI_COMPACT_PIN			0x08
+#define FI_COMPACT_PIN_SAME		0x09
+#define FI_COMPACT_PIN_FAR		0x0a
+#define FI_COMPACT_WAIT_FOR		0x0b
+#define FI_COMPACT_WAIT_UNTIL		0x0c
+#define FI_COMPACT_RUN			0x80
+#define FI_COMPACT_EVICT		0x40
 
 int fi_negotiate_config(struct rk_run_config *);
+int fi_notify(struct rk_run_config *, uint32_t);
 
 #endif
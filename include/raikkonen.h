@@ -30,25 +30,34 @@
 #ifndef _RAIKKONEN_H_
 #define _RAIKKONEN_H_
 
+#include <sys/un.h>
+
 #include <netinet/in.h>
 
+#include <stddef.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 union rk_sockaddr {
 	struct sockaddr		*rk_sa;
 	struct sockaddr_in	*rk_sin4;
 	struct sockaddr_in6	*rk_sin6;
+	struct sockaddr_un	*rk_sun;
 };
 
+/*
+ * A callback returns 0 if all is well. Anything else is counted as a failure
+ * of whatever it checks, and the thread carries on.
+ */
 struct rk_cbdef {
 	char		*cb_name;
-	void		(*cb)(uint32_t state_id, void *ptr);
+	int		(*cb)(uint32_t state_id, void *ptr);
 	uint32_t	cb_id;
-};
-
-struct rk_state_iter {
-	uint32_t i;
-	uint32_t j;
+	uint64_t	calls;
+	uint64_t	failures;
 };
 
 struct rk_config {
@@ -58,19 +67,69 @@ struct rk_config	*rk_config_get_internal(void);
 
 uint32_t		rk_state_register_internal(struct rk_config *, const char *);
 uint32_t		rk_state_enter_internal(struct rk_config *, uint32_t);
+uint32_t		rk_state_enter_data_internal(struct rk_config *, uint32_t, void *, size_t);
+uint32_t		rk_state_enter_key_internal(struct rk_config *, uint32_t, uint64_t);
+uint32_t		rk_state_enter_key_data_internal(struct rk_config *, uint32_t, uint64_t, void *, size_t);
+void			rk_state_bind_internal(struct rk_config *, uint32_t, uint32_t *);
+uint32_t		rk_callback_register_internal(struct rk_config *, const char *, int (*)(uint32_t, void *));
+uint64_t		rk_callback_calls_internal(struct rk_config *, uint32_t);
+uint64_t		rk_callback_failures_internal(struct rk_config *, uint32_t);
+
+void			rk_thread_register_internal(struct rk_config *);
+void			rk_virtual_time_internal(struct rk_config *);
+void			rk_watchdog_internal(struct rk_config *, uint32_t);
+void			rk_telemetry_internal(struct rk_config *, const char *, uint32_t);
+void			rk_record_internal(struct rk_config *, const char *);
+void			rk_shared_internal(struct rk_config *);
+void			rk_low_latency_internal(struct rk_config *, int, int, uint32_t);
 
 void			rk_start_internal(union rk_sockaddr *);
+void			rk_start_async_internal(union rk_sockaddr *);
 
 #ifdef RK_ENABLED
 #define rk_config_get()		rk_config_get_internal()
 #define rk_state_register(a, b)	rk_state_register_internal((a), (b))
 #define rk_state_enter(a, b)	rk_state_enter_internal((a), (b))
+#define rk_state_enter_data(a, b, c, d)	rk_state_enter_data_internal((a), (b), (c), (d))
+#define rk_state_enter_key(a, b, c)	rk_state_enter_key_internal((a), (b), (c))
+#define rk_state_enter_key_data(a, b, c, d, e)	rk_state_enter_key_data_internal((a), (b), (c), (d), (e))
+#define rk_state_bind(a, b, c)	rk_state_bind_internal((a), (b), (c))
+#define rk_callback_register(a, b, c)	rk_callback_register_internal((a), (b), (c))
+#define rk_callback_calls(a, b)	rk_callback_calls_internal((a), (b))
+#define rk_callback_failures(a, b)	rk_callback_failures_internal((a), (b))
+#define rk_thread_register(a)	rk_thread_register_internal((a))
+#define rk_virtual_time(a)	rk_virtual_time_internal((a))
+#define rk_watchdog(a, b)	rk_watchdog_internal((a), (b))
+#define rk_telemetry(a, b, c)	rk_telemetry_internal((a), (b), (c))
+#define rk_record(a, b)		rk_record_internal((a), (b))
+#define rk_shared(a)		rk_shared_internal((a))
+#define rk_low_latency(a, b, c, d)	rk_low_latency_internal((a), (b), (c), (d))
 #define rk_start(a)		rk_start_internal((a))
+#define rk_start_async(a)	rk_start_async_internal((a))
 #else
 #define rk_config_get()		NULL
 #define rk_state_register(a, b)	0
 #define rk_state_enter(a, b)	0
+#define rk_state_enter_data(a, b, c, d)	0
+#define rk_state_enter_key(a, b, c)	0
+#define rk_state_enter_key_data(a, b, c, d, e)	0
+#define rk_state_bind(a, b, c)
+#define rk_callback_register(a, b, c)	0
+#define rk_callback_calls(a, b)	0
+#define rk_callback_failures(a, b)	0
+#define rk_thread_register(a)
+#define rk_virtual_time(a)
+#define rk_watchdog(a, b)
+#define rk_telemetry(a, b, c)
+#define rk_record(a, b)
+#define rk_shared(a)
+#define rk_low_latency(a, b, c, d)
 #define rk_start(a)
+#define rk_start_async(a)
+#endif
+
+#ifdef __cplusplus
+}
 #endif
 
 #endif
@@ -0,0 +1,355 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifndef _RAIKKONEN_HPP_
+#define _RAIKKONEN_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "raikkonen.h"
+
+/*
+ * C++ binding, built on the C API so that C and C++ code in one program
+ * share a single state table.
+ *
+ * Scripts refer to states and callbacks by the number they were registered
+ * under. Each is therefore declared here with that number as a template
+ * argument. Declarations may be repeated in any translation unit and in any
+ * order: each number is registered once, and only after every number below
+ * it, and registering it checks that the library agrees. A program that
+ * registers states of its own from C first, or declares the same number
+ * under two names, stops at startup instead of running the wrong schedule.
+ *
+ *	RK_STATE(STATE_ACCEPT, 0);
+ *	RK_CALLBACK(CB_DROP, 0, struct conn, drop_conn);
+ *
+ *	STATE_ACCEPT.enter(conn);
+ *	rk::state<0>::enter();
+ *
+ * The objects these declare hold nothing themselves, so a header may
+ * declare them for every file that includes it. Entering a state that is
+ * not armed is an inline load of a flag the library keeps for it, and a
+ * branch. Without RK_ENABLED, none of this does anything.
+ */
+
+#define RK_STATE(name, id)		static ::rk::state<(id)> name(#name)
+#define RK_CALLBACK(name, id, type, fn)					\
+	static ::rk::callback<(id), type, (fn)> name(#name)
+
+namespace rk {
+
+#ifdef RK_ENABLED
+
+namespace detail {
+
+inline void
+check(const char *what, const char *name, uint32_t want, uint32_t got)
+{
+
+	if (got != want) {
+		std::fprintf(stderr, "rk: %s %s was registered as %u, but is "
+		    "declared as %u\n", what, name, got, want);
+		std::abort();
+	}
+}
+
+struct decl {
+	const char	*name;
+	void		(*enroll)(const char *);
+};
+
+/* What has been declared of one kind, by number. */
+struct registry {
+	const char		*what;
+	std::vector<decl>	decls;
+	uint32_t		next;
+};
+
+inline registry &
+states(void)
+{
+	static registry r = { "state", std::vector<decl>(), 0 };
+
+	return r;
+}
+
+inline registry &
+callbacks(void)
+{
+	static registry r = { "callback", std::vector<decl>(), 0 };
+
+	return r;
+}
+
+/*
+ * Record a declaration, and register whatever it makes contiguous. Static
+ * objects are constructed one at a time, so this needs no lock.
+ */
+inline void
+declare(registry &r, uint32_t id, const char *name,
+    void (*enroll)(const char *))
+{
+
+	if (r.decls.size() <= id) {
+		decl none = { NULL, NULL };
+
+		r.decls.resize(id + 1, none);
+	}
+
+	if (r.decls[id].name != NULL) {
+		if (std::strcmp(r.decls[id].name, name) != 0) {
+			std::fprintf(stderr, "rk: %s %u is declared as both %s "
+			    "and %s\n", r.what, id, r.decls[id].name, name);
+			std::abort();
+		}
+		return;
+	}
+
+	r.decls[id].name = name;
+	r.decls[id].enroll = enroll;
+	while (r.next < r.decls.size() && r.decls[r.next].name != NULL) {
+		r.next++;
+		r.decls[r.next - 1].enroll(r.decls[r.next - 1].name);
+	}
+}
+
+}
+
+template <uint32_t ID>
+class state {
+public:
+	static const uint32_t id = ID;
+
+	explicit state(const char *name)
+	{
+
+		detail::declare(detail::states(), ID, name, enroll);
+	}
+
+	/* Returns the thread's ordinal, or UINT32_MAX if nothing is armed. */
+	static uint32_t
+	enter(void)
+	{
+
+		if (idle()) {
+			return UINT32_MAX;
+		}
+		return rk_state_enter_internal(rk_config_get_internal(), ID);
+	}
+
+	static uint32_t
+	enter(void *data, size_t len)
+	{
+
+		if (idle()) {
+			return UINT32_MAX;
+		}
+		return rk_state_enter_data_internal(rk_config_get_internal(),
+		    ID, data, len);
+	}
+
+	template <typename T>
+	static uint32_t
+	enter(T *data)
+	{
+
+		return enter(static_cast<void *>(data), sizeof (*data));
+	}
+
+	/*
+	 * Only counts towards a `when` armed for key, if there is one, and
+	 * towards key's own ordinals under a `when` armed for every key.
+	 */
+	static uint32_t
+	enter_key(uint64_t key)
+	{
+
+		if (idle()) {
+			return UINT32_MAX;
+		}
+		return rk_state_enter_key_internal(rk_config_get_internal(), ID,
+		    key);
+	}
+
+	template <typename T>
+	static uint32_t
+	enter_key(uint64_t key, T *data)
+	{
+
+		if (idle()) {
+			return UINT32_MAX;
+		}
+		return rk_state_enter_key_data_internal(rk_config_get_internal(),
+		    ID, key, static_cast<void *>(data), sizeof (*data));
+	}
+
+private:
+	state(const state &);
+	state &operator=(const state &);
+
+	static void
+	enroll(const char *name)
+	{
+		struct rk_config *cfg;
+
+		cfg = rk_config_get_internal();
+		detail::check("state", name, ID,
+		    rk_state_register_internal(cfg, name));
+		rk_state_bind_internal(cfg, ID, &hot);
+	}
+
+	static bool
+	idle(void)
+	{
+
+		return __builtin_expect(*(const volatile uint32_t *)&hot == 0, 1);
+	}
+
+	/*
+	 * Set by the library while entering the state has to call into it.
+	 * Until the state is registered, it is never armed.
+	 */
+	static uint32_t hot;
+};
+
+template <uint32_t ID>
+uint32_t state<ID>::hot = 0;
+
+/*
+ * Registers F for `callback` actions, passing it the data the state was
+ * entered with as a T *. F returns nonzero to count a failure.
+ */
+template <uint32_t ID, typename T, int (*F)(uint32_t, T *)>
+class callback {
+public:
+	static const uint32_t id = ID;
+
+	explicit callback(const char *name)
+	{
+
+		detail::declare(detail::callbacks(), ID, name, enroll);
+	}
+
+	static uint64_t
+	calls(void)
+	{
+
+		return rk_callback_calls_internal(rk_config_get_internal(), ID);
+	}
+
+	static uint64_t
+	failures(void)
+	{
+
+		return rk_callback_failures_internal(rk_config_get_internal(),
+		    ID);
+	}
+
+private:
+	callback(const callback &);
+	callback &operator=(const callback &);
+
+	static void
+	enroll(const char *name)
+	{
+
+		detail::check("callback", name, ID,
+		    rk_callback_register_internal(rk_config_get_internal(),
+		    name, trampoline));
+	}
+
+	static int
+	trampoline(uint32_t state_id, void *data)
+	{
+
+		return F(state_id, static_cast<T *>(data));
+	}
+};
+
+#else
+
+template <uint32_t ID>
+class state {
+public:
+	static const uint32_t id = ID;
+
+	explicit state(const char *) {}
+
+	static uint32_t enter(void) { return 0; }
+	static uint32_t enter(void *, size_t) { return 0; }
+	template <typename T> static uint32_t enter(T *) { return 0; }
+	static uint32_t enter_key(uint64_t) { return 0; }
+	template <typename T> static uint32_t enter_key(uint64_t, T *) { return 0; }
+
+private:
+	state(const state &);
+	state &operator=(const state &);
+};
+
+template <uint32_t ID, typename T, int (*F)(uint32_t, T *)>
+class callback {
+public:
+	static const uint32_t id = ID;
+
+	explicit callback(const char *) {}
+
+	static uint64_t calls(void) { return 0; }
+	static uint64_t failures(void) { return 0; }
+
+private:
+	callback(const callback &);
+	callback &operator=(const callback &);
+};
+
+#endif
+
+/*
+ * Enters ENTER on construction and LEAVE when it goes out of scope, so that
+ * a schedule can hold threads at either edge of a critical section however
+ * the scope is left.
+ */
+template <uint32_t ENTER, uint32_t LEAVE>
+class section {
+public:
+	section(void) { state<ENTER>::enter(); }
+	~section(void) { state<LEAVE>::enter(); }
+
+private:
+	section(const section &);
+	section &operator=(const section &);
+};
+
+}
+
+#endif
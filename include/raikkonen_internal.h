@@ -35,11 +35,14 @@
 #else
 #include <semaphore.h>
 #endif
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 
+#include <ck_epoch.h>
+
 enum rk_commands {
 	RK_COMMAND_INSTALLHANDLER,
 	RK_COMMAND_RESUME,
@@ -53,6 +56,43 @@ enum rk_handler_actions {
 	RK_HANDLER_PANIC,
 	RK_HANDLER_SLEEP,
 	RK_HANDLER_WAIT,
+	RK_HANDLER_SPIN,
+	RK_HANDLER_JITTER,
+	RK_HANDLER_PIN,
+	RK_HANDLER_PIN_SAME,
+	RK_HANDLER_PIN_FAR,
+	RK_HANDLER_WAIT_UNTIL,
+};
+
+enum rk_jitter_dist {
+	RK_JITTER_UNIFORM,
+	RK_JITTER_EXP,
+};
+
+/*
+ * A random busy-wait. Uniform delays are drawn from [a, b] nanoseconds,
+ * exponential ones have a mean of a nanoseconds. The delay for a given
+ * ordinal depends only on the seed, so runs are reproducible.
+ */
+struct rk_jitter {
+	enum rk_jitter_dist	dist;
+	uint32_t		a;
+	uint32_t		b;
+	uint32_t		seed;
+};
+
+/*
+ * Which entries of a state take an ordinal at all. Each thread counts its
+ * own entries: it skips the first skip, then considers every every-th one,
+ * and of those keeps a fraction p / 2^32 (all of them if p is 0). Entries
+ * that aren't kept leave the state as if it were unarmed.
+ */
+struct rk_sample {
+	bool			on;
+	uint32_t		every;
+	uint32_t		skip;
+	uint32_t		p;
+	uint32_t		seed;
 };
 
 struct rk_sema {
@@ -61,14 +101,48 @@ struct rk_sema {
 #else
 	sem_t			sem;
 #endif
+
+	/*
+	 * Only maintained when the run is accounting for blocked threads.
+	 * Both are protected by rk_config.park_lock.
+	 */
+	uint32_t		n_waiters;
+	uint32_t		n_credits;
+
+	/* When a thread last posted it for the scheduler, if wake_stats. */
+	uint64_t		posted_ns;
+};
+
+/*
+ * A thread sleeping in virtual time. Timers live on the sleeper's stack and
+ * are linked into rk_config.timers in deadline order.
+ */
+struct rk_timer {
+	uint64_t		deadline;
+	bool			fired;
+	struct rk_timer		*next;
 };
 
 struct rk_array {
 	uint32_t		nelm;
+	uint32_t		cap;
 	size_t			elmsize;
 	void			*buf;
 };
 
+struct rk_state_handler;
+
+/*
+ * Where to move a thread. `pin` names a CPU; `pin-same` and `pin-far` name
+ * the handler whose most recent thread to place relative to.
+ */
+struct rk_pin {
+	uint32_t		cpu;
+	struct rk_state_handler	*ref;
+};
+
+#define RK_GATE_OPEN	0x80000000U
+
 struct rk_state_handler {
 	/*
 	 * We store the epoch here so that we can do some sanity checking
@@ -83,49 +157,196 @@ struct rk_state_handler {
 		uint32_t	act_callback;
 		struct rk_sema	act_sema;
 		struct timespec	act_sleep;
+		uint32_t	act_spin;
+		struct rk_jitter act_jitter;
+		struct rk_pin	act_pin;
+		struct rk_state_handler *act_until;
 	} u;
 #define act_callback	u.act_callback
 #define act_sema	u.act_sema
 #define act_sleep	u.act_sleep
+#define act_spin	u.act_spin
+#define act_jitter	u.act_jitter
+#define act_pin		u.act_pin
+#define act_until	u.act_until
+
+	/*
+	 * Set when a `waitstate STATE[range]` waits for threads to reach this
+	 * handler. Every thread that does posts arrival.
+	 */
+	bool			watched;
+	struct rk_sema		arrival;
+
+	/*
+	 * Set when a pin action places threads relative to this handler.
+	 * Every thread that reaches it stores the CPU it is on, plus one.
+	 */
+	bool			located;
+	uint32_t		last_cpu;
+
+	/*
+	 * Set when a `wait-until` holds threads until this handler's range
+	 * has been reached. gate_left counts the threads still to come, and
+	 * the last of them opens gate. Until then, gate counts the threads
+	 * parked on gate_sema.
+	 */
+	bool			gated;
+	uint32_t		gate_left;
+	uint32_t		gate;
+	struct rk_sema		gate_sema;
+
+	/*
+	 * Threads parked in a wait action, counted without the lock for
+	 * telemetry.
+	 */
+	uint32_t		parked;
+
+	/* Evict the data passed to rk_state_enter_data after the action. */
+	bool			evict;
+
+	/* How long a wait lasts without a resume; zero for as long as it takes. */
+	struct timespec		wait_for;
+
+	/*
+	 * Waiters that gave up before they were resumed. Each swallows the
+	 * resume meant for it when that comes. Protected by park_lock.
+	 */
+	uint32_t		timed_out;
+};
+
+/*
+ * A state armed with per-key ordinals counts each key in a slot of its own.
+ * The table is open addressed and never shrinks; entries with a key that
+ * finds it full are passed over as if the state weren't armed.
+ */
+#define RK_KEY_SLOTS	1024
+
+struct rk_key_slot {
+	uint64_t		key;
+
+	/* 0 while free, 1 while being claimed, 2 once key is set. */
+	uint32_t		busy;
+	uint32_t		cur_thread;
+};
+
+/*
+ * What a `when` command arms a state with. Apart from the counters, a
+ * snapshot never changes once it is published: arming the state again
+ * publishes a new one, and the old one is reclaimed once no entering thread
+ * can still be looking at it.
+ */
+struct rk_state_snapshot {
+	uint32_t		cur_thread;
+	uint32_t		cap_thread;
+	uint32_t		disarm_at;
+	struct rk_sample	sample;
+	bool			keyed;
+	uint64_t		key;
+
+	/* Per-key ordinals, or NULL; full is set once a key is turned away. */
+	struct rk_key_slot	*keys;
+	uint32_t		full;
+	struct rk_array		*handlers;
+	struct rk_sema		waitstate;
+
+	/*
+	 * Snapshots are staged: entering threads ignore one until
+	 * rk_config.arm_gen reaches gen, and use whatever was armed before
+	 * it, in prev, instead.
+	 */
+	uint32_t		gen;
+	struct rk_state_snapshot *prev;
+
+	ck_epoch_entry_t	epoch_entry;
 };
 
 /*
  * Although we track states by ID internally, they have a readable name
  * representation. A state may have one or more handlers specified. These
  * handlers are assigned through `when` conditions in a Kimi script. When a
- * thread enters a state, it checks to see if a handler is installed for
- * that state. If n_handlers > 0, a handler is installed and the proper
- * handler may be found in next_handler.
+ * thread enters a state, it checks to see if a snapshot is armed for that
+ * state, and if so, looks up the handler for its ordinal in it.
+ *
+ * snapshot is what the scheduler installed last and is only touched by the
+ * scheduler. armed is what entering threads look at. They are the same
+ * until the remaining policy turns out to be a no-op, at which point armed
+ * is cleared and the state goes back to the unarmed fast path.
  */
 struct rk_state {
 	const char		*state_name;
 	uint32_t		state_id;
 
-	uint32_t		cap_thread;
-	uint32_t		cur_thread;
-	struct rk_sema		waitstate;
+	struct rk_state_snapshot *snapshot;
+	struct rk_state_snapshot *armed;
 
-	struct rk_array		*handlers;
+	/* A binding's flag, kept by rk_state_flag; NULL if none is bound. */
+	uint32_t		*bound;
 };
 
 struct rk_cmd_installhandler {
 	uint32_t		state_id;
 	uint32_t		tr_max;
+
+	/*
+	 * First ordinal from which every remaining range is `continue` and
+	 * the waitstate has been signalled; UINT_MAX if there is none.
+	 */
+	uint32_t		disarm_at;
+	struct rk_sample	sample;
+
+	/*
+	 * Whether only entries made with key count, or whether every key
+	 * counts ordinals of its own.
+	 */
+	bool			keyed;
+	uint64_t		key;
+	bool			per_key;
 	struct rk_array		handlers;
+
+	/*
+	 * Whether the ranges are in ascending order without overlapping, so
+	 * that they can be searched by bisection.
+	 */
+	bool			sorted;
+};
+
+/*
+ * Where the install currently live for a state is, by epoch and position in
+ * the epoch's commands. Pointers into the command arrays don't survive them
+ * growing, so the index records positions instead.
+ */
+struct rk_install_ref {
+	uint32_t		epoch;
+	uint32_t		command;
 };
 
+/* The handler is looked up when the resume is parsed. */
 struct rk_cmd_resume {
 	uint32_t		state_id;
 	uint32_t		tr_start;
 	uint32_t		tr_end;
+	struct rk_state_handler	*handler;
 };
 
 struct rk_cmd_timeout {
 	struct timespec		timeout;
 };
 
+/*
+ * A plain waitstate has no handler. A ranged one waits for every ordinal in
+ * tr_start..tr_end of the state to have arrived at handler.
+ */
 struct rk_cmd_waitstate {
-	/* empty, for now. */
+	struct rk_state_handler	*handler;
+	uint32_t		state_id;
+	uint32_t		tr_start;
+	uint32_t		tr_end;
+
+	/*
+	 * For a plain waitstate, the IDs of the states armed since the last
+	 * one, which are all it has to wait for.
+	 */
+	struct rk_array		states;
 };
 
 struct rk_command {
@@ -157,12 +378,174 @@ struct rk_run_config {
 	union rk_sockaddr	rk_sa;
 #define rksin4	rk_sa.rk_sin4
 #define rksin6	rk_sa.rk_sin6
+#define rksun	rk_sa.rk_sun
 #define rksa	rk_sa.rk_sa
 
+	/* Our copy of the caller's address, which rk_sa points at. */
+	struct sockaddr_storage	sa_storage;
+
 	uint32_t		fi_state;
 	int			client_fd;
 
+	/*
+	 * States armed since the last plain waitstate that was parsed, and a
+	 * flag per state to keep them unique.
+	 */
+	struct rk_array		wait_pending;
+	uint8_t			*wait_marked;
+
 	struct rk_array		epochs;
+
+	/* The latest install parsed for each state, by state ID. */
+	struct rk_array		installs;
+
+	/* Reclamation of state snapshots that have been replaced. */
+	ck_epoch_t		reclaim;
+
+	/*
+	 * Staged snapshots become visible together when arm_gen is bumped.
+	 * Those they replace are kept in retired until then, since entering
+	 * threads may still reach them through prev.
+	 */
+	uint32_t		arm_gen;
+	struct rk_array		retired;
+
+	/*
+	 * When accounting is enabled, every thread blocking inside the library
+	 * is tracked so that we know when nothing can make progress on its
+	 * own. Virtual time relies on this to advance the clock.
+	 */
+	bool			accounting;
+	bool			virtual_time;
+
+	pthread_mutex_t		park_lock;
+	pthread_cond_t		park_cv;
+	uint32_t		n_threads;
+	uint32_t		n_blocked;
+
+	/* Threads in a wait with a deadline, which will return on their own. */
+	uint32_t		n_timed;
+	uint64_t		vclock;
+	struct rk_timer		*timers;
+
+	/*
+	 * Epochs may be appended by a streaming client while the scheduler
+	 * runs. epoch_lock protects the epoch array; epoch_cv is signalled
+	 * when epochs arrive, when the scheduler takes one, and when either
+	 * side is done.
+	 */
+	pthread_mutex_t		epoch_lock;
+	pthread_cond_t		epoch_cv;
+	bool			streaming;
+	bool			compact;
+	bool			stream_done;
+	uint32_t		next_epoch;
+
+	/* Where the scheduler is; read by the watchdog and telemetry. */
+	uint32_t		cur_epoch;
+	uint32_t		cur_command;
+	bool			sched_done;
+	bool			sched_sleeping;
+	uint32_t		watchdog_ms;
+
+	const char		*telemetry_path;
+	uint32_t		telemetry_ms;
+
+	/*
+	 * Low-latency scheduling: the scheduler is pinned to ll_cpu unless it
+	 * is negative, may run SCHED_FIFO, and polls for ll_spin_ns before it
+	 * blocks.
+	 */
+	bool			low_latency;
+	bool			ll_fifo;
+	int			ll_cpu;
+	uint64_t		ll_spin_ns;
+
+	/*
+	 * How long the scheduler takes to run again once what it waits for
+	 * has happened. Kept when wake_stats is set, by low-latency mode.
+	 */
+	bool			wake_stats;
+	uint64_t		wake_n;
+	uint64_t		wake_total_ns;
+	uint64_t		wake_max_ns;
+	uint64_t		wake_polled;
+
+	const char		*record_path;
+	struct rk_record_log	*record;
+
+	/* Coverage bitmap shared with a fuzzing driver, if any. */
+	uint8_t			*fuzz_map;
+
+	/* Arena shared with forked processes, in shared mode. */
+	struct rk_shm		*shm;
+};
+
+/*
+ * Record mode log, mapped from a file so that it survives the program
+ * crashing. Entries are claimed by a global sequence number; an entry is
+ * complete once its seq field holds that number plus one.
+ */
+#define RK_RECORD_MAGIC		"rkrec001"
+#define RK_RECORD_NAMELEN	64
+#define RK_RECORD_ENTRIES	(1U << 20)
+
+struct rk_record_entry {
+	uint64_t		seq;
+	uint32_t		state_id;
+	uint32_t		ordinal;
+	uint32_t		tid;
+	uint32_t		epoch;
+};
+
+struct rk_record_log {
+	char			magic[8];
+	uint32_t		n_states;
+	uint32_t		n_entries;
+	uint64_t		seq;
+	/* n_states names of RK_RECORD_NAMELEN bytes, then the entries. */
+};
+
+/*
+ * Fuzz mode coverage bitmap, attached from the SysV shared memory segment
+ * named by RK_FUZZ_ENV. Each byte counts hits of one edge between the
+ * previous state a thread entered and the state it enters now.
+ */
+#define RK_FUZZ_ENV		"RK_FUZZ_SHM"
+#define RK_FUZZ_MAP_SIZE	(1U << 16)
+
+/*
+ * Shared mode arena. Everything an entering thread looks at is allocated
+ * from a single MAP_SHARED mapping made before the program forks, so that
+ * it is at the same address in every process. Nothing allocated from it is
+ * ever freed.
+ *
+ * Threads parked in a wait handler are listed in waiters, so that the
+ * scheduler can tell when a process died while parked.
+ */
+#define RK_SHM_SIZE		(64UL << 20)
+#define RK_SHM_WAITERS		1024
+
+struct rk_shm_waiter {
+	uint32_t		busy;
+	uint32_t		pid;
+	uint32_t		state_id;
+	uint32_t		ordinal;
+	struct rk_sema		*sema;
+};
+
+struct rk_shm {
+	uint64_t		size;
+	uint64_t		used;
+	bool			abandoned;
+
+	/* Stands in for rk_config.arm_gen, which forked processes can't see. */
+	uint32_t		arm_gen;
+
+	/* Stands in for rk_config.park_lock; robust and process-shared. */
+	pthread_mutex_t		park_lock;
+
+	struct rk_shm_waiter	waiters[RK_SHM_WAITERS];
 };
 
 extern struct rk_run_config rk_config;
@@ -172,22 +555,82 @@ void			rk_array_init(struct rk_array *, size_t);
 void			*rk_array_append(struct rk_array *);
 void			*rk_array_first(struct rk_array *);
 uint32_t		rk_array_len(struct rk_array *);
+void			rk_array_truncate(struct rk_array *, uint32_t);
 
 struct rk_command	*rk_command_create(struct rk_epoch *);
 
+struct rk_cmd_installhandler *rk_config_find_install(struct rk_run_config *, struct rk_epoch *, uint32_t);
 struct rk_state_handler	*rk_config_find_handler(struct rk_run_config *, struct rk_epoch *, uint32_t, uint32_t, uint32_t);
-struct rk_state 	*rk_config_iterate_state(struct rk_run_config *, struct rk_epoch *, struct rk_state_iter *);
+uint32_t		rk_config_find_ordinal(struct rk_cmd_installhandler *, uint32_t);
+int			rk_config_index_install(struct rk_run_config *, struct rk_epoch *, uint32_t);
+void			rk_config_reindex(struct rk_run_config *);
 
 struct rk_epoch		*rk_epoch_create(struct rk_run_config *);
 bool			rk_epoch_add_command(struct rk_epoch *, struct rk_command *);
 void			rk_epoch_set_notify(struct rk_epoch *);
+bool			rk_epoch_get(struct rk_run_config *, uint32_t, struct rk_epoch *, bool);
 
 struct rk_state_handler	*rk_state_handler_create(struct rk_array *);
 
-struct rk_state_handler	*rk_state_find_handler(struct rk_state *, uint32_t, uint32_t);
+struct rk_state		*rk_state_get(uint32_t);
+void			rk_state_arm(struct rk_state *, struct rk_cmd_installhandler *);
+void			rk_state_publish(void);
+void			rk_state_detour_all(void);
+uint32_t		rk_state_entered(struct rk_state_snapshot *);
 
 bool			rk_sema_init(struct rk_sema *, uint32_t);
 bool			rk_sema_wait(struct rk_sema *);
+bool			rk_sema_timedwait(struct rk_sema *, uint32_t);
+bool			rk_sema_timedwait_ts(struct rk_sema *, const struct timespec *);
+bool			rk_sema_trywait(struct rk_sema *);
 bool			rk_sema_post(struct rk_sema *);
+bool			rk_sema_ready(struct rk_sema *);
+void			rk_sema_destroy(struct rk_sema *);
+
+void			rk_thread_enter(void);
+void			rk_thread_lock(void);
+void			rk_thread_unlock(void);
+bool			rk_thread_park(struct rk_sema *);
+bool			rk_thread_park_timed(struct rk_sema *, const struct timespec *, uint32_t *);
+bool			rk_thread_unpark(struct rk_sema *);
+bool			rk_thread_unpark_timed(struct rk_sema *, uint32_t *);
+bool			rk_thread_ready(struct rk_sema *);
+void			rk_thread_sleep(const struct timespec *);
+ck_epoch_record_t	*rk_thread_record(void);
+uint32_t		rk_thread_id(void);
+
+void			rk_watchdog_start(void);
+void			rk_telemetry_start(void);
+void			rk_record_start(void);
+uint32_t		rk_record_enter(uint32_t, uint32_t *);
+uint64_t		rk_spin_ns(void);
+void			rk_spin_calibrate(void);
+void			rk_spin(uint32_t);
+
+void			rk_latency_setup(void);
+bool			rk_latency_poll(struct rk_sema *);
+void			rk_latency_stamp(struct rk_sema *);
+void			rk_latency_woken(struct rk_sema *, uint64_t);
+void			rk_latency_report(void);
+uint64_t		rk_jitter_mix(uint64_t);
+uint32_t		rk_jitter_ns(const struct rk_jitter *, uint32_t, uint32_t);
+bool			rk_sample_take(const struct rk_sample *, uint32_t, uint32_t);
+void			rk_pin_init(void);
+void			rk_pin(struct rk_state_handler *, uint32_t, uint32_t);
+void			rk_pin_restore(void);
+void			rk_pin_locate(struct rk_state_handler *);
+extern __thread bool	rk_pin_pinned;
+void			rk_evict_init(void);
+void			rk_evict(const void *, size_t);
+void			rk_fuzz_start(void);
+void			rk_fuzz_enter(uint32_t, uint32_t);
+void			*rk_shm_alloc(size_t);
+bool			rk_shm_owns(const void *);
+void			rk_shm_lock(void);
+void			rk_shm_unlock(void);
+bool			rk_shm_park(uint32_t, uint32_t, struct rk_sema *, struct rk_shm_waiter **);
+void			rk_shm_unpark(struct rk_shm_waiter *);
+bool			rk_shm_wait(struct rk_sema *);
+void			rk_shm_abandon(void);
 
 #endif
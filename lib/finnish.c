@@ -34,10 +34,12 @@
 #else
 #define be32toh ntohl
 #define be16toh ntohs
+#define htobe32 htonl
 #endif
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <semaphore.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -66,6 +68,34 @@ enum finnish_parse_states {
 
 static uint32_t last_waitstate;
 
+/*
+ * What parsing a request changes outside the epochs it appends, so that a
+ * request that turns out to be invalid can be undone. That includes the
+ * flags it sets on ranges armed by earlier requests it refers to.
+ */
+struct fi_undo_flags {
+	struct rk_state_handler		*handler;
+	struct rk_cmd_installhandler	*install;
+	uint32_t			disarm_at;
+	uint32_t			gate_left;
+	bool				gated;
+	bool				watched;
+	bool				located;
+};
+
+struct fi_undo {
+	uint32_t		n_epochs;
+	uint32_t		last_waitstate;
+	uint32_t		*pending;
+	uint32_t		n_pending;
+	struct fi_undo_flags	*flags;
+	uint32_t		n_flags;
+	uint32_t		cap_flags;
+};
+
+/* The request being parsed; epoch_lock is held while it is set. */
+static struct fi_undo *cur_undo;
+
 #ifdef FI_DEBUG
 static void
 hexdump(uint8_t *buf, uint32_t len)
@@ -153,6 +183,343 @@ fi_do_timespec(struct timespec *ts, uint8_t unit, uint32_t val)
 	return 0;
 }
 
+static int
+fi_do_jitter(struct rk_jitter *j, uint8_t dist, uint32_t a, uint32_t b,
+    uint32_t seed)
+{
+
+	switch (dist) {
+	case FI_BYTECODE_JITTER_UNIFORM:
+		if (a > b) {
+			fprintf(rk_log, "fi_do_jitter: Uniform jitter from %u "
+			    "to %u ns is empty.\n", a, b);
+			return -1;
+		}
+		j->dist = RK_JITTER_UNIFORM;
+		break;
+
+	case FI_BYTECODE_JITTER_EXP:
+		j->dist = RK_JITTER_EXP;
+		break;
+
+	default:
+		fprintf(rk_log, "fi_do_jitter: Invalid jitter distribution "
+		    "%u.\n", dist);
+		return -1;
+	}
+
+	j->a = a;
+	j->b = b;
+	j->seed = seed;
+	rk_spin_calibrate();
+
+	return 0;
+}
+
+/*
+ * Whether the scheduler may already have armed the install of state_id. A
+ * streaming client's epochs are parsed while the schedule runs, and the
+ * handlers of an install that has gone live can't be set up any further.
+ * Called with epoch_lock held, which the scheduler takes epochs under.
+ */
+static bool
+fi_install_live(struct rk_run_config *c, uint32_t state_id)
+{
+	struct rk_install_ref *ref;
+
+	if (c->streaming == false || state_id >= rk_array_len(&c->installs)) {
+		return false;
+	}
+
+	ref = rk_array_first(&c->installs);
+	return ref[state_id].epoch != UINT_MAX &&
+	    ref[state_id].epoch < c->next_epoch;
+}
+
+/*
+ * Remember how h, a range armed for state_id, was before the request being
+ * parsed refers to it. Ranges the request arms itself go away with it.
+ */
+static int
+fi_undo_note(struct rk_run_config *c, struct rk_epoch *e, uint32_t state_id,
+    struct rk_state_handler *h)
+{
+	struct fi_undo_flags *f;
+	struct rk_install_ref *ref;
+	uint32_t cap;
+
+	ref = rk_array_first(&c->installs);
+	if (cur_undo == NULL || ref[state_id].epoch >= cur_undo->n_epochs) {
+		return 0;
+	}
+
+	if (cur_undo->n_flags == cur_undo->cap_flags) {
+		cap = cur_undo->cap_flags ? cur_undo->cap_flags * 2 : 4;
+		f = realloc(cur_undo->flags, cap * sizeof (*f));
+		if (f == NULL) {
+			fprintf(rk_log, "fi_undo_note: Out of memory.\n");
+			return -1;
+		}
+		cur_undo->flags = f;
+		cur_undo->cap_flags = cap;
+	}
+
+	f = &cur_undo->flags[cur_undo->n_flags++];
+	f->handler = h;
+	f->install = rk_config_find_install(c, e, state_id);
+	f->disarm_at = f->install->disarm_at;
+	f->gate_left = h->gate_left;
+	f->gated = h->gated;
+	f->watched = h->watched;
+	f->located = h->located;
+
+	return 0;
+}
+
+/*
+ * Keep the install of state_id armed until every thread in the range of h
+ * has come through. An install disarms from the last ordinal that does
+ * anything, which a later when block referring to the range doesn't move.
+ */
+static void
+fi_keep_armed(struct rk_run_config *c, struct rk_epoch *e, uint32_t state_id,
+    const struct rk_state_handler *h)
+{
+	struct rk_cmd_installhandler *ih;
+
+	ih = rk_config_find_install(c, e, state_id);
+	if (ih == NULL) {
+		return;
+	}
+
+	if (h->tr_end == UINT_MAX) {
+		ih->disarm_at = UINT_MAX;
+	} else if (ih->disarm_at <= h->tr_end) {
+		ih->disarm_at = h->tr_end + 1;
+	}
+}
+
+/*
+ * Bind a pin-same or pin-far action to the range it places threads
+ * relative to. The range must have been armed by an earlier when block; the
+ * one being parsed can't be referred to, since its handlers may still move.
+ * Nor can one that a streaming client's earlier request may have put live,
+ * unless it is already being located.
+ */
+static int
+fi_do_pin_ref(struct rk_run_config *c, struct rk_epoch *e, uint32_t self,
+    struct rk_pin *pin, uint32_t state_id, uint32_t tr_start, uint32_t tr_end)
+{
+
+	if (state_id >= rk_array_len(&c->states)) {
+		fprintf(rk_log, "fi_do_pin_ref: state id %u exceeds number of "
+		    "configured states.\n", state_id);
+		return -1;
+	}
+
+	if (state_id == self) {
+		fprintf(rk_log, "fi_do_pin_ref: a pin can't refer to the state "
+		    "it is armed in.\n");
+		return -1;
+	}
+
+	pin->ref = rk_config_find_handler(c, e, state_id, tr_start, tr_end);
+	if (pin->ref == NULL) {
+		fprintf(rk_log, "fi_do_pin_ref: no range %u-%u is armed for "
+		    "state %u.\n", tr_start, tr_end, state_id);
+		return -1;
+	}
+
+	if (pin->ref->located == false && fi_install_live(c, state_id)) {
+		fprintf(rk_log, "fi_do_pin_ref: state %u may already be armed "
+		    "by an earlier request.\n", state_id);
+		return -1;
+	}
+
+	if (fi_undo_note(c, e, state_id, pin->ref) != 0) {
+		return -1;
+	}
+
+	pin->ref->located = true;
+	fi_keep_armed(c, e, state_id, pin->ref);
+	rk_pin_init();
+
+	return 0;
+}
+
+/*
+ * Bind a wait-until action to the range it waits for, which has the same
+ * restrictions as the reference of a pin. It also has to end, since the
+ * gate opens once every thread in it has arrived, and it can never be live
+ * already, since threads may have gone through without counting.
+ */
+static int
+fi_do_until_ref(struct rk_run_config *c, struct rk_epoch *e, uint32_t self,
+    struct rk_state_handler *handler, uint32_t state_id, uint32_t tr_start,
+    uint32_t tr_end)
+{
+	struct rk_state_handler *ref;
+
+	if (state_id >= rk_array_len(&c->states)) {
+		fprintf(rk_log, "fi_do_until_ref: state id %u exceeds number "
+		    "of configured states.\n", state_id);
+		return -1;
+	}
+
+	if (state_id == self) {
+		fprintf(rk_log, "fi_do_until_ref: a wait-until can't refer to "
+		    "the state it is armed in.\n");
+		return -1;
+	}
+
+	if (tr_end == UINT_MAX) {
+		fprintf(rk_log, "fi_do_until_ref: can't wait until a range up "
+		    "to N.\n");
+		return -1;
+	}
+
+	ref = rk_config_find_handler(c, e, state_id, tr_start, tr_end);
+	if (ref == NULL) {
+		fprintf(rk_log, "fi_do_until_ref: no range %u-%u is armed for "
+		    "state %u.\n", tr_start, tr_end, state_id);
+		return -1;
+	}
+
+	if (fi_install_live(c, state_id)) {
+		fprintf(rk_log, "fi_do_until_ref: state %u may already be "
+		    "armed by an earlier request.\n", state_id);
+		return -1;
+	}
+
+	if (fi_undo_note(c, e, state_id, ref) != 0) {
+		return -1;
+	}
+
+	if (ref->gated == false) {
+		if (rk_sema_init(&ref->gate_sema, 0) == false) {
+			perror("fi_do_until_ref: rk_sema_init");
+			return -1;
+		}
+		ref->gate_left = tr_end - tr_start + 1;
+		ref->gated = true;
+	}
+	fi_keep_armed(c, e, state_id, ref);
+
+	handler->action = RK_HANDLER_WAIT_UNTIL;
+	handler->act_until = ref;
+	return 0;
+}
+
+/*
+ * Find the ordinal from which entering the state can't do anything: every
+ * range from there on is `continue`, and the thread that signals the
+ * waitstate has already come through.
+ */
+static void
+fi_compute_disarm(struct rk_cmd_installhandler *ih)
+{
+	struct rk_state_handler *h;
+	uint32_t n, i, last;
+
+	h = rk_array_first(&ih->handlers);
+	n = rk_array_len(&ih->handlers);
+
+	/* Highest ordinal that still has something to do. */
+	last = 0;
+	for (i = 0; i < n; i++) {
+		if ((h[i].action != RK_HANDLER_CONTINUE || h[i].evict) &&
+		    h[i].tr_end > last) {
+			last = h[i].tr_end;
+		}
+	}
+
+	if (last == UINT_MAX) {
+		ih->disarm_at = UINT_MAX;
+		return;
+	}
+
+	ih->disarm_at = last + 1;
+	if (ih->tr_max > 0 && ih->disarm_at < ih->tr_max - 1) {
+		ih->disarm_at = ih->tr_max - 1;
+	}
+}
+
+/*
+ * Note whether an install's ranges are in order, once they have all been
+ * read. The compiler always sorts them, but a hand-written script need not.
+ */
+static void
+fi_check_sorted(struct rk_cmd_installhandler *ih)
+{
+	struct rk_state_handler *h;
+	uint32_t n, i;
+
+	h = rk_array_first(&ih->handlers);
+	n = rk_array_len(&ih->handlers);
+
+	ih->sorted = true;
+	for (i = 0; i < n; i++) {
+		if (h[i].tr_end < h[i].tr_start ||
+		    (i > 0 && h[i].tr_start <= h[i - 1].tr_end)) {
+			ih->sorted = false;
+			return;
+		}
+	}
+}
+
+/* A policy that keeps every entry is no policy at all. */
+static void
+fi_check_sample(struct rk_sample *sp)
+{
+
+	sp->on = sp->every > 1 || sp->skip > 0 || sp->p != 0;
+}
+
+/*
+ * Note that the command just created arms a state: index it, so that resumes
+ * find it without searching, and list the state for the next plain waitstate.
+ * A state only has to be listed once, however often it is armed in between.
+ */
+static int
+fi_note_install(struct rk_run_config *c, struct rk_epoch *e, uint32_t state_id)
+{
+	uint32_t *id, n_states;
+
+	n_states = rk_array_len(&c->states);
+	if (state_id >= n_states) {
+		fprintf(rk_log, "fi_note_install: when state id %u exceeds "
+		    "number of configured states.\n", state_id);
+		return -1;
+	}
+
+	if (rk_config_index_install(c, e, state_id)) {
+		fprintf(rk_log, "fi_note_install: Out of memory.\n");
+		return -1;
+	}
+
+	if (c->wait_marked == NULL) {
+		c->wait_marked = calloc(n_states, sizeof (*c->wait_marked));
+		if (c->wait_marked == NULL) {
+			fprintf(rk_log, "fi_note_install: Out of memory.\n");
+			return -1;
+		}
+	}
+
+	if (c->wait_marked[state_id]) {
+		return 0;
+	}
+
+	id = rk_array_append(&c->wait_pending);
+	if (id == NULL) {
+		fprintf(rk_log, "fi_note_install: Out of memory.\n");
+		return -1;
+	}
+	*id = state_id;
+	c->wait_marked[state_id] = 1;
+
+	return 0;
+}
+
 static int
 fi_parse_when_command(struct rk_run_config *c, struct rk_epoch *e,
     uint8_t *buf, uint32_t *off, uint32_t len)
@@ -160,7 +527,9 @@ fi_parse_when_command(struct rk_run_config *c, struct rk_epoch *e,
 	struct rk_state_handler *handler;
 	enum finnish_parse_states pstate;
 	struct rk_command *cmd;
-	uint32_t state_id;
+	struct rk_sample *sp;
+	uint32_t state_id, hi, lo;
+	uint8_t op[2], flags;
 
 	cmd = rk_command_create(e);
 	if (cmd == NULL) {
@@ -171,14 +540,49 @@ fi_parse_when_command(struct rk_run_config *c, struct rk_epoch *e,
 	cmd->command = RK_COMMAND_INSTALLHANDLER;
 	*off += 4;
 	
-	if (fi_read_uint32(buf + *off, &state_id, off, len)) {
+	if (fi_read_uint32(buf + *off, &state_id, off, len) ||
+	    fi_read_uint8(buf + *off, &flags, off, len)) {
 		fprintf(rk_log, "fi_parse_when_command: Couldn't read "
 		    "state ID.\n");
 		return -1;
 	}
 
-	/* Skip NUL behind state ID */
-	*off+=1;
+	if ((flags & FI_BYTECODE_WHEN_KEY) &&
+	    (flags & FI_BYTECODE_WHEN_PER_KEY)) {
+		fprintf(rk_log, "fi_parse_when_command: A when can't be for "
+		    "one key and for every key.\n");
+		return -1;
+	}
+
+	if (flags & FI_BYTECODE_WHEN_SAMPLE) {
+		sp = &cmd->cmd_installhandler.sample;
+		if (fi_read_uint32(buf + *off, &sp->every, off, len) ||
+		    fi_read_uint32(buf + *off, &sp->skip, off, len) ||
+		    fi_read_uint32(buf + *off, &sp->p, off, len) ||
+		    fi_read_uint32(buf + *off, &sp->seed, off, len)) {
+			fprintf(rk_log, "fi_parse_when_command: Couldn't read "
+			    "sampling policy.\n");
+			return -1;
+		}
+		fi_check_sample(sp);
+	}
+
+	if (flags & FI_BYTECODE_WHEN_KEY) {
+		if (fi_read_uint32(buf + *off, &hi, off, len) ||
+		    fi_read_uint32(buf + *off, &lo, off, len)) {
+			fprintf(rk_log, "fi_parse_when_command: Couldn't read "
+			    "key.\n");
+			return -1;
+		}
+		cmd->cmd_installhandler.keyed = true;
+		cmd->cmd_installhandler.key = (uint64_t)hi << 32 | lo;
+	}
+	cmd->cmd_installhandler.per_key =
+	    (flags & FI_BYTECODE_WHEN_PER_KEY) != 0;
+
+	if (fi_note_install(c, e, state_id)) {
+		return -1;
+	}
 
 	cmd->cmd_installhandler.state_id = state_id;
 	rk_array_init(&cmd->cmd_installhandler.handlers, sizeof (struct rk_state_handler));
@@ -189,6 +593,8 @@ fi_parse_when_command(struct rk_run_config *c, struct rk_epoch *e,
 		case FI_STATE_PARSE_WHENBODY_RANGE:
 			if (!memcmp(buf + *off, FI_BYTECODE_WHEN_END, 4)) {
 				*off += 4;
+				fi_check_sorted(&cmd->cmd_installhandler);
+				fi_compute_disarm(&cmd->cmd_installhandler);
 				return 0;
 			} else {
 				handler = rk_state_handler_create(&cmd->cmd_installhandler.handlers);
@@ -215,7 +621,15 @@ fi_parse_when_command(struct rk_run_config *c, struct rk_epoch *e,
 			break;
 
 		case FI_STATE_PARSE_WHENBODY_COMMAND:
-			if (!memcmp(buf + *off, FI_BYTECODE_WHENCMD_CALLBACK, 2)) {
+			/* The evict modifier may be set on any command. */
+			op[0] = buf[*off] & ~FI_BYTECODE_WHENCMD_EVICT;
+			op[1] = buf[*off + 1];
+			handler->evict = (buf[*off] & FI_BYTECODE_WHENCMD_EVICT) != 0;
+			if (handler->evict) {
+				rk_evict_init();
+			}
+
+			if (!memcmp(op, FI_BYTECODE_WHENCMD_CALLBACK, 2)) {
 				handler->action = RK_HANDLER_CALLBACK;
 				*off += 2;
 				if (fi_read_uint32(buf + *off, &handler->act_callback,
@@ -224,13 +638,20 @@ fi_parse_when_command(struct rk_run_config *c, struct rk_epoch *e,
 					    "Couldn't read callback ID.\n");
 					return -1;
 				}
-			} else if (!memcmp(buf + *off, FI_BYTECODE_WHENCMD_CONTINUE, 2)) {
+				if (handler->act_callback >=
+				    rk_array_len(&c->callbacks)) {
+					fprintf(rk_log, "fi_parse_when_command: "
+					    "callback %u is not registered.\n",
+					    handler->act_callback);
+					return -1;
+				}
+			} else if (!memcmp(op, FI_BYTECODE_WHENCMD_CONTINUE, 2)) {
 				handler->action = RK_HANDLER_CONTINUE;
 				*off += 2;
-			} else if (!memcmp(buf + *off, FI_BYTECODE_WHENCMD_PANIC, 2)) {
+			} else if (!memcmp(op, FI_BYTECODE_WHENCMD_PANIC, 2)) {
 				handler->action = RK_HANDLER_PANIC;
 				*off += 2;
-			} else if (!memcmp(buf + *off, FI_BYTECODE_WHENCMD_SLEEP, 2)) {
+			} else if (!memcmp(op, FI_BYTECODE_WHENCMD_SLEEP, 2)) {
 				uint32_t u32;
 				uint8_t u8;
 
@@ -246,13 +667,100 @@ fi_parse_when_command(struct rk_run_config *c, struct rk_epoch *e,
 				if (fi_do_timespec(&handler->act_sleep, u8, u32)) {
 					return -1;
 				}
-			} else if (!memcmp(buf + *off, FI_BYTECODE_WHENCMD_WAIT, 2)) {
+			} else if (!memcmp(op, FI_BYTECODE_WHENCMD_WAIT, 2) ||
+			    !memcmp(op, FI_BYTECODE_WHENCMD_WAIT_FOR, 2)) {
+				uint32_t u32;
+				uint8_t u8;
+
 				handler->action = RK_HANDLER_WAIT;
 				*off += 2;
+				if (!memcmp(op, FI_BYTECODE_WHENCMD_WAIT_FOR, 2) &&
+				    (fi_read_uint8(buf + *off, &u8, off, len) ||
+				    fi_read_uint32(buf + *off, &u32, off, len) ||
+				    fi_do_timespec(&handler->wait_for, u8, u32))) {
+					fprintf(rk_log, "fi_parse_when_command: "
+					    "Couldn't read wait timespec.\n");
+					return -1;
+				}
 				if (rk_sema_init(&handler->act_sema, 0) == false) {
 					perror("fi_parse_when_command: rk_sema_init");
 					return -1;
 				}
+			} else if (!memcmp(op, FI_BYTECODE_WHENCMD_SPIN, 2)) {
+				handler->action = RK_HANDLER_SPIN;
+				*off += 2;
+				if (fi_read_uint32(buf + *off, &handler->act_spin,
+				    off, len)) {
+					fprintf(rk_log, "fi_parse_when_command: "
+					    "Couldn't read spin duration.\n");
+					return -1;
+				}
+				rk_spin_calibrate();
+			} else if (!memcmp(op, FI_BYTECODE_WHENCMD_JITTER, 2)) {
+				uint32_t a, b, seed;
+				uint8_t dist;
+
+				handler->action = RK_HANDLER_JITTER;
+				*off += 2;
+				if (fi_read_uint8(buf + *off, &dist, off, len) ||
+				    fi_read_uint32(buf + *off, &a, off, len) ||
+				    fi_read_uint32(buf + *off, &b, off, len) ||
+				    fi_read_uint32(buf + *off, &seed, off, len)) {
+					fprintf(rk_log, "fi_parse_when_command: "
+					    "Couldn't read jitter.\n");
+					return -1;
+				}
+
+				if (fi_do_jitter(&handler->act_jitter, dist, a, b,
+				    seed)) {
+					return -1;
+				}
+			} else if (!memcmp(op, FI_BYTECODE_WHENCMD_PIN, 2)) {
+				handler->action = RK_HANDLER_PIN;
+				*off += 2;
+				if (fi_read_uint32(buf + *off, &handler->act_pin.cpu,
+				    off, len)) {
+					fprintf(rk_log, "fi_parse_when_command: "
+					    "Couldn't read pin CPU.\n");
+					return -1;
+				}
+				rk_pin_init();
+			} else if (!memcmp(op, FI_BYTECODE_WHENCMD_PIN_SAME, 2) ||
+			    !memcmp(op, FI_BYTECODE_WHENCMD_PIN_FAR, 2)) {
+				uint32_t ref, start, end;
+
+				handler->action = !memcmp(op,
+				    FI_BYTECODE_WHENCMD_PIN_SAME, 2) ?
+				    RK_HANDLER_PIN_SAME : RK_HANDLER_PIN_FAR;
+				*off += 2;
+				if (fi_read_uint32(buf + *off, &ref, off, len) ||
+				    fi_read_uint32(buf + *off, &start, off, len) ||
+				    fi_read_uint32(buf + *off, &end, off, len)) {
+					fprintf(rk_log, "fi_parse_when_command: "
+					    "Couldn't read pin reference.\n");
+					return -1;
+				}
+
+				if (fi_do_pin_ref(c, e, state_id,
+				    &handler->act_pin, ref, start, end)) {
+					return -1;
+				}
+			} else if (!memcmp(op, FI_BYTECODE_WHENCMD_WAIT_UNTIL, 2)) {
+				uint32_t ref, start, end;
+
+				*off += 2;
+				if (fi_read_uint32(buf + *off, &ref, off, len) ||
+				    fi_read_uint32(buf + *off, &start, off, len) ||
+				    fi_read_uint32(buf + *off, &end, off, len)) {
+					fprintf(rk_log, "fi_parse_when_command: "
+					    "Couldn't read wait-until reference.\n");
+					return -1;
+				}
+
+				if (fi_do_until_ref(c, e, state_id, handler, ref,
+				    start, end)) {
+					return -1;
+				}
 			} else {
 				fprintf(rk_log, "fi_parse_when_command: "
 				    "Invalid / unrecognized command: ");
@@ -309,11 +817,14 @@ fi_parse_timeout_command(struct rk_run_config *c, struct rk_epoch *e,
 	return 0;
 }
 
+static int	fi_check_resume(struct rk_run_config *, struct rk_epoch *,
+		    struct rk_command *);
+static int	fi_check_resume_handler(struct rk_state_handler *);
+
 static int
 fi_parse_resume_command(struct rk_run_config *c, struct rk_epoch *e,
     uint8_t *buf, uint32_t *off, uint32_t len)
 {
-	struct rk_state_handler *handler;
 	struct rk_command *cmd;
 
 	cmd = rk_command_create(e);
@@ -333,6 +844,15 @@ fi_parse_resume_command(struct rk_run_config *c, struct rk_epoch *e,
 		return -1;
 	}
 
+	return fi_check_resume(c, e, cmd);
+}
+
+static int
+fi_check_resume(struct rk_run_config *c, struct rk_epoch *e,
+    struct rk_command *cmd)
+{
+	struct rk_state_handler *handler;
+
 	if (cmd->cmd_resume.state_id >= rk_array_len(&c->states)) {
 		fprintf(rk_log, "fi_parse_resume_command: resume state id "
 		    "exceeds number of configured states.\n");
@@ -342,6 +862,14 @@ fi_parse_resume_command(struct rk_run_config *c, struct rk_epoch *e,
 	/* Make sure that the range we are resuming is expecting to wake up. */
 	handler = rk_config_find_handler(c, e, cmd->cmd_resume.state_id,
 	    cmd->cmd_resume.tr_start, cmd->cmd_resume.tr_end);
+	cmd->cmd_resume.handler = handler;
+	return fi_check_resume_handler(handler);
+}
+
+static int
+fi_check_resume_handler(struct rk_state_handler *handler)
+{
+
 	if (handler == NULL) {
 		fprintf(rk_log, "fi_parse_resume_command: invalid state "
 		    "to resume.\n");
@@ -364,67 +892,195 @@ fi_parse_resume_command(struct rk_run_config *c, struct rk_epoch *e,
 	return 0;
 }
 
-static int
-fi_parse_bytecode(struct rk_run_config *config, uint8_t *bytecode, uint32_t len)
+static struct rk_epoch *
+fi_begin_timeslice(struct rk_run_config *config, uint32_t slice_id,
+    uint8_t notify)
 {
-	struct fi_bytecode_timeslice ts;
-	enum finnish_parse_states state;
-	struct rk_epoch *cur_epoch;
-	uint32_t off, u;
-
-	state = FI_STATE_PARSE_TIMESLICE;
-	off = 0;
-	while (off < len) {
-		switch (state) {
-		case FI_STATE_PARSE_TIMESLICE:
-			if (off + sizeof(ts) > len) {
-				fprintf(rk_log, "fi_parse_bytecode: Expected "
-				    "timeslice, but remaining data cannot fill "
-				    "that size.\n");
-				return -1;
-			}
+	struct rk_epoch *e;
+	uint32_t n;
+
+	/*
+	 * Epochs are numbered by their position, which the install index
+	 * and the scheduler both rely on.
+	 */
+	n = rk_array_len(&config->epochs);
+	if (slice_id != n) {
+		fprintf(rk_log, "fi_parse_bytecode: New epoch "
+		    "offset invalid (%" PRIu32 ", expected %" PRIu32 ").\n",
+		    slice_id, n);
+		return NULL;
+	}
 
-			if (memcmp(bytecode + off, FI_BYTECODE_TIMESLICE,
-			    sizeof (ts.prologue))) {
-				fprintf(rk_log, "fi_parse_bytecode: Expected "
-				    "timeslice prologue, but got junk.\n");
-				return -1;
-			}
+	if (notify != 0 && notify != 1) {
+		fprintf(rk_log, "fi_parse_bytecode: Invalid "
+		    "notify value.\n");
+		return NULL;
+	}
 
-			off += sizeof(ts.prologue);
+	/* The streaming client's requests would be mistaken for jatka. */
+	if (notify && config->streaming) {
+		fprintf(rk_log, "fi_parse_bytecode: Notifications are "
+		    "not supported when streaming.\n");
+		return NULL;
+	}
 
-			memcpy(&ts.slice_id, bytecode + off, sizeof (ts.slice_id));
-			ts.slice_id = be32toh(ts.slice_id);
+	e = rk_epoch_create(config);
+	if (e == NULL) {
+		fprintf(rk_log, "fi_parse_bytecode: Out of "
+		    "memory for new timeslice.\n");
+		return NULL;
+	}
+	e->epoch = slice_id;
+	if (notify) {
+		rk_epoch_set_notify(e);
+	} else {
+		e->notify = 0;
+	}
 
-			u = rk_array_len(&config->epochs) - 1;
-			if (u && ts.slice_id - u != 1) {
-				fprintf(rk_log, "fi_parse_bytecode: New epoch "
-				    "offset invalid (%" PRIu32 " - %" PRIu32 ".\n",
-				    ts.slice_id, u);
-				return -1;
-			}
+	return e;
+}
 
-			off += sizeof (ts.slice_id);
-			ts.notify = bytecode[off];
-			if (ts.notify != 0 && ts.notify != 1) {
-				fprintf(rk_log, "fi_parse_bytecode: Invalid "
-				    "notify value.\n");
+/*
+ * Wait until every state armed since the last plain waitstate has had its
+ * interesting ordinals entered. Anything armed before that was already
+ * waited for, so the states to wait on are exactly the pending ones.
+ */
+static int
+fi_parse_waitstate(struct rk_run_config *c, struct rk_epoch *e)
+{
+	struct rk_command *cmd;
+	uint32_t *ids, n, i;
+
+	last_waitstate = e->epoch;
+	cmd = rk_command_create(e);
+	if (cmd == NULL) {
+		fprintf(rk_log, "fi_parse_bytecode: "
+		    "Out of memory for waitstate "
+		    "command.\n");
+		return -1;
+	}
+
+	cmd->command = RK_COMMAND_WAITSTATE;
+
+	ids = rk_array_first(&c->wait_pending);
+	n = rk_array_len(&c->wait_pending);
+	for (i = 0; i < n; i++) {
+		c->wait_marked[ids[i]] = 0;
+	}
+	cmd->cmd_waitstate.states = c->wait_pending;
+	rk_array_init(&c->wait_pending, sizeof (uint32_t));
+
+	return 0;
+}
+
+/*
+ * Wait until threads have arrived at every ordinal of one of a state's
+ * ranges. The range has to be one installed for the state at this point,
+ * like for a resume.
+ */
+static int
+fi_parse_waitrange(struct rk_run_config *c, struct rk_epoch *e,
+    uint32_t state_id, uint32_t tr_start, uint32_t tr_end)
+{
+	struct rk_state_handler *handler;
+	struct rk_command *cmd;
+
+	if (state_id >= rk_array_len(&c->states)) {
+		fprintf(rk_log, "fi_parse_waitrange: state id exceeds number "
+		    "of configured states.\n");
+		return -1;
+	}
+
+	if (tr_end == UINT_MAX) {
+		fprintf(rk_log, "fi_parse_waitrange: can't wait for a range "
+		    "up to N.\n");
+		return -1;
+	}
+
+	handler = rk_config_find_handler(c, e, state_id, tr_start, tr_end);
+	if (handler == NULL) {
+		fprintf(rk_log, "fi_parse_waitrange: no such range for "
+		    "state.\n");
+		return -1;
+	}
+
+	/* Threads may have gone through a live range without being counted. */
+	if (fi_install_live(c, state_id)) {
+		fprintf(rk_log, "fi_parse_waitrange: state %u may already be "
+		    "armed by an earlier request.\n", state_id);
+		return -1;
+	}
+
+	if (fi_undo_note(c, e, state_id, handler) != 0) {
+		return -1;
+	}
+
+	if (handler->watched == false) {
+		if (rk_sema_init(&handler->arrival, 0) == false) {
+			perror("fi_parse_waitrange: rk_sema_init");
+			return -1;
+		}
+		handler->watched = true;
+	}
+	fi_keep_armed(c, e, state_id, handler);
+
+	cmd = rk_command_create(e);
+	if (cmd == NULL) {
+		fprintf(rk_log, "fi_parse_waitrange: Out of memory for "
+		    "waitstate command.\n");
+		return -1;
+	}
+
+	cmd->command = RK_COMMAND_WAITSTATE;
+	cmd->cmd_waitstate.handler = handler;
+	cmd->cmd_waitstate.state_id = state_id;
+	cmd->cmd_waitstate.tr_start = tr_start;
+	cmd->cmd_waitstate.tr_end = tr_end;
+	last_waitstate = e->epoch;
+
+	return 0;
+}
+
+static int
+fi_parse_bytecode(struct rk_run_config *config, uint8_t *bytecode, uint32_t len)
+{
+	struct fi_bytecode_timeslice ts;
+	enum finnish_parse_states state;
+	struct rk_epoch *cur_epoch;
+	uint32_t off;
+
+	state = FI_STATE_PARSE_TIMESLICE;
+	off = 0;
+	while (off < len) {
+		switch (state) {
+		case FI_STATE_PARSE_TIMESLICE:
+			if (off + sizeof(ts) > len) {
+				fprintf(rk_log, "fi_parse_bytecode: Expected "
+				    "timeslice, but remaining data cannot fill "
+				    "that size.\n");
 				return -1;
 			}
+
+			if (memcmp(bytecode + off, FI_BYTECODE_TIMESLICE,
+			    sizeof (ts.prologue))) {
+				fprintf(rk_log, "fi_parse_bytecode: Expected "
+				    "timeslice prologue, but got junk.\n");
+				return -1;
+			}
+
+			off += sizeof(ts.prologue);
+
+			memcpy(&ts.slice_id, bytecode + off, sizeof (ts.slice_id));
+			ts.slice_id = be32toh(ts.slice_id);
+			off += sizeof (ts.slice_id);
+			ts.notify = bytecode[off];
 			off++;
 
-			cur_epoch = rk_epoch_create(config);
+			cur_epoch = fi_begin_timeslice(config, ts.slice_id,
+			    ts.notify);
 			if (cur_epoch == NULL) {
-				fprintf(rk_log, "fi_parse_bytecode: Out of "
-				    "memory for new timeslice.\n");
 				return -1;
 			}
-			cur_epoch->epoch = ts.slice_id;
-			if (ts.notify) {
-				rk_epoch_set_notify(cur_epoch);
-			} else {
-				cur_epoch->notify = 0;
-			}
 
 			state = FI_STATE_PARSE_COMMAND;
 			break;
@@ -452,20 +1108,23 @@ fi_parse_bytecode(struct rk_run_config *config, uint8_t *bytecode, uint32_t len)
 					return -1;
 				}
 				continue;
+			} else if (!memcmp(bytecode + off, FI_BYTECODE_WAITRANGE, 4)) {
+				uint32_t state_id, tr_start, tr_end;
+
+				off += 4;
+				if (fi_read_uint32(bytecode + off, &state_id, &off, len) ||
+				    fi_read_uint32(bytecode + off, &tr_start, &off, len) ||
+				    fi_read_uint32(bytecode + off, &tr_end, &off, len) ||
+				    fi_parse_waitrange(config, cur_epoch, state_id,
+				    tr_start, tr_end)) {
+					return -1;
+				}
+				continue;
 			} else if (!memcmp(bytecode + off, FI_BYTECODE_WAITSTATE, 4)) {
-				struct rk_command *cmd;
-
-				last_waitstate = cur_epoch->epoch;
-				cmd = rk_command_create(cur_epoch);
-				if (cmd == NULL) {
-					fprintf(rk_log, "fi_parse_bytecode: "
-					    "Out of memory for waitstate "
-					    "command.\n");
+				if (fi_parse_waitstate(config, cur_epoch)) {
 					return -1;
 				}
 				off += 4;
-
-				cmd->command = RK_COMMAND_WAITSTATE;
 				continue;
 			} else if (!memcmp(bytecode + off, FI_BYTECODE_WHEN, 4)) {
 				if (fi_parse_when_command(config, cur_epoch,
@@ -485,6 +1144,535 @@ fi_parse_bytecode(struct rk_run_config *config, uint8_t *bytecode, uint32_t len)
 	return 0;
 }
 
+static int
+fi_read_uleb(uint8_t *buf, uint32_t *dest, uint32_t *off, uint32_t len)
+{
+	uint32_t v, i;
+
+	v = 0;
+	for (i = 0; i < 5; i++) {
+		if (*off + i + 1 > len) {
+			fprintf(rk_log, "fi_read_uleb: not enough data "
+			    "available\n");
+			return -1;
+		}
+
+		v |= (uint32_t)(buf[i] & 0x7f) << (7 * i);
+		if ((buf[i] & 0x80) == 0) {
+			if (i == 4 && buf[i] > 0x0f) {
+				break;
+			}
+
+			*dest = v;
+			*off += i + 1;
+			return 0;
+		}
+	}
+
+	fprintf(rk_log, "fi_read_uleb: value does not fit 32 bits\n");
+	return -1;
+}
+
+/*
+ * A span of 0 stands for a range that runs to N. Anything else is the number
+ * of ordinals in the range.
+ */
+static int
+fi_compact_range(uint32_t start, uint32_t span, uint32_t *end)
+{
+
+	if (span == 0) {
+		*end = UINT_MAX;
+		return 0;
+	}
+
+	if (start == 0 || span - 1 >= UINT_MAX - start) {
+		fprintf(rk_log, "fi_parse_compact: invalid range\n");
+		return -1;
+	}
+
+	*end = start + span - 1;
+	return 0;
+}
+
+/*
+ * Each handler starts with an action byte, followed by the gap between the
+ * end of the previous range and the start of this one, the span of the
+ * range, and the arguments of the action. With FI_COMPACT_RUN set, every
+ * ordinal in the range gets its own handler, as if they had been specified
+ * one by one. A when with flags has them after the state ID, followed by
+ * the sampling policy and the key as its low and high halves, if the flags
+ * say so.
+ */
+static int
+fi_parse_compact_when(struct rk_run_config *c, struct rk_epoch *e,
+    uint8_t op, uint8_t *buf, uint32_t *off, uint32_t len)
+{
+	struct rk_state_handler tmpl, *handler;
+	struct rk_cmd_installhandler *ih;
+	uint32_t state_id, gap, span, next, start, end, u, v, w, seed;
+	struct rk_command *cmd;
+	uint8_t a, unit, flags;
+
+	if (fi_read_uleb(buf + *off, &state_id, off, len)) {
+		fprintf(rk_log, "fi_parse_compact_when: Couldn't read "
+		    "state ID.\n");
+		return -1;
+	}
+
+	cmd = rk_command_create(e);
+	if (cmd == NULL) {
+		fprintf(rk_log, "fi_parse_compact_when: Out of memory "
+		    "creating when command.\n");
+		return -1;
+	}
+	cmd->command = RK_COMMAND_INSTALLHANDLER;
+
+	ih = &cmd->cmd_installhandler;
+	ih->state_id = state_id;
+	rk_array_init(&ih->handlers, sizeof (struct rk_state_handler));
+
+	flags = 0;
+	if (op == FI_COMPACT_WHEN_FLAGS &&
+	    fi_read_uint8(buf + *off, &flags, off, len)) {
+		fprintf(rk_log, "fi_parse_compact_when: Couldn't read "
+		    "flags.\n");
+		return -1;
+	}
+
+	if ((flags & FI_BYTECODE_WHEN_KEY) &&
+	    (flags & FI_BYTECODE_WHEN_PER_KEY)) {
+		fprintf(rk_log, "fi_parse_compact_when: A when can't be for "
+		    "one key and for every key.\n");
+		return -1;
+	}
+
+	if (flags & FI_BYTECODE_WHEN_SAMPLE) {
+		if (fi_read_uleb(buf + *off, &ih->sample.every, off, len) ||
+		    fi_read_uleb(buf + *off, &ih->sample.skip, off, len) ||
+		    fi_read_uleb(buf + *off, &ih->sample.p, off, len) ||
+		    fi_read_uleb(buf + *off, &ih->sample.seed, off, len)) {
+			fprintf(rk_log, "fi_parse_compact_when: Couldn't read "
+			    "sampling policy.\n");
+			return -1;
+		}
+		fi_check_sample(&ih->sample);
+	}
+
+	if (flags & FI_BYTECODE_WHEN_KEY) {
+		if (fi_read_uleb(buf + *off, &u, off, len) ||
+		    fi_read_uleb(buf + *off, &v, off, len)) {
+			fprintf(rk_log, "fi_parse_compact_when: Couldn't read "
+			    "key.\n");
+			return -1;
+		}
+		ih->keyed = true;
+		ih->key = (uint64_t)v << 32 | u;
+	}
+	ih->per_key = (flags & FI_BYTECODE_WHEN_PER_KEY) != 0;
+
+	if (fi_note_install(c, e, state_id)) {
+		return -1;
+	}
+
+	next = 1;
+	for (;;) {
+		if (fi_read_uint8(buf + *off, &a, off, len)) {
+			fprintf(rk_log, "fi_parse_compact_when: ran out of "
+			    "buffer while parsing when body.\n");
+			return -1;
+		}
+
+		if (a == FI_COMPACT_WHEN_END) {
+			fi_check_sorted(ih);
+			fi_compute_disarm(ih);
+			return 0;
+		}
+
+		if (next == 0) {
+			fprintf(rk_log, "fi_parse_compact_when: range after "
+			    "N.\n");
+			return -1;
+		}
+
+		if (fi_read_uleb(buf + *off, &gap, off, len) ||
+		    fi_read_uleb(buf + *off, &span, off, len)) {
+			fprintf(rk_log, "fi_parse_compact_when: Couldn't read "
+			    "thread range.\n");
+			return -1;
+		}
+
+		if (gap > UINT_MAX - next) {
+			fprintf(rk_log, "fi_parse_compact_when: invalid "
+			    "range\n");
+			return -1;
+		}
+		start = next + gap;
+		if (fi_compact_range(start, span, &end)) {
+			return -1;
+		}
+
+		memset(&tmpl, 0, sizeof (tmpl));
+		tmpl.epoch = e->epoch;
+		tmpl.evict = (a & FI_COMPACT_EVICT) != 0;
+		if (tmpl.evict) {
+			rk_evict_init();
+		}
+
+		switch (a & ~(FI_COMPACT_RUN | FI_COMPACT_EVICT)) {
+		case FI_COMPACT_CALLBACK:
+			tmpl.action = RK_HANDLER_CALLBACK;
+			if (fi_read_uleb(buf + *off, &tmpl.act_callback, off,
+			    len)) {
+				fprintf(rk_log, "fi_parse_compact_when: "
+				    "Couldn't read callback ID.\n");
+				return -1;
+			}
+			if (tmpl.act_callback >= rk_array_len(&c->callbacks)) {
+				fprintf(rk_log, "fi_parse_compact_when: "
+				    "callback %u is not registered.\n",
+				    tmpl.act_callback);
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_CONTINUE:
+			tmpl.action = RK_HANDLER_CONTINUE;
+			break;
+
+		case FI_COMPACT_PANIC:
+			tmpl.action = RK_HANDLER_PANIC;
+			break;
+
+		case FI_COMPACT_SLEEP:
+			tmpl.action = RK_HANDLER_SLEEP;
+			if (fi_read_uint8(buf + *off, &unit, off, len) ||
+			    fi_read_uleb(buf + *off, &u, off, len)) {
+				fprintf(rk_log, "fi_parse_compact_when: "
+				    "Couldn't read sleep timespec.\n");
+				return -1;
+			}
+
+			if (fi_do_timespec(&tmpl.act_sleep, unit, u)) {
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_WAIT:
+			tmpl.action = RK_HANDLER_WAIT;
+			break;
+
+		case FI_COMPACT_WAIT_FOR:
+			tmpl.action = RK_HANDLER_WAIT;
+			if (fi_read_uint8(buf + *off, &unit, off, len) ||
+			    fi_read_uleb(buf + *off, &u, off, len) ||
+			    fi_do_timespec(&tmpl.wait_for, unit, u)) {
+				fprintf(rk_log, "fi_parse_compact_when: "
+				    "Couldn't read wait timespec.\n");
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_SPIN:
+			tmpl.action = RK_HANDLER_SPIN;
+			if (fi_read_uleb(buf + *off, &tmpl.act_spin, off, len)) {
+				fprintf(rk_log, "fi_parse_compact_when: "
+				    "Couldn't read spin duration.\n");
+				return -1;
+			}
+			rk_spin_calibrate();
+			break;
+
+		case FI_COMPACT_JITTER:
+			tmpl.action = RK_HANDLER_JITTER;
+			if (fi_read_uint8(buf + *off, &unit, off, len) ||
+			    fi_read_uleb(buf + *off, &u, off, len) ||
+			    fi_read_uleb(buf + *off, &v, off, len) ||
+			    fi_read_uleb(buf + *off, &seed, off, len)) {
+				fprintf(rk_log, "fi_parse_compact_when: "
+				    "Couldn't read jitter.\n");
+				return -1;
+			}
+
+			if (fi_do_jitter(&tmpl.act_jitter, unit, u, v, seed)) {
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_PIN:
+			tmpl.action = RK_HANDLER_PIN;
+			if (fi_read_uleb(buf + *off, &tmpl.act_pin.cpu, off, len)) {
+				fprintf(rk_log, "fi_parse_compact_when: "
+				    "Couldn't read pin CPU.\n");
+				return -1;
+			}
+			rk_pin_init();
+			break;
+
+		case FI_COMPACT_PIN_SAME:
+		case FI_COMPACT_PIN_FAR:
+			tmpl.action = (a & ~(FI_COMPACT_RUN | FI_COMPACT_EVICT)) ==
+			    FI_COMPACT_PIN_SAME ?
+			    RK_HANDLER_PIN_SAME : RK_HANDLER_PIN_FAR;
+			if (fi_read_uleb(buf + *off, &u, off, len) ||
+			    fi_read_uleb(buf + *off, &v, off, len) ||
+			    fi_read_uleb(buf + *off, &w, off, len)) {
+				fprintf(rk_log, "fi_parse_compact_when: "
+				    "Couldn't read pin reference.\n");
+				return -1;
+			}
+
+			if (fi_compact_range(v, w, &w) ||
+			    fi_do_pin_ref(c, e, state_id, &tmpl.act_pin, u, v,
+			    w)) {
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_WAIT_UNTIL:
+			if (fi_read_uleb(buf + *off, &u, off, len) ||
+			    fi_read_uleb(buf + *off, &v, off, len) ||
+			    fi_read_uleb(buf + *off, &w, off, len)) {
+				fprintf(rk_log, "fi_parse_compact_when: "
+				    "Couldn't read wait-until reference.\n");
+				return -1;
+			}
+
+			if (fi_compact_range(v, w, &w) ||
+			    fi_do_until_ref(c, e, state_id, &tmpl, u, v, w)) {
+				return -1;
+			}
+			break;
+
+		default:
+			fprintf(rk_log, "fi_parse_compact_when: Invalid / "
+			    "unrecognized command: %02x\n", a);
+			return -1;
+		}
+
+		if ((a & FI_COMPACT_RUN) && end == UINT_MAX) {
+			fprintf(rk_log, "fi_parse_compact_when: a run can't "
+			    "extend to N.\n");
+			return -1;
+		}
+
+		do {
+			handler = rk_state_handler_create(&ih->handlers);
+			if (handler == NULL) {
+				fprintf(rk_log, "fi_parse_compact_when: Out of "
+				    "memory creating state handler.\n");
+				return -1;
+			}
+
+			*handler = tmpl;
+			handler->tr_start = start;
+			handler->tr_end = (a & FI_COMPACT_RUN) ? start : end;
+			if (handler->action == RK_HANDLER_WAIT &&
+			    rk_sema_init(&handler->act_sema, 0) == false) {
+				perror("fi_parse_compact_when: rk_sema_init");
+				return -1;
+			}
+		} while ((a & FI_COMPACT_RUN) && start++ < end);
+
+		if (end == UINT_MAX) {
+			ih->tr_max = start;
+		}
+		next = end + 1;
+	}
+}
+
+static int
+fi_parse_compact_resume(struct rk_run_config *c, struct rk_epoch *e,
+    uint8_t op, uint8_t *buf, uint32_t *off, uint32_t len)
+{
+	uint32_t state_id, start, n, end, n_handlers, k;
+	struct rk_cmd_installhandler *ih;
+	struct rk_state_handler *h;
+	struct rk_command *cmd;
+
+	if (fi_read_uleb(buf + *off, &state_id, off, len) ||
+	    fi_read_uleb(buf + *off, &start, off, len) ||
+	    fi_read_uleb(buf + *off, &n, off, len)) {
+		fprintf(rk_log, "fi_parse_compact_resume: Couldn't read "
+		    "bytecode values.\n");
+		return -1;
+	}
+
+	if (fi_compact_range(start, n, &end)) {
+		return -1;
+	}
+
+	if (op == FI_COMPACT_RESUME) {
+		cmd = rk_command_create(e);
+		if (cmd == NULL) {
+			fprintf(rk_log, "fi_parse_compact_resume: Out of "
+			    "memory creating resume command.\n");
+			return -1;
+		}
+		cmd->command = RK_COMMAND_RESUME;
+		cmd->cmd_resume.state_id = state_id;
+		cmd->cmd_resume.tr_start = start;
+		cmd->cmd_resume.tr_end = end;
+
+		return fi_check_resume(c, e, cmd);
+	}
+
+	/*
+	 * A run resumes each ordinal from start to end on its own. Compact
+	 * when bodies are sorted by ordinal, so once the first handler has
+	 * been found the rest can be checked in a single pass instead of
+	 * being looked up one at a time.
+	 */
+	if (end == UINT_MAX) {
+		fprintf(rk_log, "fi_parse_compact_resume: a run can't "
+		    "extend to N.\n");
+		return -1;
+	}
+
+	if (state_id >= rk_array_len(&c->states)) {
+		fprintf(rk_log, "fi_parse_compact_resume: resume state id "
+		    "exceeds number of configured states.\n");
+		return -1;
+	}
+
+	ih = rk_config_find_install(c, e, state_id);
+	if (ih == NULL) {
+		fprintf(rk_log, "fi_parse_compact_resume: invalid state "
+		    "to resume.\n");
+		return -1;
+	}
+
+	h = rk_array_first(&ih->handlers);
+	n_handlers = rk_array_len(&ih->handlers);
+	k = ih->sorted ? rk_config_find_ordinal(ih, start) : 0;
+	do {
+		while (k < n_handlers && h[k].tr_end < start) {
+			k++;
+		}
+
+		if (fi_check_resume_handler(k < n_handlers &&
+		    h[k].tr_start == start && h[k].tr_end == start ?
+		    &h[k] : NULL)) {
+			return -1;
+		}
+
+		cmd = rk_command_create(e);
+		if (cmd == NULL) {
+			fprintf(rk_log, "fi_parse_compact_resume: Out of "
+			    "memory creating resume command.\n");
+			return -1;
+		}
+		cmd->command = RK_COMMAND_RESUME;
+		cmd->cmd_resume.state_id = state_id;
+		cmd->cmd_resume.tr_start = start;
+		cmd->cmd_resume.tr_end = start;
+		cmd->cmd_resume.handler = &h[k];
+	} while (start++ < end);
+
+	return 0;
+}
+
+static int
+fi_parse_compact(struct rk_run_config *config, uint8_t *bytecode, uint32_t len)
+{
+	uint32_t off, u, state_id, start, span, end;
+	struct rk_epoch *cur_epoch;
+	struct rk_command *cmd;
+	uint8_t op, u8;
+
+	cur_epoch = NULL;
+	off = 0;
+	while (off < len) {
+		op = bytecode[off++];
+		if ((cur_epoch == NULL) != (op == FI_COMPACT_TIMESLICE)) {
+			fprintf(rk_log, "fi_parse_compact: unexpected opcode "
+			    "%02x %s timeslice.\n", op,
+			    cur_epoch == NULL ? "outside" : "inside");
+			return -1;
+		}
+
+		switch (op) {
+		case FI_COMPACT_TIMESLICE:
+			if (fi_read_uleb(bytecode + off, &u, &off, len) ||
+			    fi_read_uint8(bytecode + off, &u8, &off, len)) {
+				return -1;
+			}
+
+			cur_epoch = fi_begin_timeslice(config, u, u8);
+			if (cur_epoch == NULL) {
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_TIMESLICE_END:
+			cur_epoch = NULL;
+			break;
+
+		case FI_COMPACT_WHEN:
+		case FI_COMPACT_WHEN_FLAGS:
+			if (fi_parse_compact_when(config, cur_epoch, op,
+			    bytecode, &off, len)) {
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_RESUME:
+		case FI_COMPACT_RESUME_RUN:
+			if (fi_parse_compact_resume(config, cur_epoch, op,
+			    bytecode, &off, len)) {
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_TIMEOUT:
+			cmd = rk_command_create(cur_epoch);
+			if (cmd == NULL) {
+				fprintf(rk_log, "fi_parse_compact: Out of "
+				    "memory creating timeout command.\n");
+				return -1;
+			}
+			cmd->command = RK_COMMAND_TIMEOUT;
+
+			if (fi_read_uint8(bytecode + off, &u8, &off, len) ||
+			    fi_read_uleb(bytecode + off, &u, &off, len) ||
+			    fi_do_timespec(&cmd->cmd_timeout.timeout, u8, u)) {
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_WAITRANGE:
+			if (fi_read_uleb(bytecode + off, &state_id, &off, len) ||
+			    fi_read_uleb(bytecode + off, &start, &off, len) ||
+			    fi_read_uleb(bytecode + off, &span, &off, len) ||
+			    fi_compact_range(start, span, &end) ||
+			    fi_parse_waitrange(config, cur_epoch, state_id,
+			    start, end)) {
+				return -1;
+			}
+			break;
+
+		case FI_COMPACT_WAITSTATE:
+			if (fi_parse_waitstate(config, cur_epoch)) {
+				return -1;
+			}
+			break;
+
+		default:
+			fprintf(rk_log, "fi_parse_compact: Invalid opcode "
+			    "%02x.\n", op);
+			return -1;
+		}
+	}
+
+	if (cur_epoch != NULL) {
+		fprintf(rk_log, "fi_parse_compact: ran out of buffer inside "
+		    "timeslice.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static ssize_t
 fi_read(int fd, void *buf, size_t size)
 {
@@ -559,6 +1747,7 @@ static int
 fi_wait_hei(struct rk_run_config *config)
 {
 	struct fi_packet_hei hei;
+	uint16_t dialect;
 
 	if (fi_read(config->client_fd, &hei, sizeof (hei)) != sizeof (hei)) {
 		return fi_write_ei(config);
@@ -568,66 +1757,285 @@ fi_wait_hei(struct rk_run_config *config)
 		return fi_write_ei(config);
 	}
 
-	if (be16toh(hei.dialect) != FI_DIALECT) {
+	/* Dialects other than 0x0000 are sets of flags. */
+	dialect = be16toh(hei.dialect);
+	if (dialect & ~(FI_DIALECT_STREAM | FI_DIALECT_COMPACT)) {
 		return fi_write_ei(config);
 	}
 
+	config->streaming = (dialect & FI_DIALECT_STREAM) != 0;
+	config->compact = (dialect & FI_DIALECT_COMPACT) != 0;
+
 	return fi_write_joo(config);
 }
 
 static int
-fi_read_ota_se(struct rk_run_config *config)
+fi_write_hei_hei(struct rk_run_config *config)
 {
-	struct fi_packet_ota_se ota_se;
-	struct fi_packet_loppu loppu;
-	uint8_t *bytecode;
-	uint32_t len;
+	uint8_t hei_hei[7] = { 0x68, 0x65, 0x69, 0x20, 0x68, 0x65, 0x69 };
 
-	if (fi_read(config->client_fd, &ota_se, sizeof (ota_se)) !=
-	    sizeof (ota_se)) {
-		return fi_write_ei(config);
+	return (fi_write(config->client_fd, hei_hei, sizeof (hei_hei)) ==
+	    sizeof (hei_hei));
+}
+
+static int
+fi_undo_save(struct rk_run_config *c, struct fi_undo *u)
+{
+
+	u->n_epochs = rk_array_len(&c->epochs);
+	u->last_waitstate = last_waitstate;
+	u->flags = NULL;
+	u->n_flags = 0;
+	u->cap_flags = 0;
+	u->n_pending = rk_array_len(&c->wait_pending);
+	u->pending = NULL;
+	if (u->n_pending > 0) {
+		u->pending = malloc(u->n_pending * sizeof (*u->pending));
+		if (u->pending == NULL) {
+			return -1;
+		}
+		memcpy(u->pending, rk_array_first(&c->wait_pending),
+		    u->n_pending * sizeof (*u->pending));
 	}
 
-	if (memcmp(ota_se.prologue, "ota se", sizeof (ota_se.prologue))) {
-		return fi_write_ei(config);
+	return 0;
+}
+
+/*
+ * Put back the states pending a waitstate. The request may have appended
+ * to them, or handed them to a waitstate command that is thrown away. Its
+ * references to earlier ranges are forgotten, latest first.
+ */
+static void
+fi_undo_restore(struct rk_run_config *c, struct fi_undo *u)
+{
+	struct fi_undo_flags *f;
+	uint32_t *id, i;
+
+	last_waitstate = u->last_waitstate;
+	for (i = u->n_flags; i-- > 0;) {
+		f = &u->flags[i];
+		f->handler->gated = f->gated;
+		f->handler->gate_left = f->gate_left;
+		f->handler->watched = f->watched;
+		f->handler->located = f->located;
+		f->install->disarm_at = f->disarm_at;
 	}
 
-	len = be32toh(ota_se.length);
+	if (c->wait_marked != NULL) {
+		memset(c->wait_marked, 0, rk_array_len(&c->states) *
+		    sizeof (*c->wait_marked));
+	}
+
+	rk_array_truncate(&c->wait_pending, 0);
+	for (i = 0; i < u->n_pending; i++) {
+		id = rk_array_append(&c->wait_pending);
+		if (id == NULL) {
+			break;
+		}
+		*id = u->pending[i];
+		c->wait_marked[*id] = 1;
+	}
+}
+
+/*
+ * Read and parse the bytecode following an `ota se` header, up to and
+ * including `loppu`. Epochs are appended under epoch_lock, since in the
+ * streaming dialect the scheduler is already running; if the bytecode turns
+ * out to be invalid, none of it is kept. Sends `ei` on failure.
+ */
+static int
+fi_read_bytecode(struct rk_run_config *config, struct fi_packet_ota_se *ota_se)
+{
+	struct fi_packet_loppu loppu;
+	struct fi_undo undo;
+	uint32_t len;
+	uint8_t *bytecode;
+	int r;
+
+	len = be32toh(ota_se->length);
 	bytecode = calloc(1, len);
 	if (bytecode == NULL) {
 		fprintf(rk_log, "fi_read_ota_se: couldn't allocate %" PRIu32
 		    " bytes\n", len);
-		return fi_write_ei(config);
+		fi_write_ei(config);
+		return -1;
 	}
 
 	if (fi_read(config->client_fd, bytecode, len) != len) {
 		free(bytecode);
-		return fi_write_ei(config);
+		fi_write_ei(config);
+		return -1;
 	}
 
-	if (fi_parse_bytecode(config, bytecode, len) != 0) {
+	pthread_mutex_lock(&config->epoch_lock);
+	if (fi_undo_save(config, &undo) != 0) {
+		pthread_mutex_unlock(&config->epoch_lock);
 		free(bytecode);
+		fprintf(rk_log, "fi_read_ota_se: Out of memory.\n");
+		fi_write_ei(config);
+		return -1;
+	}
+
+	cur_undo = &undo;
+	if (config->compact) {
+		r = fi_parse_compact(config, bytecode, len);
+	} else {
+		r = fi_parse_bytecode(config, bytecode, len);
+	}
+	cur_undo = NULL;
+	if (r != 0) {
+		rk_array_truncate(&config->epochs, undo.n_epochs);
+		rk_config_reindex(config);
+		fi_undo_restore(config, &undo);
+	} else {
+		pthread_cond_broadcast(&config->epoch_cv);
+	}
+	pthread_mutex_unlock(&config->epoch_lock);
+	free(undo.flags);
+	free(undo.pending);
+	free(bytecode);
+
+	if (r != 0) {
 		fprintf(rk_log, "fi_read_ota_se: couldn't parse bytecode\n");
-		return fi_write_ei(config);
+		fi_write_ei(config);
+		return -1;
 	}
 
 	if (fi_read(config->client_fd, &loppu, sizeof (loppu)) !=
 	    sizeof (loppu)) {
-		free(bytecode);
 		fprintf(rk_log, "fi_read_ota_se: loppu missing\n");
-		return fi_write_ei(config);
+		fi_write_ei(config);
+		return -1;
 	}
 
 	if (memcmp(loppu.prologue, "loppu", sizeof (loppu.prologue))) {
-		free(bytecode);
 		fprintf(rk_log, "fi_read_ota_se: loppu invalid\n");
+		fi_write_ei(config);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+fi_read_ota_se(struct rk_run_config *config)
+{
+	struct fi_packet_ota_se ota_se;
+
+	if (fi_read(config->client_fd, &ota_se, sizeof (ota_se)) !=
+	    sizeof (ota_se)) {
 		return fi_write_ei(config);
 	}
 
-	free(bytecode);
+	if (memcmp(ota_se.prologue, "ota se", sizeof (ota_se.prologue))) {
+		return fi_write_ei(config);
+	}
+
+	if (fi_read_bytecode(config, &ota_se) != 0) {
+		return -1;
+	}
+
 	return fi_write_joo(config);
 }
 
+/*
+ * In the streaming dialect the client keeps talking after the first `ota
+ * se`. Further `ota se` requests append epochs to the running schedule;
+ * `hei hei` (or the client going away) means no more are coming. The `joo`
+ * for a request is held back while the client is more than
+ * FI_STREAM_WINDOW epochs ahead of the scheduler, so a client that waits for
+ * `joo` before sending more never runs far ahead of the program.
+ */
+static void *
+fi_serve(void *arg)
+{
+	struct rk_run_config *config = arg;
+	struct fi_packet_ota_se ota_se;
+	uint8_t *rest;
+	uint8_t c;
+
+	rest = (uint8_t *)&ota_se + sizeof (ota_se.prologue);
+	for (;;) {
+		if (fi_read(config->client_fd, ota_se.prologue,
+		    sizeof (ota_se.prologue)) != sizeof (ota_se.prologue)) {
+			break;
+		}
+
+		if (!memcmp(ota_se.prologue, "hei he", sizeof (ota_se.prologue))) {
+			if (fi_read(config->client_fd, &c, 1) == 1 && c == 'i') {
+				fi_write_hei_hei(config);
+			} else {
+				fi_write_ei(config);
+			}
+			break;
+		}
+
+		if (memcmp(ota_se.prologue, "ota se", sizeof (ota_se.prologue))) {
+			fprintf(rk_log, "fi_serve: expected ota se or hei hei\n");
+			fi_write_ei(config);
+			break;
+		}
+
+		if (fi_read(config->client_fd, rest,
+		    sizeof (ota_se) - sizeof (ota_se.prologue)) !=
+		    sizeof (ota_se) - sizeof (ota_se.prologue)) {
+			fi_write_ei(config);
+			break;
+		}
+
+		if (fi_read_bytecode(config, &ota_se) != 0) {
+			break;
+		}
+
+		pthread_mutex_lock(&config->epoch_lock);
+		while (rk_array_len(&config->epochs) - config->next_epoch >
+		    FI_STREAM_WINDOW && config->sched_done == false) {
+			pthread_cond_wait(&config->epoch_cv, &config->epoch_lock);
+		}
+		pthread_mutex_unlock(&config->epoch_lock);
+
+		if (!fi_write_joo(config)) {
+			break;
+		}
+	}
+
+	pthread_mutex_lock(&config->epoch_lock);
+	config->stream_done = true;
+	pthread_cond_broadcast(&config->epoch_cv);
+	pthread_mutex_unlock(&config->epoch_lock);
+
+	close(config->client_fd);
+	return NULL;
+}
+
+/*
+ * Tell the client that the scheduler is entering an epoch, and wait for it
+ * to say `jatka`. Only used outside the streaming dialect, where nothing
+ * else reads from the client once the schedule is loaded.
+ */
+int
+fi_notify(struct rk_run_config *config, uint32_t epoch)
+{
+	uint8_t vaihtaa[11] = { 0x76, 0x61, 0x69, 0x68, 0x74, 0x61, 0x61 };
+	uint8_t jatka[5];
+	uint32_t be;
+
+	be = htobe32(epoch);
+	memcpy(&vaihtaa[7], &be, sizeof (be));
+	if (fi_write(config->client_fd, vaihtaa, sizeof (vaihtaa)) !=
+	    sizeof (vaihtaa)) {
+		return -1;
+	}
+
+	if (fi_read(config->client_fd, jatka, sizeof (jatka)) !=
+	    sizeof (jatka) || memcmp(jatka, "jatka", sizeof (jatka))) {
+		return -1;
+	}
+
+	return 0;
+}
+
 int
 fi_negotiate_config(struct rk_run_config *config)
 {
@@ -651,6 +2059,16 @@ fi_negotiate_config(struct rk_run_config *config)
 		config->fi_state = FI_STATE_LINGER;
 		/* FALLTHROUGH */
 	case FI_STATE_LINGER:
+		if (config->streaming) {
+			pthread_t t;
+
+			if (pthread_create(&t, NULL, fi_serve, config) != 0) {
+				perror("fi_negotiate_config: pthread_create");
+				config->stream_done = true;
+				break;
+			}
+			pthread_detach(t);
+		}
 		break;
 	}
 
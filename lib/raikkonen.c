@@ -31,12 +31,15 @@
 #include <sys/socket.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -49,7 +52,12 @@
 static pthread_t rk_scheduler;
 static struct rk_sema rk_initialized;
 
-struct rk_run_config rk_config;
+struct rk_run_config rk_config = {
+	.park_lock = PTHREAD_MUTEX_INITIALIZER,
+	.park_cv = PTHREAD_COND_INITIALIZER,
+	.epoch_lock = PTHREAD_MUTEX_INITIALIZER,
+	.epoch_cv = PTHREAD_COND_INITIALIZER,
+};
 
 FILE *rk_log;
 
@@ -73,6 +81,12 @@ rk_get_config(void)
 	case AF_INET6:
 		sl = sizeof (*rk_config.rksin6);
 		break;
+	case AF_UNIX:
+		sl = sizeof (*rk_config.rksun);
+
+		/* A socket left behind by an earlier run would make bind fail. */
+		unlink(rk_config.rksun->sun_path);
+		break;
 	default:
 		fprintf(rk_log, "rk_get_config: impossible sa_family %d\n",
 		    rk_config.rksa->sa_family);
@@ -95,12 +109,19 @@ rk_get_config(void)
 		return -1;
 	}
 
+	rsl = sizeof (remote);
 	a = accept(fd, (struct sockaddr *)&remote, &rsl);
 	if (a < 0) {
 		perror("rk_get_config: accept");
 		return -1;
 	}
 
+	/* Notifications are a few bytes each way; don't let them sit. */
+	if (rk_config.rksa->sa_family != AF_UNIX &&
+	    setsockopt(a, IPPROTO_TCP, TCP_NODELAY, &so, sizeof (so)) == -1) {
+		perror("rk_get_config: setsockopt(TCP_NODELAY)");
+	}
+
 	/* 
 	 * Don't really care about future stuff. If there's a protocol error,
 	 * accepting some other connection is only going to be more confusing.
@@ -116,12 +137,78 @@ rk_get_config(void)
 	return 0;
 }
 
+static void
+rk_scheduler_release(bool *posted)
+{
+
+	if (*posted == true) {
+		return;
+	}
+
+	*posted = true;
+	if (rk_sema_post(&rk_initialized) == false) {
+		perror("rk_thread_scheduler: rk_sema_post(initialized)");
+	}
+}
+
+/*
+ * Fetch the next epoch to run. When a streaming client has not sent it yet,
+ * let the program run up to the current boundary and wait for it.
+ */
+static bool
+rk_scheduler_fetch(uint32_t epoch, struct rk_epoch *e, bool *posted)
+{
+
+	if (rk_epoch_get(&rk_config, epoch, e, false) == true) {
+		return true;
+	}
+
+	rk_scheduler_release(posted);
+	return rk_epoch_get(&rk_config, epoch, e, true);
+}
+
+/*
+ * Wait for threads to get somewhere. In shared mode, a process may die
+ * before it does; then the schedule is abandoned and false is returned.
+ */
+static bool
+rk_scheduler_park(struct rk_sema *s, const char *what)
+{
+	uint64_t since;
+
+	since = rk_config.wake_stats ? rk_spin_ns() : 0;
+	if (rk_config.low_latency) {
+		rk_latency_poll(s);
+	}
+
+	if (rk_config.shm == NULL) {
+		if (rk_thread_park(s) == false) {
+			perror(what);
+		}
+		rk_latency_woken(s, since);
+		return true;
+	}
+
+	if (rk_shm_wait(s) == true) {
+		rk_latency_woken(s, since);
+		return true;
+	}
+
+	if (errno != EOWNERDEAD) {
+		perror(what);
+		return true;
+	}
+
+	rk_shm_abandon();
+	return false;
+}
+
 static void *
 rk_thread_scheduler(void *arg)
 {
-	struct rk_epoch *cur_epoch;
+	struct rk_epoch cur_epoch;
 	uint32_t epoch = 0;
-	bool posted;
+	bool posted, staged;
 
 	/* If we fail, let the program go on; we've already whined */
 	if (rk_get_config() != 0) {
@@ -131,24 +218,59 @@ rk_thread_scheduler(void *arg)
 		return (NULL);
 	}
 
+	/*
+	 * The scheduler is one of the threads that has to be blocked before
+	 * virtual time may advance.
+	 */
+	if (rk_config.accounting) {
+		rk_thread_enter();
+	}
+	rk_latency_setup();
+	rk_watchdog_start();
+	rk_telemetry_start();
+	rk_record_start();
+
 	posted = false;
+	staged = false;
 	while (1) {
-		if (epoch < rk_array_len(&rk_config.epochs)) {
+		if (rk_scheduler_fetch(epoch, &cur_epoch, &posted)) {
 			struct rk_command *commands;
 			uint32_t n_commands, i;
 
-			cur_epoch = rk_array_first(&rk_config.epochs);
-			cur_epoch = &cur_epoch[epoch];
+			/*
+			 * A notifying epoch doesn't start until the client
+			 * says so. Past the first epoch, the program has
+			 * already been set up and may run in the meantime.
+			 */
+			if (cur_epoch.notify) {
+				if (epoch > 0) {
+					rk_scheduler_release(&posted);
+				}
+				if (fi_notify(&rk_config, epoch) != 0) {
+					fprintf(rk_log, "rk_thread_scheduler: "
+					    "client unreachable for epoch %"
+					    PRIu32 "\n", epoch);
+					abort();
+				}
+			}
 
-			commands = rk_array_first(&cur_epoch->commands);
-			n_commands = rk_array_len(&cur_epoch->commands);
+			commands = rk_array_first(&cur_epoch.commands);
+			n_commands = rk_array_len(&cur_epoch.commands);
 			for (i = 0; i < n_commands; i++) {
 				struct rk_state_handler *handler;
 				struct rk_state *wakestate;
-				struct rk_state_iter it;
-				struct timespec rem;
-				uint32_t n_wake;
-				int r;
+				uint32_t n_wake, n_ids, k;
+				uint32_t *ids;
+
+				ck_pr_store_32(&rk_config.cur_epoch, epoch);
+				ck_pr_store_32(&rk_config.cur_command, i);
+
+				/* A run of installs goes live all at once. */
+				if (staged &&
+				    commands[i].command != RK_COMMAND_INSTALLHANDLER) {
+					rk_state_publish();
+					staged = false;
+				}
 
 				if (posted == false &&
 				    (commands[i].command == RK_COMMAND_TIMEOUT ||
@@ -159,31 +281,23 @@ rk_thread_scheduler(void *arg)
 					 * handlers are installed before the
 					 * program proceeds.
 					 */
-					posted = true;
-					if (rk_sema_post(&rk_initialized) == false) {
-						perror("rk_thread_scheduler: rk_sema_post(initialized)");
-					}
+					rk_scheduler_release(&posted);
 				}
 
 				switch (commands[i].command) {
 				case RK_COMMAND_INSTALLHANDLER:
-					wakestate = rk_array_first(&rk_config.states);
-					wakestate = &wakestate[commands[i].cmd_installhandler.state_id];
-					wakestate->cur_thread = 1;
-					wakestate->cap_thread = commands[i].cmd_installhandler.tr_max;
-					wakestate->handlers = &commands[i].cmd_installhandler.handlers;
+					wakestate = rk_state_get(commands[i].cmd_installhandler.state_id);
+					rk_state_arm(wakestate, &commands[i].cmd_installhandler);
+					staged = true;
 					break;
 
 				case RK_COMMAND_RESUME:
 					n_wake = (commands[i].cmd_resume.tr_end - commands[i].cmd_resume.tr_start) + 1;
-					wakestate = rk_array_first(&rk_config.states);
-					wakestate = &wakestate[commands[i].cmd_resume.state_id];
-					handler = rk_state_find_handler(wakestate,
-					    commands[i].cmd_resume.tr_start,
-					    commands[i].cmd_resume.tr_end);
+					handler = commands[i].cmd_resume.handler;
 
 					while (n_wake--) {
-						if (rk_sema_post(&handler->act_sema) == false) {
+						if (rk_thread_unpark_timed(&handler->act_sema,
+						    &handler->timed_out) == false) {
 							perror("rk_thread_scheduler: rk_sema_post(act)");
 						}
 					}
@@ -191,32 +305,53 @@ rk_thread_scheduler(void *arg)
 					break;
 					
 				case RK_COMMAND_TIMEOUT:
-					do {
-						r = nanosleep(&commands[i].cmd_timeout.timeout, &rem);
-						commands[i].cmd_timeout.timeout.tv_sec = rem.tv_sec;
-						commands[i].cmd_timeout.timeout.tv_nsec = rem.tv_nsec;
-					} while (r == -1 && errno == EINTR);
+					/* Sleeping on schedule isn't being stuck. */
+					ck_pr_store_8((uint8_t *)&rk_config.sched_sleeping, true);
+					rk_thread_sleep(&commands[i].cmd_timeout.timeout);
+					ck_pr_store_8((uint8_t *)&rk_config.sched_sleeping, false);
 					break;
 					
 				case RK_COMMAND_WAITSTATE:
-					memset(&it, 0, sizeof (it));
-					while ((wakestate = rk_config_iterate_state(&rk_config, cur_epoch, &it)) != NULL) {
-						if (ck_pr_load_32(&wakestate->cap_thread) == UINT_MAX) {
+					handler = commands[i].cmd_waitstate.handler;
+					if (handler != NULL) {
+						n_wake = (commands[i].cmd_waitstate.tr_end - commands[i].cmd_waitstate.tr_start) + 1;
+						while (n_wake--) {
+							if (rk_scheduler_park(&handler->arrival,
+							    "rk_thread_scheduler: rk_sema_wait(arrival)") == false) {
+								goto done;
+							}
+						}
+						break;
+					}
+
+					ids = rk_array_first(&commands[i].cmd_waitstate.states);
+					n_ids = rk_array_len(&commands[i].cmd_waitstate.states);
+					for (k = 0; k < n_ids; k++) {
+						wakestate = rk_state_get(ids[k]);
+						if (wakestate->snapshot == NULL ||
+						    ck_pr_load_32(&wakestate->snapshot->cap_thread) == UINT_MAX) {
 							continue;
 						}
 
-						if (rk_sema_wait(&wakestate->waitstate) == false) {
-							perror("rk_thread_scheduler: rk_sema_wait(waitstate)");
+						if (rk_scheduler_park(&wakestate->snapshot->waitstate,
+						    "rk_thread_scheduler: rk_sema_wait(waitstate)") == false) {
+							goto done;
 						}
 					}
 					break;
 				}
 			}
+
+			if (staged) {
+				rk_state_publish();
+				staged = false;
+			}
 		} else {
 			/*
 			 * Once the epoch transitions out of the configured
-			 * range, there's not really anything else we can do.
-			 * Exit the thread to avoid spinning.
+			 * range and the client will not send any more, there's
+			 * not really anything else we can do. Exit the thread
+			 * to avoid spinning.
 			 */
 			break;
 		}
@@ -224,12 +359,19 @@ rk_thread_scheduler(void *arg)
 		epoch++;
 	}
 
+done:
+	rk_latency_report();
+	pthread_mutex_lock(&rk_config.epoch_lock);
+	ck_pr_store_8((uint8_t *)&rk_config.sched_done, true);
+	pthread_cond_broadcast(&rk_config.epoch_cv);
+	pthread_mutex_unlock(&rk_config.epoch_lock);
 	return NULL;
 }
 
-void
-rk_start_internal(union rk_sockaddr *rk_sa)
+static void
+rk_start_common(union rk_sockaddr *rk_sa, bool wait)
 {
+	socklen_t sl;
 
 	rk_log = stderr;
 	setlinebuf(rk_log);
@@ -237,12 +379,37 @@ rk_start_internal(union rk_sockaddr *rk_sa)
 	/* Cowardly refuse to do anything if our configuration is bogus. */
 	if (rk_sa == NULL || rk_array_len(&rk_config.states) == 0 ||
 	    (rk_sa->rk_sa->sa_family != AF_INET &&
-	     rk_sa->rk_sa->sa_family != AF_INET6)) {
+	     rk_sa->rk_sa->sa_family != AF_INET6 &&
+	     rk_sa->rk_sa->sa_family != AF_UNIX)) {
 		fprintf(rk_log, "Bogus configuration; not running.\n");
 		return;
 	}
 
-	rk_config.rk_sa.rk_sa = rk_sa->rk_sa;
+	/* Sleepers in other processes can't be seen to advance the clock. */
+	if (rk_config.shm != NULL && rk_config.virtual_time) {
+		fprintf(rk_log, "Virtual time is not supported in shared mode; "
+		    "not running.\n");
+		return;
+	}
+
+	/*
+	 * The scheduler binds the address after we return, and the caller's
+	 * may be gone by then when we don't wait for it.
+	 */
+	switch (rk_sa->rk_sa->sa_family) {
+	case AF_INET:
+		sl = sizeof (*rk_sa->rk_sin4);
+		break;
+	case AF_INET6:
+		sl = sizeof (*rk_sa->rk_sin6);
+		break;
+	default:
+		sl = sizeof (*rk_sa->rk_sun);
+		break;
+	}
+	memcpy(&rk_config.sa_storage, rk_sa->rk_sa, sl);
+	rk_config.rk_sa.rk_sa = (struct sockaddr *)&rk_config.sa_storage;
+	rk_fuzz_start();
 
 	if (rk_sema_init(&rk_initialized, 0) == false) {
 		perror("rk_start: rk_sema_init");
@@ -250,5 +417,26 @@ rk_start_internal(union rk_sockaddr *rk_sa)
 	}
 	pthread_create(&rk_scheduler, NULL, rk_thread_scheduler, NULL);
 	pthread_detach(rk_scheduler);
-	rk_sema_wait(&rk_initialized);
+	if (wait) {
+		rk_sema_wait(&rk_initialized);
+	}
+}
+
+void
+rk_start_internal(union rk_sockaddr *rk_sa)
+{
+
+	rk_start_common(rk_sa, true);
+}
+
+/*
+ * Start without waiting for a schedule. Every state stays unarmed until a
+ * client connects, and the first epoch's `when` commands then go live
+ * together while the program runs.
+ */
+void
+rk_start_async_internal(union rk_sockaddr *rk_sa)
+{
+
+	rk_start_common(rk_sa, false);
 }
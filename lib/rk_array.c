@@ -42,40 +42,59 @@ rk_array_init(struct rk_array *a, size_t elmsize)
 
 	assert(a != NULL);
 	a->nelm = 0;
+	a->cap = 0;
 	a->elmsize = elmsize;
+	a->buf = NULL;
 }
 
+/*
+ * Storage grows by doubling, so building large arrays one element at a time
+ * stays linear. Elements still move when it grows; don't keep pointers into
+ * an array that is still being appended to. In shared mode, storage comes
+ * from the arena and outgrown storage is left where it is.
+ */
 void *
 rk_array_append(struct rk_array *a)
 {
 	void *nbuf, *obuf;
-	uint32_t nelm;
+	uint32_t cap;
 	int r;
 
 	assert(a != NULL);
 	assert(a->elmsize > 0);
 
-	nelm = ++a->nelm;
-	obuf = a->buf;
-
-	r = posix_memalign(&nbuf, 64, a->elmsize * nelm);
-	if (r != 0) {
-		perror("rk_array_append: posix_memalign");
-		return NULL;
-	}
-
-	if (nelm > 1) {
-		memcpy(nbuf, obuf, a->elmsize * (nelm - 1));
+	if (a->nelm == a->cap) {
+		cap = a->cap ? a->cap * 2 : 4;
+		obuf = a->buf;
+
+		if (rk_config.shm != NULL) {
+			nbuf = rk_shm_alloc(a->elmsize * cap);
+			if (nbuf == NULL) {
+				return NULL;
+			}
+		} else {
+			r = posix_memalign(&nbuf, 64, a->elmsize * cap);
+			if (r != 0) {
+				perror("rk_array_append: posix_memalign");
+				return NULL;
+			}
+		}
+
+		if (a->nelm > 0) {
+			memcpy(nbuf, obuf, a->elmsize * a->nelm);
+		}
+
+		a->buf = nbuf;
+		a->cap = cap;
+
+		if (obuf != NULL && rk_shm_owns(obuf) == false) {
+			free(obuf);
+		}
 	}
 
-	a->buf = nbuf;
-	nbuf = nbuf + (a->elmsize * (nelm - 1));
+	nbuf = a->buf + (a->elmsize * a->nelm++);
 	memset(nbuf, 0, a->elmsize);
 
-	if (obuf != NULL) {
-		free(obuf);
-	}
-
 	return nbuf;
 }
 
@@ -94,3 +113,14 @@ rk_array_len(struct rk_array *a)
 	assert(a != NULL);
 	return a->nelm;
 }
+
+/* Forget every element past the first n. */
+void
+rk_array_truncate(struct rk_array *a, uint32_t n)
+{
+
+	assert(a != NULL);
+	if (n < a->nelm) {
+		a->nelm = n;
+	}
+}
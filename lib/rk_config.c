@@ -27,8 +27,12 @@
  *
  */
 
+#include <assert.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <limits.h>
+
+#include <ck_pr.h>
 
 #include "raikkonen.h"
 #include "raikkonen_internal.h"
@@ -41,86 +45,231 @@ rk_config_get_internal(void)
 	void *pun = &rk_config;
 
 	if (!once++) {
-		rk_array_init(&rk_config.states, sizeof (struct rk_state));
-		rk_array_init(&rk_config.callbacks, sizeof (void (*)()));
+		rk_array_init(&rk_config.states, sizeof (struct rk_state *));
+		rk_array_init(&rk_config.callbacks, sizeof (struct rk_cbdef));
 		rk_array_init(&rk_config.epochs, sizeof (struct rk_epoch));
+		rk_array_init(&rk_config.installs,
+		    sizeof (struct rk_install_ref));
+		rk_array_init(&rk_config.retired,
+		    sizeof (struct rk_state_snapshot *));
+		rk_array_init(&rk_config.wait_pending, sizeof (uint32_t));
+		ck_epoch_init(&rk_config.reclaim);
 	}
 
 	return pun;
 }
 
-struct rk_state_handler *
-rk_config_find_handler(struct rk_run_config *c, struct rk_epoch *max,
-    uint32_t state_id, uint32_t tr_start, uint32_t tr_end)
+/*
+ * Register a function for `callback` actions. Like states, callbacks are
+ * numbered in the order they are registered, and scripts refer to them by
+ * that number.
+ */
+uint32_t
+rk_callback_register_internal(struct rk_config *cfg, const char *name,
+    int (*cb)(uint32_t, void *))
 {
-	struct rk_epoch *epochs;
-	uint32_t i;
+	struct rk_run_config *c;
+	struct rk_cbdef *def;
+	void *pun;
 
-	epochs = rk_array_first(&c->epochs);
-	for (i = 0; i <= max->epoch; i++) {
-		struct rk_command *cmds;
-		uint32_t n_cmds, j;
+	assert(cfg != NULL);
+	pun = cfg;
+	c = pun;
 
-		cmds = rk_array_first(&epochs[i].commands);
-		n_cmds = rk_array_len(&epochs[i].commands);
+	def = rk_array_append(&c->callbacks);
+	if (def == NULL) {
+		return UINT_MAX;
+	}
 
-		for (j = 0; j < n_cmds; j++) {
-			struct rk_state_handler *handlers;
-			uint32_t n_handlers, k;
+	def->cb_name = (char *)name;
+	def->cb = cb;
+	def->cb_id = rk_array_len(&c->callbacks) - 1;
 
-			if (cmds[j].command != RK_COMMAND_INSTALLHANDLER ||
-			    cmds[j].cmd_installhandler.state_id != state_id) {
-				continue;
-			}
+	return def->cb_id;
+}
 
-			handlers = rk_array_first(&cmds->cmd_installhandler.handlers);
-			n_handlers = rk_array_len(&cmds->cmd_installhandler.handlers);
-			for (k = 0; k < n_handlers; k++) {
-				if (handlers[k].tr_start != tr_start ||
-				    handlers[k].tr_end != tr_end) {
-					continue;
-				}
+static struct rk_cbdef *
+rk_callback_get(struct rk_config *cfg, uint32_t cb_id)
+{
+	struct rk_run_config *c;
+	struct rk_cbdef *defs;
+	void *pun;
 
-				return &handlers[k];
-			}
+	assert(cfg != NULL);
+	pun = cfg;
+	c = pun;
+
+	if (cb_id >= rk_array_len(&c->callbacks)) {
+		return NULL;
+	}
+
+	defs = rk_array_first(&c->callbacks);
+	return &defs[cb_id];
+}
+
+/* How many times a callback has been run, in this or any shared process. */
+uint64_t
+rk_callback_calls_internal(struct rk_config *cfg, uint32_t cb_id)
+{
+	struct rk_cbdef *def;
+
+	def = rk_callback_get(cfg, cb_id);
+	return def != NULL ? ck_pr_load_64(&def->calls) : 0;
+}
+
+/* How many of those runs found something wrong. */
+uint64_t
+rk_callback_failures_internal(struct rk_config *cfg, uint32_t cb_id)
+{
+	struct rk_cbdef *def;
+
+	def = rk_callback_get(cfg, cb_id);
+	return def != NULL ? ck_pr_load_64(&def->failures) : 0;
+}
+
+/*
+ * Record that the last command of epoch e installs handlers for state_id.
+ * Installs are parsed in the order they run, so this is the one that is live
+ * until the state is armed again.
+ */
+int
+rk_config_index_install(struct rk_run_config *c, struct rk_epoch *e,
+    uint32_t state_id)
+{
+	struct rk_install_ref *ref;
+
+	while (rk_array_len(&c->installs) <= state_id) {
+		ref = rk_array_append(&c->installs);
+		if (ref == NULL) {
+			return -1;
 		}
+		ref->epoch = UINT_MAX;
 	}
 
-	return NULL;
+	ref = rk_array_first(&c->installs);
+	ref[state_id].epoch = e->epoch;
+	ref[state_id].command = rk_array_len(&e->commands) - 1;
+
+	return 0;
 }
 
-struct rk_state *
-rk_config_iterate_state(struct rk_run_config *c, struct rk_epoch *max,
-    struct rk_state_iter *it)
+/*
+ * Build the install index again from the epochs that are left, after the
+ * parser has thrown away some that referred to it.
+ */
+void
+rk_config_reindex(struct rk_run_config *c)
 {
+	struct rk_install_ref *ref;
 	struct rk_epoch *epochs;
-	uint32_t i;
+	uint32_t i, n;
+
+	ref = rk_array_first(&c->installs);
+	n = rk_array_len(&c->installs);
+	for (i = 0; i < n; i++) {
+		ref[i].epoch = UINT_MAX;
+	}
 
 	epochs = rk_array_first(&c->epochs);
-	for (i = it->i; i <= max->epoch; i++) {
+	n = rk_array_len(&c->epochs);
+	for (i = 0; i < n; i++) {
 		struct rk_command *cmds;
-		uint32_t n_cmds, j;
+		uint32_t j;
 
 		cmds = rk_array_first(&epochs[i].commands);
-		n_cmds = rk_array_len(&epochs[i].commands);
-
-		for (j = it->j; j < n_cmds; j++) {
-			struct rk_state *s;
-
+		for (j = 0; j < rk_array_len(&epochs[i].commands); j++) {
 			if (cmds[j].command != RK_COMMAND_INSTALLHANDLER) {
 				continue;
 			}
 
-			s = rk_array_first(&c->states);
-			s = &s[cmds[j].cmd_installhandler.state_id];
+			ref = rk_array_first(&c->installs);
+			ref = &ref[cmds[j].cmd_installhandler.state_id];
+			ref->epoch = i;
+			ref->command = j;
+		}
+	}
+}
 
-			it->i = i;
-			it->j = j + 1;
-			if (it->j >= n_cmds) {
-				it->i++;
-				it->j = 0;
-			}
-			return s;
+/*
+ * A state may be armed again in a later epoch; only the most recent install
+ * up to max is live.
+ */
+struct rk_cmd_installhandler *
+rk_config_find_install(struct rk_run_config *c, struct rk_epoch *max,
+    uint32_t state_id)
+{
+	struct rk_install_ref *ref;
+	struct rk_epoch *epochs;
+	struct rk_command *cmd;
+
+	if (state_id >= rk_array_len(&c->installs)) {
+		return NULL;
+	}
+
+	ref = rk_array_first(&c->installs);
+	ref = &ref[state_id];
+	if (ref->epoch == UINT_MAX || ref->epoch > max->epoch) {
+		return NULL;
+	}
+
+	epochs = rk_array_first(&c->epochs);
+	cmd = rk_array_first(&epochs[ref->epoch].commands);
+	return &cmd[ref->command].cmd_installhandler;
+}
+
+/*
+ * Find the first handler of a sorted install whose range ends at or after
+ * ordinal, or the number of handlers if there is none.
+ */
+uint32_t
+rk_config_find_ordinal(struct rk_cmd_installhandler *ih, uint32_t ordinal)
+{
+	struct rk_state_handler *handlers;
+	uint32_t lo, hi, mid;
+
+	handlers = rk_array_first(&ih->handlers);
+	lo = 0;
+	hi = rk_array_len(&ih->handlers);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (handlers[mid].tr_end < ordinal) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+struct rk_state_handler *
+rk_config_find_handler(struct rk_run_config *c, struct rk_epoch *max,
+    uint32_t state_id, uint32_t tr_start, uint32_t tr_end)
+{
+	struct rk_cmd_installhandler *ih;
+	struct rk_state_handler *handlers;
+	uint32_t n_handlers, k;
+
+	ih = rk_config_find_install(c, max, state_id);
+	if (ih == NULL) {
+		return NULL;
+	}
+
+	handlers = rk_array_first(&ih->handlers);
+	n_handlers = rk_array_len(&ih->handlers);
+	if (ih->sorted) {
+		k = rk_config_find_ordinal(ih, tr_start);
+		if (k < n_handlers && handlers[k].tr_start == tr_start &&
+		    handlers[k].tr_end == tr_end) {
+			return &handlers[k];
+		}
+		return NULL;
+	}
+
+	for (k = 0; k < n_handlers; k++) {
+		if (handlers[k].tr_start == tr_start &&
+		    handlers[k].tr_end == tr_end) {
+			return &handlers[k];
 		}
 	}
 
@@ -28,6 +28,8 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -73,3 +75,37 @@ rk_epoch_set_notify(struct rk_epoch *e)
 	e->notify = true;
 }
 
+
+/*
+ * Copy out epoch n for the scheduler. A streaming client may append epochs
+ * while the schedule runs, which moves the epoch array; the commands of an
+ * epoch do not move once it has been parsed, so a copy stays usable without
+ * holding the lock. If wait is set and the client may still send more, block
+ * until epoch n arrives or the client says it is done.
+ */
+bool
+rk_epoch_get(struct rk_run_config *c, uint32_t n, struct rk_epoch *dst,
+    bool wait)
+{
+	struct rk_epoch *epochs;
+	bool found;
+
+	pthread_mutex_lock(&c->epoch_lock);
+	while (wait && n >= rk_array_len(&c->epochs) &&
+	    c->streaming && c->stream_done == false) {
+		pthread_cond_wait(&c->epoch_cv, &c->epoch_lock);
+	}
+
+	found = n < rk_array_len(&c->epochs);
+	if (found) {
+		epochs = rk_array_first(&c->epochs);
+		*dst = epochs[n];
+
+		/* Makes room in the client's window. */
+		c->next_epoch = n + 1;
+		pthread_cond_broadcast(&c->epoch_cv);
+	}
+	pthread_mutex_unlock(&c->epoch_lock);
+
+	return found;
+}
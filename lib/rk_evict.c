@@ -0,0 +1,193 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+enum rk_evict_method {
+	RK_EVICT_NONE,
+	RK_EVICT_CLFLUSHOPT,
+	RK_EVICT_CLFLUSH,
+	RK_EVICT_SWEEP,
+};
+
+static enum rk_evict_method rk_evict_method;
+static size_t rk_evict_line = 64;
+
+/* Without a flush instruction, evict by touching more than fits in cache. */
+static volatile uint8_t *rk_evict_buf;
+static size_t rk_evict_size = 32 << 20;
+
+static size_t
+rk_evict_sysfs(int index, const char *what)
+{
+	unsigned long v;
+	char path[128];
+	char unit;
+	FILE *f;
+	int n;
+
+	snprintf(path, sizeof (path),
+	    "/sys/devices/system/cpu/cpu0/cache/index%d/%s", index, what);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	unit = '\0';
+	n = fscanf(f, "%lu%c", &v, &unit);
+	fclose(f);
+	if (n < 1) {
+		return 0;
+	}
+
+	if (unit == 'K') {
+		v <<= 10;
+	} else if (unit == 'M') {
+		v <<= 20;
+	}
+
+	return v;
+}
+
+static void
+rk_evict_init_sweep(void)
+{
+	size_t size, largest;
+	int i;
+
+	largest = 0;
+	for (i = 0; i < 8; i++) {
+		size = rk_evict_sysfs(i, "size");
+		if (size > largest) {
+			largest = size;
+		}
+	}
+
+	size = rk_evict_sysfs(0, "coherency_line_size");
+	if (size != 0) {
+		rk_evict_line = size;
+	}
+	if (largest != 0) {
+		rk_evict_size = largest * 2;
+	}
+
+	rk_evict_buf = calloc(1, rk_evict_size);
+	if (rk_evict_buf == NULL) {
+		perror("rk_evict_init: calloc");
+		return;
+	}
+
+	rk_evict_method = RK_EVICT_SWEEP;
+}
+
+/*
+ * Pick a way to evict. Called by the parser the first time it sees the
+ * evict modifier, so that the sweep buffer is only allocated when needed.
+ */
+void
+rk_evict_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+#endif
+
+	if (rk_evict_method != RK_EVICT_NONE) {
+		return;
+	}
+
+#if defined(__x86_64__) || defined(__i386__)
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (edx & (1U << 19))) {
+		rk_evict_line = ((ebx >> 8) & 0xff) * 8;
+		rk_evict_method = RK_EVICT_CLFLUSH;
+
+		if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+		    (ebx & (1U << 23))) {
+			rk_evict_method = RK_EVICT_CLFLUSHOPT;
+		}
+		return;
+	}
+#endif
+
+	rk_evict_init_sweep();
+}
+
+/*
+ * Write the lines back and drop them from every level of the hierarchy, so
+ * that the caller's next access to them misses. The fence makes sure that
+ * the flushes are done before the thread goes on.
+ */
+void
+rk_evict(const void *data, size_t len)
+{
+	uintptr_t p, end;
+	size_t i;
+
+	p = (uintptr_t)data & ~(uintptr_t)(rk_evict_line - 1);
+	end = (uintptr_t)data + len;
+
+	switch (rk_evict_method) {
+#if defined(__x86_64__) || defined(__i386__)
+	case RK_EVICT_CLFLUSHOPT:
+		for (; p < end; p += rk_evict_line) {
+			__asm__ __volatile__("clflushopt %0" : "+m" (*(volatile char *)p));
+		}
+		_mm_sfence();
+		break;
+
+	case RK_EVICT_CLFLUSH:
+		for (; p < end; p += rk_evict_line) {
+			_mm_clflush((const void *)p);
+		}
+		_mm_mfence();
+		break;
+#endif
+
+	case RK_EVICT_SWEEP:
+		for (i = 0; i < rk_evict_size; i += rk_evict_line) {
+			rk_evict_buf[i]++;
+		}
+		break;
+
+	default:
+		break;
+	}
+}
@@ -0,0 +1,123 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ck_pr.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+/* Edge ID of the last state this thread entered, shifted as in AFL. */
+static __thread uint32_t rk_fuzz_prev;
+
+/*
+ * Attach the coverage bitmap if a fuzzing driver started us. This runs
+ * before the schedule is loaded, so that states can be armed accordingly.
+ */
+void
+rk_fuzz_start(void)
+{
+	unsigned long id;
+	const char *env;
+	char *end;
+	void *map;
+
+	env = getenv(RK_FUZZ_ENV);
+	if (env == NULL) {
+		return;
+	}
+
+	errno = 0;
+	id = strtoul(env, &end, 10);
+	if (errno != 0 || *end != '\0' || end == env) {
+		fprintf(rk_log, "rk_fuzz_start: bad %s '%s'\n", RK_FUZZ_ENV,
+		    env);
+		return;
+	}
+
+	map = shmat(id, NULL, 0);
+	if (map == (void *)-1) {
+		perror("rk_fuzz_start: shmat");
+		return;
+	}
+
+	rk_config.fuzz_map = map;
+
+	/* Coverage counts unarmed states too. */
+	rk_state_detour_all();
+}
+
+/*
+ * Small ordinals are interesting one by one; past that, only their order
+ * of magnitude is. Unarmed states are bucket 0, so there are 9 in all.
+ */
+static uint32_t
+rk_fuzz_bucket(uint32_t ordinal)
+{
+	uint32_t b;
+
+	if (ordinal == UINT_MAX) {
+		return 0;
+	}
+
+	for (b = 0; ordinal != 0 && b < 7; b++) {
+		ordinal >>= 1;
+	}
+
+	return b + 1;
+}
+
+/*
+ * Count the edge from the previous state this thread entered to this one.
+ * Unarmed states have no ordinal and are passed UINT_MAX. As in AFL, the
+ * counters are bumped without atomics: a lost increment costs nothing that
+ * matters to coverage.
+ */
+void
+rk_fuzz_enter(uint32_t state_id, uint32_t ordinal)
+{
+	uint32_t cur;
+
+	/* Room for every bucket, so states don't share any. */
+	cur = (state_id * 16 + rk_fuzz_bucket(ordinal)) * 0x9e3779b1U;
+	cur = (cur >> 16) & (RK_FUZZ_MAP_SIZE - 1);
+
+	rk_config.fuzz_map[cur ^ rk_fuzz_prev]++;
+	rk_fuzz_prev = cur >> 1;
+}
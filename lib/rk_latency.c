@@ -0,0 +1,194 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <ck_pr.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+/*
+ * Low-latency scheduling. Normally the scheduler sleeps on a semaphore
+ * whenever it waits for threads, so every epoch transition costs a wakeup
+ * plus however long the kernel takes to run it again. In this mode it
+ * polls the semaphore for a while first, which only costs a load while the
+ * thread it waits for is still on its way, and can be kept off the CPUs the
+ * program runs on and ahead of them in the run queue.
+ */
+void
+rk_low_latency_internal(struct rk_config *cfg, int cpu, int fifo,
+    uint32_t spin_us)
+{
+
+	assert(cfg != NULL);
+	rk_config.low_latency = true;
+	rk_config.ll_cpu = cpu;
+	rk_config.ll_fifo = fifo != 0;
+	rk_config.ll_spin_ns = (uint64_t)spin_us * 1000;
+	rk_config.wake_stats = true;
+}
+
+/* Called by the scheduler thread before it loads the schedule. */
+void
+rk_latency_setup(void)
+{
+#ifdef __linux__
+	struct sched_param sp;
+	cpu_set_t set;
+	int r;
+
+	if (rk_config.low_latency == false) {
+		return;
+	}
+
+	if (rk_config.ll_cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(rk_config.ll_cpu, &set);
+		if (sched_setaffinity(0, sizeof (set), &set) != 0) {
+			perror("rk_latency_setup: sched_setaffinity");
+		}
+	}
+
+	/*
+	 * The lowest real-time priority is enough to run ahead of every
+	 * ordinary thread in the program.
+	 */
+	if (rk_config.ll_fifo) {
+		memset(&sp, 0, sizeof (sp));
+		sp.sched_priority = sched_get_priority_min(SCHED_FIFO);
+		r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (r != 0) {
+			fprintf(rk_log, "rk_latency_setup: can't use SCHED_FIFO "
+			    "(%s); running at normal priority\n", strerror(r));
+		}
+	}
+#else
+	if (rk_config.low_latency && (rk_config.ll_cpu >= 0 ||
+	    rk_config.ll_fifo)) {
+		fprintf(rk_log, "rk_latency_setup: pinning and SCHED_FIFO are "
+		    "only supported on Linux; polling only\n");
+	}
+#endif
+}
+
+/*
+ * Poll s until it is posted or the spin budget runs out. When this returns
+ * true, waiting on s will not block.
+ */
+bool
+rk_latency_poll(struct rk_sema *s)
+{
+	uint64_t deadline;
+
+	if (rk_config.ll_spin_ns == 0) {
+		return false;
+	}
+
+	deadline = rk_spin_ns() + rk_config.ll_spin_ns;
+	do {
+		if (rk_thread_ready(s)) {
+			ck_pr_inc_64(&rk_config.wake_polled);
+			return true;
+		}
+		ck_pr_stall();
+	} while (rk_spin_ns() < deadline);
+
+	return false;
+}
+
+/* Note when a thread let the scheduler go on. */
+void
+rk_latency_stamp(struct rk_sema *s)
+{
+
+	if (rk_config.wake_stats) {
+		ck_pr_store_64(&s->posted_ns, rk_spin_ns());
+	}
+}
+
+/*
+ * The scheduler has come back from waiting on s, which it started doing at
+ * since. Account for the time from when it was posted, or from when the
+ * scheduler got there if that was later. Only the scheduler updates the
+ * totals; telemetry reads them as they go.
+ */
+void
+rk_latency_woken(struct rk_sema *s, uint64_t since)
+{
+	uint64_t posted, now, ns;
+
+	if (rk_config.wake_stats == false) {
+		return;
+	}
+
+	posted = ck_pr_load_64(&s->posted_ns);
+	now = rk_spin_ns();
+	if (posted < since) {
+		posted = since;
+	}
+	if (posted > now) {
+		return;
+	}
+
+	ns = now - posted;
+	ck_pr_store_64(&rk_config.wake_total_ns, rk_config.wake_total_ns + ns);
+	if (ns > rk_config.wake_max_ns) {
+		ck_pr_store_64(&rk_config.wake_max_ns, ns);
+	}
+	ck_pr_store_64(&rk_config.wake_n, rk_config.wake_n + 1);
+}
+
+void
+rk_latency_report(void)
+{
+	uint64_t n;
+
+	if (rk_config.low_latency == false) {
+		return;
+	}
+
+	n = rk_config.wake_n;
+	fprintf(rk_log, "rk_latency: %" PRIu64 " wakeups (%" PRIu64 " while "
+	    "polling), mean %" PRIu64 " ns, max %" PRIu64 " ns\n", n,
+	    rk_config.wake_polled, n ? rk_config.wake_total_ns / n : 0,
+	    rk_config.wake_max_ns);
+}
@@ -0,0 +1,275 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <ck_pr.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+/* Whether this thread's affinity was changed by a pin action. */
+__thread bool rk_pin_pinned;
+
+static const char *rk_pin_names[] = {
+	[RK_HANDLER_PIN] = "pin",
+	[RK_HANDLER_PIN_SAME] = "pin-same",
+	[RK_HANDLER_PIN_FAR] = "pin-far",
+};
+
+#ifdef __linux__
+
+static __thread cpu_set_t rk_pin_saved;
+
+/* CPUs the program may run on, and where each of them sits. */
+static cpu_set_t rk_pin_allowed;
+static int rk_pin_package[CPU_SETSIZE];
+static int rk_pin_core[CPU_SETSIZE];
+static bool rk_pin_ready;
+
+static int
+rk_pin_topology(int cpu, const char *what, int dflt)
+{
+	char path[128];
+	FILE *f;
+	int v;
+
+	snprintf(path, sizeof (path),
+	    "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return dflt;
+	}
+
+	if (fscanf(f, "%d", &v) != 1) {
+		v = dflt;
+	}
+	fclose(f);
+
+	return v;
+}
+
+/*
+ * Discover the topology from sysfs. Called by the parser the first time it
+ * sees a pin action, before any thread can take one. A CPU without topology
+ * information is treated as a core of its own in package 0.
+ */
+void
+rk_pin_init(void)
+{
+	int cpu;
+
+	if (rk_pin_ready) {
+		return;
+	}
+
+	/* A pinned thread is restored on entering any state, armed or not. */
+	rk_state_detour_all();
+
+	if (sched_getaffinity(0, sizeof (rk_pin_allowed),
+	    &rk_pin_allowed) != 0) {
+		perror("rk_pin_init: sched_getaffinity");
+		CPU_ZERO(&rk_pin_allowed);
+	}
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &rk_pin_allowed)) {
+			continue;
+		}
+
+		rk_pin_package[cpu] = rk_pin_topology(cpu,
+		    "physical_package_id", 0);
+		rk_pin_core[cpu] = rk_pin_topology(cpu, "core_id", cpu);
+	}
+
+	rk_pin_ready = true;
+}
+
+/*
+ * Pick the CPU that best matches the action relative to ref: an SMT
+ * sibling for pin-same, another package (or failing that, another core)
+ * for pin-far. Ties go to the lowest CPU number so that placement is
+ * reproducible.
+ */
+static int
+rk_pin_choose(enum rk_handler_actions action, int ref)
+{
+	int cpu, best, best_rank, rank;
+	bool same_pkg, same_core;
+
+	best = ref;
+	best_rank = -1;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &rk_pin_allowed)) {
+			continue;
+		}
+
+		same_pkg = rk_pin_package[cpu] == rk_pin_package[ref];
+		same_core = same_pkg && rk_pin_core[cpu] == rk_pin_core[ref];
+		if (action == RK_HANDLER_PIN_SAME) {
+			rank = (cpu != ref && same_core) ? 2 : cpu == ref;
+		} else {
+			rank = !same_pkg ? 3 : !same_core ? 2 : cpu != ref;
+		}
+
+		if (rank > best_rank) {
+			best = cpu;
+			best_rank = rank;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Move the calling thread as the handler says, remembering its affinity
+ * so that it can be restored when the thread enters its next state. The
+ * placement that took effect is logged, since the best match may not be
+ * what was asked for.
+ */
+void
+rk_pin(struct rk_state_handler *h, uint32_t state_id, uint32_t td)
+{
+	struct rk_state **states;
+	const char *name;
+	uint32_t ref;
+	cpu_set_t set;
+	int cpu;
+
+	states = rk_array_first(&rk_config.states);
+	name = states[state_id]->state_name;
+
+	if (h->action == RK_HANDLER_PIN) {
+		ref = 0;
+		if (h->act_pin.cpu >= CPU_SETSIZE ||
+		    !CPU_ISSET(h->act_pin.cpu, &rk_pin_allowed)) {
+			fprintf(rk_log, "rk_pin: %s[%u]: CPU %u is not "
+			    "available; not pinned\n", name, td,
+			    h->act_pin.cpu);
+			return;
+		}
+		cpu = h->act_pin.cpu;
+	} else {
+		ref = ck_pr_load_32(&h->act_pin.ref->last_cpu);
+		if (ref == 0) {
+			fprintf(rk_log, "rk_pin: %s[%u]: no thread has reached "
+			    "the %s reference yet; not pinned\n", name, td,
+			    rk_pin_names[h->action]);
+			return;
+		}
+		cpu = rk_pin_choose(h->action, ref - 1);
+	}
+
+	if (rk_pin_pinned == false &&
+	    sched_getaffinity(0, sizeof (rk_pin_saved), &rk_pin_saved) != 0) {
+		perror("rk_pin: sched_getaffinity");
+		return;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof (set), &set) != 0) {
+		perror("rk_pin: sched_setaffinity");
+		return;
+	}
+	rk_pin_pinned = true;
+
+	if (ref != 0) {
+		fprintf(rk_log, "rk_pin: %s[%u]: %s of CPU %u (package %d, "
+		    "core %d): pinned to CPU %d (package %d, core %d), "
+		    "running on CPU %d\n", name, td, rk_pin_names[h->action],
+		    ref - 1, rk_pin_package[ref - 1], rk_pin_core[ref - 1],
+		    cpu, rk_pin_package[cpu], rk_pin_core[cpu], sched_getcpu());
+	} else {
+		fprintf(rk_log, "rk_pin: %s[%u]: pinned to CPU %d (package "
+		    "%d, core %d), running on CPU %d\n", name, td, cpu,
+		    rk_pin_package[cpu], rk_pin_core[cpu], sched_getcpu());
+	}
+}
+
+void
+rk_pin_restore(void)
+{
+
+	if (sched_setaffinity(0, sizeof (rk_pin_saved), &rk_pin_saved) != 0) {
+		perror("rk_pin_restore: sched_setaffinity");
+	}
+	rk_pin_pinned = false;
+}
+
+void
+rk_pin_locate(struct rk_state_handler *h)
+{
+	int cpu;
+
+	cpu = sched_getcpu();
+	if (cpu >= 0) {
+		ck_pr_store_32(&h->last_cpu, cpu + 1);
+	}
+}
+
+#else
+
+void
+rk_pin_init(void)
+{
+
+	fprintf(rk_log, "rk_pin_init: pin actions are only supported on "
+	    "Linux; they will do nothing\n");
+}
+
+void
+rk_pin(struct rk_state_handler *h, uint32_t state_id, uint32_t td)
+{
+
+	(void)rk_pin_names;
+}
+
+void
+rk_pin_restore(void)
+{
+
+	rk_pin_pinned = false;
+}
+
+void
+rk_pin_locate(struct rk_state_handler *h)
+{
+
+}
+
+#endif
@@ -0,0 +1,159 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ck_pr.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+static struct rk_record_entry *rk_record_entries;
+static uint32_t rk_record_busy;
+
+void
+rk_record_internal(struct rk_config *cfg, const char *path)
+{
+
+	assert(cfg != NULL);
+	rk_config.record_path = path;
+}
+
+/*
+ * Map the log once the schedule is loaded. The file is sized for
+ * RK_RECORD_ENTRIES entries up front and is sparse until they are used.
+ */
+void
+rk_record_start(void)
+{
+	struct rk_record_log *log;
+	struct rk_state **states;
+	uint32_t n_states, i;
+	size_t size;
+	char *names;
+	int fd;
+
+	if (rk_config.record_path == NULL) {
+		return;
+	}
+
+	states = rk_array_first(&rk_config.states);
+	n_states = rk_array_len(&rk_config.states);
+	size = sizeof (*log) + (size_t)n_states * RK_RECORD_NAMELEN +
+	    (size_t)RK_RECORD_ENTRIES * sizeof (struct rk_record_entry);
+
+	fd = open(rk_config.record_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("rk_record_start: open");
+		return;
+	}
+
+	if (ftruncate(fd, size) != 0) {
+		perror("rk_record_start: ftruncate");
+		close(fd);
+		return;
+	}
+
+	log = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (log == MAP_FAILED) {
+		perror("rk_record_start: mmap");
+		return;
+	}
+
+	memcpy(log->magic, RK_RECORD_MAGIC, sizeof (log->magic));
+	log->n_states = n_states;
+	log->n_entries = RK_RECORD_ENTRIES;
+	log->seq = 0;
+
+	names = (char *)(log + 1);
+	for (i = 0; i < n_states; i++) {
+		strncpy(names + (size_t)i * RK_RECORD_NAMELEN,
+		    states[i]->state_name, RK_RECORD_NAMELEN - 1);
+	}
+
+	rk_record_entries = (struct rk_record_entry *)(names +
+	    (size_t)n_states * RK_RECORD_NAMELEN);
+	ck_pr_fence_store();
+	ck_pr_store_ptr(&rk_config.record, log);
+}
+
+/*
+ * Take an ordinal from cur on behalf of a thread entering an armed state,
+ * and log it. The ordinal and the sequence number are taken together, so
+ * that entries into a state are logged in the order of their ordinals;
+ * otherwise a replay could ask for an order that never happened. The entry
+ * itself is private to the thread that claimed it.
+ */
+uint32_t
+rk_record_enter(uint32_t state_id, uint32_t *cur)
+{
+	struct rk_record_entry *e;
+	uint32_t ordinal;
+	uint64_t seq;
+
+	while (ck_pr_fas_32(&rk_record_busy, 1) != 0) {
+		while (ck_pr_load_32(&rk_record_busy) != 0) {
+			ck_pr_stall();
+		}
+	}
+	ordinal = ck_pr_faa_32(cur, 1);
+	seq = ck_pr_faa_64(&rk_config.record->seq, 1);
+	ck_pr_fence_release();
+	ck_pr_store_32(&rk_record_busy, 0);
+
+	if (seq >= RK_RECORD_ENTRIES) {
+		/* Only one thread takes the first sequence number past it. */
+		if (seq == RK_RECORD_ENTRIES) {
+			fprintf(rk_log, "rk_record_enter: log full after %u "
+			    "entries; the rest aren't recorded\n",
+			    RK_RECORD_ENTRIES);
+		}
+		return ordinal;
+	}
+
+	e = &rk_record_entries[seq];
+	e->state_id = state_id;
+	e->ordinal = ordinal;
+	e->tid = rk_thread_id();
+	e->epoch = ck_pr_load_32(&rk_config.cur_epoch);
+	ck_pr_fence_store();
+	ck_pr_store_64(&e->seq, seq + 1);
+	return ordinal;
+}
@@ -0,0 +1,138 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+/*
+ * How often the calling thread has entered a sampled state since it was
+ * armed with generation gen.
+ */
+struct rk_sample_count {
+	uint32_t	gen;
+	uint64_t	seen;
+};
+
+static pthread_key_t rk_sample_key;
+static pthread_once_t rk_sample_once = PTHREAD_ONCE_INIT;
+
+static __thread struct rk_sample_count *rk_sample_counts;
+static __thread uint32_t rk_sample_n;
+
+static void
+rk_sample_key_init(void)
+{
+
+	if (pthread_key_create(&rk_sample_key, free) != 0) {
+		perror("rk_sample_key_init: pthread_key_create");
+	}
+}
+
+/* The calling thread's counter for state_id, or NULL. */
+static struct rk_sample_count *
+rk_sample_count(uint32_t state_id)
+{
+	struct rk_sample_count *counts;
+	uint32_t n;
+
+	if (state_id < rk_sample_n) {
+		return &rk_sample_counts[state_id];
+	}
+
+	pthread_once(&rk_sample_once, rk_sample_key_init);
+
+	n = rk_array_len(&rk_config.states);
+	if (n <= state_id) {
+		n = state_id + 1;
+	}
+	counts = realloc(rk_sample_counts, n * sizeof (*counts));
+	if (counts == NULL) {
+		return NULL;
+	}
+	memset(counts + rk_sample_n, 0, (n - rk_sample_n) * sizeof (*counts));
+
+	rk_sample_counts = counts;
+	rk_sample_n = n;
+	if (pthread_setspecific(rk_sample_key, counts) != 0) {
+		perror("rk_sample_count: pthread_setspecific");
+	}
+	return &counts[state_id];
+}
+
+/*
+ * Whether this entry into state_id, armed with generation gen, is one the
+ * schedule cares about. Only the calling thread's own counter is touched,
+ * so the entries that are passed over cost no shared writes at all. A
+ * counter from an earlier arming of the state starts again from zero.
+ */
+bool
+rk_sample_take(const struct rk_sample *sp, uint32_t state_id, uint32_t gen)
+{
+	struct rk_sample_count *sc;
+	uint64_t seen, x;
+
+	sc = rk_sample_count(state_id);
+	if (sc == NULL) {
+		fprintf(rk_log, "Out of memory sampling state %u\n", state_id);
+		return false;
+	}
+
+	if (sc->gen != gen) {
+		sc->gen = gen;
+		sc->seen = 0;
+	}
+	seen = ++sc->seen;
+
+	if (seen <= sp->skip) {
+		return false;
+	}
+	if (sp->every > 1 && (seen - sp->skip) % sp->every != 0) {
+		return false;
+	}
+	if (sp->p == 0) {
+		return true;
+	}
+
+	/*
+	 * The draw depends on the seed, the state, the thread's ID and how
+	 * often it has been here, so threads don't all keep the same entries
+	 * and a given thread's are fixed by the seed.
+	 */
+	x = ((uint64_t)sp->seed << 32 | state_id) ^
+	    rk_jitter_mix((uint64_t)rk_thread_id() << 32 ^ seen);
+	return (uint32_t)(rk_jitter_mix(x) >> 32) < sp->p;
+}
@@ -31,8 +31,9 @@
 #include <dispatch/dispatch.h>
 #else
 #include <semaphore.h>
-#include <errno.h>
 #endif
+#include <errno.h>
+#include <time.h>
 
 #include "raikkonen.h"
 #include "raikkonen_internal.h"
@@ -40,6 +41,11 @@
 bool
 rk_sema_init(struct rk_sema *s, uint32_t value)
 {
+
+	s->n_waiters = 0;
+	s->n_credits = 0;
+	s->posted_ns = 0;
+
 #ifdef __APPLE__
 	dispatch_semaphore_t *sem = &s->sem;
 
@@ -48,7 +54,8 @@ rk_sema_init(struct rk_sema *s, uint32_t value)
 #else
 	int r;
 
-	r = sem_init(&s->sem, 0, value);
+	/* In shared mode, every semaphore is in the arena. */
+	r = sem_init(&s->sem, rk_config.shm != NULL, value);
 
 	return (r == 0);
 #endif
@@ -71,6 +78,66 @@ rk_sema_wait(struct rk_sema *s)
 #endif
 }
 
+/* Like rk_sema_wait, but gives up with ETIMEDOUT after ms milliseconds. */
+bool
+rk_sema_timedwait(struct rk_sema *s, uint32_t ms)
+{
+	struct timespec rel;
+
+	rel.tv_sec = ms / 1000;
+	rel.tv_nsec = (long)(ms % 1000) * 1000000;
+	return rk_sema_timedwait_ts(s, &rel);
+}
+
+/* Like rk_sema_timedwait, for a timeout of rel from now. */
+bool
+rk_sema_timedwait_ts(struct rk_sema *s, const struct timespec *rel)
+{
+#ifdef __APPLE__
+	if (dispatch_semaphore_wait(s->sem, dispatch_time(DISPATCH_TIME_NOW,
+	    (int64_t)rel->tv_sec * 1000000000 + rel->tv_nsec)) != 0) {
+		errno = ETIMEDOUT;
+		return false;
+	}
+	return true;
+#else
+	struct timespec ts;
+	int r;
+
+	/* The deadline is absolute, so it holds across interruptions. */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += rel->tv_sec;
+	ts.tv_nsec += rel->tv_nsec;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	do {
+		r = sem_timedwait(&s->sem, &ts);
+	} while (r == -1 && errno == EINTR);
+
+	return (r == 0);
+#endif
+}
+
+/* Take the semaphore if that doesn't mean waiting for it. */
+bool
+rk_sema_trywait(struct rk_sema *s)
+{
+#ifdef __APPLE__
+	return dispatch_semaphore_wait(s->sem, DISPATCH_TIME_NOW) == 0;
+#else
+	int r;
+
+	do {
+		r = sem_trywait(&s->sem);
+	} while (r == -1 && errno == EINTR);
+
+	return (r == 0);
+#endif
+}
+
 bool
 rk_sema_post(struct rk_sema *s)
 {
@@ -85,3 +152,29 @@ rk_sema_post(struct rk_sema *s)
 	return (r == 0);
 #endif
 }
+
+/*
+ * Whether a wait would return at once, without taking anything. Dispatch
+ * semaphores can't be looked at, so on Apple this never says so.
+ */
+bool
+rk_sema_ready(struct rk_sema *s)
+{
+#ifdef __APPLE__
+	return false;
+#else
+	int v;
+
+	return (sem_getvalue(&s->sem, &v) == 0 && v > 0);
+#endif
+}
+
+void
+rk_sema_destroy(struct rk_sema *s)
+{
+#ifdef __APPLE__
+	dispatch_release(s->sem);
+#else
+	sem_destroy(&s->sem);
+#endif
+}
@@ -0,0 +1,340 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ck_pr.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+/* How often the scheduler looks for dead processes while it waits. */
+#define RK_SHM_REAP_MS	100
+
+/*
+ * Put the run in shared mode. The arena is mapped here rather than when the
+ * scheduler starts, because the state table has to be allocated from it,
+ * and the program must fork after this and after rk_start.
+ */
+void
+rk_shared_internal(struct rk_config *cfg)
+{
+#ifdef __APPLE__
+	assert(cfg != NULL);
+	fprintf(stderr, "rk_shared: semaphores can't be shared between "
+	    "processes on this platform\n");
+#else
+	pthread_mutexattr_t attr;
+	struct rk_shm *shm;
+	void *p;
+
+	assert(cfg != NULL);
+	if (rk_config.shm != NULL) {
+		return;
+	}
+
+	if (rk_array_len(&rk_config.states) != 0) {
+		fprintf(stderr, "rk_shared: must be called before any state "
+		    "is registered\n");
+		return;
+	}
+
+	p = mmap(NULL, RK_SHM_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("rk_shared: mmap");
+		return;
+	}
+
+	shm = p;
+	shm->size = RK_SHM_SIZE;
+	shm->used = (sizeof (*shm) + 63) & ~63UL;
+
+	/*
+	 * If a process dies holding the lock, the next one to take it is
+	 * told so instead of hanging.
+	 */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	if (pthread_mutex_init(&shm->park_lock, &attr) != 0) {
+		perror("rk_shared: pthread_mutex_init");
+		munmap(p, RK_SHM_SIZE);
+		return;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	rk_config.shm = shm;
+#endif
+}
+
+/* Carve 64-byte aligned memory out of the arena. Only the parent does this. */
+void *
+rk_shm_alloc(size_t size)
+{
+	struct rk_shm *shm;
+	uint64_t off;
+
+	shm = rk_config.shm;
+	size = (size + 63) & ~(size_t)63;
+
+	off = ck_pr_faa_64(&shm->used, size);
+	if (off + size > shm->size) {
+		fprintf(rk_log != NULL ? rk_log : stderr,
+		    "rk_shm_alloc: shared arena exhausted\n");
+		return NULL;
+	}
+
+	return (uint8_t *)shm + off;
+}
+
+bool
+rk_shm_owns(const void *p)
+{
+	const uint8_t *base;
+
+	base = (const uint8_t *)rk_config.shm;
+	return base != NULL && (const uint8_t *)p >= base &&
+	    (const uint8_t *)p < base + rk_config.shm->size;
+}
+
+void
+rk_shm_lock(void)
+{
+	int r;
+
+	r = pthread_mutex_lock(&rk_config.shm->park_lock);
+	if (r == EOWNERDEAD) {
+		/*
+		 * The owner died between adjusting a waiter count and
+		 * posting, so the counts may be off by one. They are only
+		 * used for reporting in shared mode.
+		 */
+		fprintf(rk_log, "rk_shm_lock: a process died holding the "
+		    "park lock\n");
+		pthread_mutex_consistent(&rk_config.shm->park_lock);
+	} else if (r != 0) {
+		errno = r;
+		perror("rk_shm_lock: pthread_mutex_lock");
+	}
+}
+
+void
+rk_shm_unlock(void)
+{
+
+	pthread_mutex_unlock(&rk_config.shm->park_lock);
+}
+
+/*
+ * List the calling thread as parked on sema at an ordinal of a state, in
+ * *wp. The thread must not wait if the schedule has been abandoned in the
+ * meantime; that is reported by returning false. If the list is full, the
+ * thread parks unlisted and *wp is NULL.
+ */
+bool
+rk_shm_park(uint32_t state_id, uint32_t ordinal, struct rk_sema *sema,
+    struct rk_shm_waiter **wp)
+{
+	struct rk_shm_waiter *w;
+	struct rk_shm *shm;
+	uint32_t i;
+
+	*wp = NULL;
+	shm = rk_config.shm;
+	for (i = 0; i < RK_SHM_WAITERS; i++) {
+		w = &shm->waiters[i];
+		if (ck_pr_load_32(&w->busy) == 0 &&
+		    ck_pr_cas_32(&w->busy, 0, 1) == true) {
+			break;
+		}
+	}
+
+	if (i == RK_SHM_WAITERS) {
+		fprintf(rk_log, "rk_shm_park: more than %u threads parked; "
+		    "not watching %" PRIu32 "[%" PRIu32 "]\n",
+		    RK_SHM_WAITERS, state_id, ordinal);
+		return ck_pr_load_8((uint8_t *)&shm->abandoned) == false;
+	}
+
+	w->state_id = state_id;
+	w->ordinal = ordinal;
+	w->sema = sema;
+	ck_pr_fence_store();
+	ck_pr_store_32(&w->pid, getpid());
+
+	/* Pairs with the fence in rk_shm_abandon. */
+	ck_pr_fence_memory();
+	if (ck_pr_load_8((uint8_t *)&shm->abandoned)) {
+		rk_shm_unpark(w);
+		return false;
+	}
+
+	*wp = w;
+	return true;
+}
+
+void
+rk_shm_unpark(struct rk_shm_waiter *w)
+{
+
+	if (w == NULL) {
+		return;
+	}
+
+	ck_pr_store_32(&w->pid, 0);
+	ck_pr_fence_store();
+	ck_pr_store_32(&w->busy, 0);
+}
+
+static bool
+rk_shm_alive(pid_t pid)
+{
+#ifdef __linux__
+	char path[64], buf[256], *p;
+	FILE *f;
+#endif
+
+	if (kill(pid, 0) == -1 && errno == ESRCH) {
+		return false;
+	}
+
+#ifdef __linux__
+	/* A child that nobody has waited for yet is still there, but dead. */
+	snprintf(path, sizeof (path), "/proc/%d/stat", (int)pid);
+	f = fopen(path, "r");
+	if (f == NULL) {
+		return true;
+	}
+	p = fgets(buf, sizeof (buf), f);
+	fclose(f);
+	if (p != NULL && (p = strrchr(buf, ')')) != NULL &&
+	    p[1] == ' ' && p[2] == 'Z') {
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+/* Log every listed thread whose process has gone, and unlist it. */
+static bool
+rk_shm_reap(void)
+{
+	struct rk_shm_waiter *w;
+	struct rk_state **states;
+	bool dead;
+	uint32_t i;
+	pid_t pid;
+
+	states = rk_array_first(&rk_config.states);
+	dead = false;
+	for (i = 0; i < RK_SHM_WAITERS; i++) {
+		w = &rk_config.shm->waiters[i];
+		pid = ck_pr_load_32(&w->pid);
+		if (pid == 0 || rk_shm_alive(pid)) {
+			continue;
+		}
+
+		fprintf(rk_log, "rk_shm: process %d died parked at "
+		    "%s[%" PRIu32 "]\n", (int)pid,
+		    states[w->state_id]->state_name, w->ordinal);
+		rk_shm_unpark(w);
+		dead = true;
+	}
+
+	return dead;
+}
+
+/*
+ * The scheduler's wait in shared mode. A process that dies while parked
+ * will never get to wherever the schedule expects it next, so rather than
+ * wait forever, give up as soon as one is found. Returns false if so.
+ */
+bool
+rk_shm_wait(struct rk_sema *s)
+{
+
+	while (rk_sema_timedwait(s, RK_SHM_REAP_MS) == false) {
+		if (errno != ETIMEDOUT) {
+			return false;
+		}
+
+		if (rk_shm_reap()) {
+			errno = EOWNERDEAD;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Stop scheduling: disarm every state so that nothing parks again, and
+ * release every thread that is still parked, in whichever process.
+ */
+void
+rk_shm_abandon(void)
+{
+	struct rk_shm_waiter *w;
+	struct rk_state **states;
+	uint32_t i, n;
+
+	ck_pr_store_8((uint8_t *)&rk_config.shm->abandoned, true);
+
+	states = rk_array_first(&rk_config.states);
+	n = rk_array_len(&rk_config.states);
+	for (i = 0; i < n; i++) {
+		ck_pr_store_ptr(&states[i]->armed, NULL);
+	}
+
+	ck_pr_fence_memory();
+	for (i = 0; i < RK_SHM_WAITERS; i++) {
+		w = &rk_config.shm->waiters[i];
+		if (ck_pr_load_32(&w->pid) != 0 &&
+		    rk_sema_post(w->sema) == false) {
+			perror("rk_shm_abandon: rk_sema_post");
+		}
+	}
+
+	fprintf(rk_log, "rk_shm: schedule abandoned; all states disarmed\n");
+}
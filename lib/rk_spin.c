@@ -0,0 +1,160 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <ck_pr.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+/* Ticks per nanosecond, in 16.16 fixed point. Zero until calibrated. */
+static uint64_t rk_spin_scale;
+
+#define RK_SPIN_CALIBRATE_NS	5000000ULL
+
+uint64_t
+rk_spin_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Where there is a usable cycle counter, spin on it: reading it costs a few
+ * nanoseconds, where clock_gettime may cost tens. Anywhere else, the
+ * monotonic clock is the counter and a tick is a nanosecond.
+ */
+static inline uint64_t
+rk_spin_ticks(void)
+{
+
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return rk_spin_ns();
+#endif
+}
+
+/*
+ * Measure the counter against the monotonic clock. Called by the parser the
+ * first time it sees a spin or jitter action, so programs that never use
+ * them don't pay for it.
+ */
+void
+rk_spin_calibrate(void)
+{
+	uint64_t t0, t1, c0, c1;
+	volatile double warm;
+
+	if (ck_pr_load_64(&rk_spin_scale) != 0) {
+		return;
+	}
+
+	/*
+	 * Resolve log() here rather than in the first thread to draw an
+	 * exponential delay, where binding it costs microseconds.
+	 */
+	warm = 2.0;
+	warm = log(warm);
+
+	t0 = rk_spin_ns();
+	c0 = rk_spin_ticks();
+	do {
+		t1 = rk_spin_ns();
+	} while (t1 - t0 < RK_SPIN_CALIBRATE_NS);
+	c1 = rk_spin_ticks();
+
+	ck_pr_store_64(&rk_spin_scale, ((c1 - c0) << 16) / (t1 - t0));
+	if (rk_spin_scale == 0) {
+		ck_pr_store_64(&rk_spin_scale, 1);
+	}
+}
+
+/* Busy-wait for ns nanoseconds without giving up the CPU. */
+void
+rk_spin(uint32_t ns)
+{
+	uint64_t start, ticks;
+
+	ticks = ((uint64_t)ns * ck_pr_load_64(&rk_spin_scale)) >> 16;
+	start = rk_spin_ticks();
+	while (rk_spin_ticks() - start < ticks) {
+		ck_pr_stall();
+	}
+}
+
+/* splitmix64 finalizer. */
+uint64_t
+rk_jitter_mix(uint64_t x)
+{
+
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/*
+ * The delay for the thread taking ordinal td in state_id. It is a function
+ * of the seed, state and ordinal only, and not of which thread gets there
+ * first or how often the program has run.
+ */
+uint32_t
+rk_jitter_ns(const struct rk_jitter *j, uint32_t state_id, uint32_t td)
+{
+	double u, d;
+	uint64_t x;
+
+	x = rk_jitter_mix(((uint64_t)j->seed << 32 | state_id) ^
+	    rk_jitter_mix(td));
+
+	switch (j->dist) {
+	case RK_JITTER_UNIFORM:
+		return j->a + x % ((uint64_t)j->b - j->a + 1);
+
+	case RK_JITTER_EXP:
+		/* Uniform in (0, 1], so the log is finite. */
+		u = ((x >> 11) + 1) * (1.0 / 9007199254740992.0);
+		d = -log(u) * j->a;
+		return d >= UINT32_MAX ? UINT32_MAX : (uint32_t)d;
+	}
+
+	return 0;
+}
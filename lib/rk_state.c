@@ -33,108 +33,605 @@
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <ck_epoch.h>
 #include <ck_pr.h>
 
 #include "raikkonen.h"
 #include "raikkonen_internal.h"
 
+/*
+ * Set once anything needs rk_state_enter to run even for unarmed states, so
+ * that bindings which skip the call for those know to stop doing so.
+ */
+static uint32_t rk_state_detour;
+
+/* Each state gets a cache line of its own. */
 uint32_t
 rk_state_register_internal(struct rk_config *cfg, const char *name)
 {
 	struct rk_run_config *c;
-	struct rk_state *s;
+	struct rk_state **sp, *s;
 	void *pun;
 
 	assert(cfg != NULL);
 	pun = cfg;
 	c = pun;
 
-	s = rk_array_append(&c->states);
-	if (s == NULL) {
+	if (c->shm != NULL) {
+		pun = rk_shm_alloc(sizeof (*s));
+	} else if (posix_memalign(&pun, 64, sizeof (*s)) != 0) {
+		pun = NULL;
+	}
+	if (pun == NULL) {
 		return UINT_MAX;
 	}
+	s = pun;
+
+	sp = rk_array_append(&c->states);
+	if (sp == NULL) {
+		if (c->shm == NULL) {
+			free(s);
+		}
+		return UINT_MAX;
+	}
+	*sp = s;
 
 	s->state_name = name;
 	s->state_id = rk_array_len(&c->states) - 1;
-	if (rk_sema_init(&s->waitstate, 0) == false) {
-		perror("rk_state_register: rk_sema_init(waitstate)");
-	}
+	s->snapshot = NULL;
+	s->armed = NULL;
+	s->bound = NULL;
 
 	return s->state_id;
 }
 
-struct rk_state_handler *
-rk_state_find_handler(struct rk_state *s, uint32_t tr_start, uint32_t tr_end)
+struct rk_state *
+rk_state_get(uint32_t state_id)
+{
+	struct rk_state **states;
+
+	states = rk_array_first(&rk_config.states);
+	return states[state_id];
+}
+
+/*
+ * Keep a binding's flag for s up to date: nonzero whenever entering s has
+ * to call into the library. It may be set when it needn't be, but is never
+ * left clear while it must be set, since whoever clears it looks at armed
+ * again afterwards.
+ */
+static void
+rk_state_flag(struct rk_state *s)
+{
+	uint32_t *flag;
+
+	flag = s->bound;
+	if (flag == NULL) {
+		return;
+	}
+
+	ck_pr_fence_memory();
+	if (ck_pr_load_32(&rk_state_detour) != 0 ||
+	    ck_pr_load_ptr(&s->armed) != NULL) {
+		ck_pr_store_32(flag, 1);
+		return;
+	}
+
+	ck_pr_store_32(flag, 0);
+	ck_pr_fence_memory();
+	if (ck_pr_load_32(&rk_state_detour) != 0 ||
+	    ck_pr_load_ptr(&s->armed) != NULL) {
+		ck_pr_store_32(flag, 1);
+	}
+}
+
+/*
+ * Have the library maintain *flag for a binding that only calls
+ * rk_state_enter when the flag is set. Another process may arm a state in
+ * shared mode without this one hearing of it, so there the flag stays set.
+ */
+void
+rk_state_bind_internal(struct rk_config *cfg, uint32_t state_id,
+    uint32_t *flag)
+{
+	struct rk_run_config *c;
+	struct rk_state *s;
+	void *pun;
+
+	assert(cfg != NULL);
+	pun = cfg;
+	c = pun;
+
+	if (state_id >= rk_array_len(&c->states)) {
+		return;
+	}
+
+	if (c->shm != NULL) {
+		ck_pr_store_32(flag, 1);
+		return;
+	}
+
+	s = rk_state_get(state_id);
+	s->bound = flag;
+	rk_state_flag(s);
+}
+
+/* From now on, send every entry through the library, armed or not. */
+void
+rk_state_detour_all(void)
+{
+	struct rk_state **states;
+	uint32_t i, n;
+
+	ck_pr_store_32(&rk_state_detour, 1);
+
+	states = rk_array_first(&rk_config.states);
+	n = rk_array_len(&rk_config.states);
+	for (i = 0; i < n; i++) {
+		rk_state_flag(states[i]);
+	}
+}
+
+/* The arm generation, which has to be in the arena in shared mode. */
+static uint32_t *
+rk_state_gen(void)
+{
+
+	if (rk_config.shm != NULL) {
+		return &rk_config.shm->arm_gen;
+	}
+	return &rk_config.arm_gen;
+}
+
+CK_EPOCH_CONTAINER(struct rk_state_snapshot, epoch_entry, rk_state_snapshot_container)
+
+static void
+rk_state_snapshot_destroy(ck_epoch_entry_t *e)
+{
+	struct rk_state_snapshot *snap;
+
+	snap = rk_state_snapshot_container(e);
+	rk_sema_destroy(&snap->waitstate);
+	free(snap->keys);
+	free(snap);
+}
+
+/*
+ * Stage a new snapshot for a state, built from an installhandler command.
+ * Entering threads keep using whatever was armed before until
+ * rk_state_publish, so that every state armed by a run of `when` commands
+ * goes live at the same instant. Any snapshot this replaces may still be in
+ * use by threads that loaded it just before the switch, so it is retired
+ * on publication rather than freed. The handlers themselves belong to the
+ * command and live as long as the configuration does, so threads parked in
+ * a handler are not affected.
+ */
+void
+rk_state_arm(struct rk_state *s, struct rk_cmd_installhandler *ih)
+{
+	struct rk_state_snapshot *snap, **old;
+	void *pun;
+
+	if (rk_config.shm != NULL) {
+		pun = rk_shm_alloc(sizeof (*snap));
+	} else if (posix_memalign(&pun, 64, sizeof (*snap)) != 0) {
+		pun = NULL;
+	}
+	if (pun == NULL) {
+		fprintf(rk_log, "Out of memory arming state %s\n",
+		    s->state_name);
+		assert(0);
+	}
+	snap = pun;
+
+	snap->cur_thread = 1;
+	snap->cap_thread = ih->tr_max;
+	snap->disarm_at = ih->disarm_at;
+	snap->sample = ih->sample;
+	snap->keyed = ih->keyed;
+	snap->key = ih->key;
+	snap->keys = NULL;
+	snap->full = 0;
+	if (ih->per_key) {
+		size_t size = RK_KEY_SLOTS * sizeof (*snap->keys);
+
+		if (rk_config.shm != NULL) {
+			pun = rk_shm_alloc(size);
+		} else if (posix_memalign(&pun, 64, size) != 0) {
+			pun = NULL;
+		}
+		if (pun == NULL) {
+			fprintf(rk_log, "Out of memory arming state %s\n",
+			    s->state_name);
+			assert(0);
+		}
+		memset(pun, 0, size);
+		snap->keys = pun;
+
+		/* Some other key may yet need any ordinal. */
+		snap->disarm_at = UINT_MAX;
+	}
+	if (rk_config.record_path != NULL || rk_config.fuzz_map != NULL) {
+		/*
+		 * Recording and coverage need every ordinal, not just the
+		 * interesting ones.
+		 */
+		snap->disarm_at = UINT_MAX;
+	}
+	snap->handlers = &ih->handlers;
+	if (rk_sema_init(&snap->waitstate, 0) == false) {
+		perror("rk_state_arm: rk_sema_init(waitstate)");
+	}
+	snap->gen = *rk_state_gen() + 1;
+	snap->prev = s->armed;
+
+	/*
+	 * Other processes don't announce when they are done looking at a
+	 * snapshot, so in shared mode the old one is never reclaimed.
+	 */
+	if (s->snapshot != NULL && rk_config.shm == NULL) {
+		old = rk_array_append(&rk_config.retired);
+		if (old == NULL) {
+			fprintf(rk_log, "Out of memory arming state %s\n",
+			    s->state_name);
+			assert(0);
+		}
+		*old = s->snapshot;
+	}
+
+	ck_pr_fence_store();
+	ck_pr_store_ptr(&s->snapshot, snap);
+	ck_pr_store_ptr(&s->armed, snap);
+	rk_state_flag(s);
+}
+
+/* Make every staged snapshot live, and retire the ones they replaced. */
+void
+rk_state_publish(void)
 {
-	struct rk_state_handler *handlers;
-	uint32_t n_handlers, i;
+	struct rk_state_snapshot **old;
+	ck_epoch_record_t *record;
+	uint32_t i, n;
 
-	handlers = rk_array_first(s->handlers);
-	n_handlers = rk_array_len(s->handlers);
-	for (i = 0; i < n_handlers; i++) {
-		if (handlers[i].tr_start == tr_start &&
-		    handlers[i].tr_end == tr_end) {
-			return &handlers[i];
+	ck_pr_fence_store();
+	ck_pr_store_32(rk_state_gen(), *rk_state_gen() + 1);
+
+	if (rk_config.shm != NULL) {
+		return;
+	}
+
+	/*
+	 * A thread can only follow prev to a retired snapshot if it loaded
+	 * the old generation, and so started its read section before this.
+	 */
+	record = rk_thread_record();
+	old = rk_array_first(&rk_config.retired);
+	n = rk_array_len(&rk_config.retired);
+	for (i = 0; i < n; i++) {
+		ck_epoch_call(record, &old[i]->epoch_entry,
+		    rk_state_snapshot_destroy);
+	}
+	rk_array_truncate(&rk_config.retired, 0);
+	ck_epoch_poll(record);
+}
+
+static uint32_t
+rk_state_key_hash(uint64_t key)
+{
+
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return (uint32_t)key & (RK_KEY_SLOTS - 1);
+}
+
+/*
+ * The ordinal counter for key in a per-key table, claiming a slot for it if
+ * it has none. Slots are claimed with a compare-and-swap and never given
+ * back, so a key found once stays where it is. Returns NULL if the table is
+ * full.
+ */
+static uint32_t *
+rk_state_key_counter(struct rk_key_slot *keys, uint64_t key)
+{
+	struct rk_key_slot *k;
+	uint32_t i, n, busy;
+
+	i = rk_state_key_hash(key);
+	for (n = 0; n < RK_KEY_SLOTS; n++, i = (i + 1) & (RK_KEY_SLOTS - 1)) {
+		k = &keys[i];
+		for (;;) {
+			busy = ck_pr_load_32(&k->busy);
+			if (busy == 0) {
+				if (ck_pr_cas_32(&k->busy, 0, 1) == false) {
+					continue;
+				}
+				k->key = key;
+				k->cur_thread = 1;
+				ck_pr_fence_store();
+				ck_pr_store_32(&k->busy, 2);
+				return &k->cur_thread;
+			}
+			if (busy == 2) {
+				break;
+			}
+			ck_pr_stall();
+		}
+
+		ck_pr_fence_load();
+		if (k->key == key) {
+			return &k->cur_thread;
 		}
 	}
 
 	return NULL;
 }
 
+/* How many ordinals have been handed out since snap was armed. */
 uint32_t
-rk_state_enter_internal(struct rk_config *cfg, uint32_t state_id)
+rk_state_entered(struct rk_state_snapshot *snap)
+{
+	uint32_t n, i;
+
+	if (snap->keys == NULL) {
+		return ck_pr_load_32(&snap->cur_thread) - 1;
+	}
+
+	n = 0;
+	for (i = 0; i < RK_KEY_SLOTS; i++) {
+		if (ck_pr_load_32(&snap->keys[i].busy) == 2) {
+			n += ck_pr_load_32(&snap->keys[i].cur_thread) - 1;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * A thread has reached a range that a `wait-until` refers to. The last one
+ * the range expects releases every thread waiting on it, directly rather
+ * than through the scheduler; any that come later don't wait at all.
+ */
+static void
+rk_state_gate_arrive(struct rk_state_handler *h)
+{
+	uint32_t n;
+
+	if (ck_pr_faa_32(&h->gate_left, UINT_MAX) != 1) {
+		return;
+	}
+
+	n = ck_pr_fas_32(&h->gate, RK_GATE_OPEN);
+	while (n-- > 0) {
+		if (rk_thread_unpark(&h->gate_sema) == false) {
+			perror("rk_state_enter: rk_sema_post(gate)");
+		}
+	}
+}
+
+/* Wait until the range of ref has been reached. */
+static bool
+rk_state_wait_until(uint32_t state_id, uint32_t td,
+    struct rk_state_handler *ref)
+{
+	struct rk_shm_waiter *w;
+	uint32_t n;
+	bool r;
+
+	do {
+		n = ck_pr_load_32(&ref->gate);
+		if (n & RK_GATE_OPEN) {
+			return true;
+		}
+	} while (ck_pr_cas_32(&ref->gate, n, n + 1) == false);
+
+	/*
+	 * Whoever opens the gate posts once for every thread it finds
+	 * counted, so our post may already have been made; parking takes it
+	 * either way.
+	 */
+	if (rk_config.shm != NULL &&
+	    rk_shm_park(state_id, td, &ref->gate_sema, &w) == false) {
+		return true;
+	}
+	r = rk_thread_park(&ref->gate_sema);
+	if (rk_config.shm != NULL) {
+		rk_shm_unpark(w);
+	}
+	return r;
+}
+
+/*
+ * A wait with a deadline. Whether it ended with a resume or the deadline is
+ * logged either way, since a deadline passing usually means the schedule
+ * is wrong.
+ */
+static bool
+rk_state_wait_for(struct rk_state *s, uint32_t td, struct rk_state_handler *h)
+{
+
+	if (rk_thread_park_timed(&h->act_sema, &h->wait_for,
+	    &h->timed_out) == true) {
+		fprintf(rk_log, "rk_state_enter: %s[%" PRIu32 "] resumed\n",
+		    s->state_name, td);
+		return true;
+	}
+
+	if (errno != ETIMEDOUT) {
+		return false;
+	}
+
+	fprintf(rk_log, "rk_state_enter: %s[%" PRIu32 "] timed out after "
+	    "%ld.%09lds\n", s->state_name, td, (long)h->wait_for.tv_sec,
+	    h->wait_for.tv_nsec);
+	return true;
+}
+
+/*
+ * Enter a state on behalf of len bytes at data. The data is passed to
+ * callbacks, and is what the evict modifier evicts. A state armed for a key
+ * only counts entries made with that key, and one armed per key counts each
+ * key's entries separately; key is NULL when there is none.
+ */
+static uint32_t
+rk_state_enter_common(struct rk_config *cfg, uint32_t state_id,
+    const uint64_t *key, void *data, size_t len)
 {
+	struct rk_state_snapshot *snap;
 	struct rk_state_handler *h;
+	struct rk_shm_waiter *w;
+	ck_epoch_section_t section;
+	ck_epoch_record_t *record;
 	struct rk_run_config *c;
-	struct rk_cbdef *cbs;
-	struct timespec rem;
+	struct rk_cbdef *cbs, *cb;
 	struct rk_state *s;
 	uint32_t td, u, i;
-	uint32_t cap;
+	uint32_t cap, gen;
+	uint32_t *cur;
 	void *pun;
-	int r;
+	bool r;
 
 	assert(cfg != NULL);
 	pun = cfg;
 	c = pun;
 
-	s = rk_array_first(&c->states);
 	if (state_id >= rk_array_len(&c->states)) {
 		return UINT_MAX;
 	}
-	s = &s[state_id];
+	s = rk_state_get(state_id);
 
-	if (s->handlers == NULL) {
+	/* Entering a state leaves the last one, and any placement it made. */
+	if (rk_pin_pinned) {
+		rk_pin_restore();
+	}
+
+	if (ck_pr_load_ptr(&s->armed) == NULL) {
+		if (c->fuzz_map != NULL) {
+			rk_fuzz_enter(state_id, UINT_MAX);
+		}
 		return UINT_MAX;
 	}
 
-	td = ck_pr_faa_32(&s->cur_thread, 1);
+	if (c->accounting) {
+		rk_thread_enter();
+	}
+
+	/*
+	 * The state is armed. Load the snapshot again inside a read section
+	 * so that it cannot be reclaimed under us if the scheduler re-arms
+	 * the state concurrently.
+	 */
+	record = rk_thread_record();
+	ck_epoch_begin(record, &section);
+
+	snap = ck_pr_load_ptr(&s->armed);
+	gen = ck_pr_load_32(rk_state_gen());
+	while (snap != NULL && snap->gen > gen) {
+		snap = snap->prev;
+	}
+	if (snap != NULL && (snap->keyed || snap->keys != NULL) &&
+	    (key == NULL || (snap->keyed && *key != snap->key))) {
+		snap = NULL;
+	}
+	if (snap == NULL || (snap->sample.on &&
+	    rk_sample_take(&snap->sample, state_id, snap->gen) == false)) {
+		ck_epoch_end(record, &section);
+		if (c->fuzz_map != NULL) {
+			rk_fuzz_enter(state_id, UINT_MAX);
+		}
+		return UINT_MAX;
+	}
+
+	cur = &snap->cur_thread;
+	if (snap->keys != NULL) {
+		cur = rk_state_key_counter(snap->keys, *key);
+		if (cur == NULL) {
+			if (ck_pr_fas_32(&snap->full, 1) == 0) {
+				fprintf(rk_log, "rk_state_enter: %s: more "
+				    "than %u keys; the rest pass unarmed\n",
+				    s->state_name, RK_KEY_SLOTS);
+			}
+			ck_epoch_end(record, &section);
+			if (c->fuzz_map != NULL) {
+				rk_fuzz_enter(state_id, UINT_MAX);
+			}
+			return UINT_MAX;
+		}
+	}
+
+	if (ck_pr_load_ptr(&c->record) != NULL) {
+		td = rk_record_enter(state_id, cur);
+	} else {
+		td = ck_pr_faa_32(cur, 1);
+	}
+	if (c->fuzz_map != NULL) {
+		rk_fuzz_enter(state_id, td);
+	}
 
-	h = rk_array_first(s->handlers);
-	u = rk_array_len(s->handlers);
+	h = rk_array_first(snap->handlers);
+	u = rk_array_len(snap->handlers);
 
-	cap = ck_pr_load_32(&s->cap_thread) - 1;
-	if (td >= cap) {
-		ck_pr_store_32(&s->cap_thread, UINT_MAX);
-		if (rk_sema_post(&s->waitstate) == false) {
+	/*
+	 * Only one thread may wake the scheduler from its waitstate, even if
+	 * several of them reach the cap at once.
+	 */
+	cap = ck_pr_load_32(&snap->cap_thread);
+	if (cap != UINT_MAX && td >= cap - 1 &&
+	    ck_pr_cas_32(&snap->cap_thread, cap, UINT_MAX) == true) {
+		rk_latency_stamp(&snap->waitstate);
+		if (rk_thread_unpark(&snap->waitstate) == false) {
 			perror("rk_state_enter: rk_sema_post(waitstate)");
+			ck_epoch_end(record, &section);
 			return UINT_MAX;
 		}
 	}
 
+	/*
+	 * Nothing past this ordinal does anything. Send everybody after us
+	 * down the unarmed path instead of through the shared counter. Only
+	 * clear what we loaded, in case the scheduler has armed the state
+	 * again in the meantime.
+	 */
+	if (td >= snap->disarm_at &&
+	    ck_pr_cas_ptr(&s->armed, snap, NULL) == true) {
+		rk_state_flag(s);
+	}
+
 	for (i = 0; i < u; i++) {
 		if (td >= h[i].tr_start && td <= h[i].tr_end) {
 			break;
 		}
 	}
 
+	ck_epoch_end(record, &section);
+
 	h = &h[i];
+	if (h->located) {
+		rk_pin_locate(h);
+	}
+	if (h->watched) {
+		rk_latency_stamp(&h->arrival);
+		if (rk_thread_unpark(&h->arrival) == false) {
+			perror("rk_state_enter: rk_sema_post(arrival)");
+		}
+	}
+	if (h->gated) {
+		rk_state_gate_arrive(h);
+	}
 
 	switch (h->action) {
 	case RK_HANDLER_CALLBACK:
 		cbs = rk_array_first(&c->callbacks);
-		cbs[h->act_callback].cb(s->state_id, NULL);
+		cb = &cbs[h->act_callback];
+		ck_pr_inc_64(&cb->calls);
+		if (cb->cb(s->state_id, data) != 0) {
+			ck_pr_inc_64(&cb->failures);
+			fprintf(rk_log, "rk_state_enter: callback %s failed at "
+			    "%s[%" PRIu32 "]\n", cb->cb_name, s->state_name, td);
+		}
 		break;
 
 	case RK_HANDLER_CONTINUE:
@@ -145,27 +642,95 @@ rk_state_enter_internal(struct rk_config *cfg, uint32_t state_id)
 		break;
 	
 	case RK_HANDLER_SLEEP:
-		rem.tv_sec = 0;
-		rem.tv_nsec = 0;
-		do {
-			if (rem.tv_sec > 0 || rem.tv_nsec > 0) {
-				r = nanosleep(&rem, &rem);
-			} else {
-				r = nanosleep(&h->act_sleep, &rem);
-			}
-		} while (r == -1 && errno == EINTR);
+		rk_thread_sleep(&h->act_sleep);
 		break;
 	
 	case RK_HANDLER_WAIT:
-		if (rk_sema_wait(&h->act_sema) == false) {
+		if (c->shm != NULL &&
+		    rk_shm_park(state_id, td, &h->act_sema, &w) == false) {
+			break;
+		}
+		if (c->telemetry_path != NULL) {
+			ck_pr_inc_32(&h->parked);
+		}
+		r = (h->wait_for.tv_sec != 0 || h->wait_for.tv_nsec != 0) ?
+		    rk_state_wait_for(s, td, h) : rk_thread_park(&h->act_sema);
+		if (c->telemetry_path != NULL) {
+			ck_pr_dec_32(&h->parked);
+		}
+		if (c->shm != NULL) {
+			rk_shm_unpark(w);
+		}
+		if (r == false) {
 			perror("rk_state_enter: rk_sema_wait(act)");
 			return UINT_MAX;
 		}
 		break;
+
+	case RK_HANDLER_SPIN:
+		rk_spin(h->act_spin);
+		break;
+
+	case RK_HANDLER_JITTER:
+		rk_spin(rk_jitter_ns(&h->act_jitter, state_id, td));
+		break;
+
+	case RK_HANDLER_PIN:
+	case RK_HANDLER_PIN_SAME:
+	case RK_HANDLER_PIN_FAR:
+		rk_pin(h, state_id, td);
+		break;
+
+	case RK_HANDLER_WAIT_UNTIL:
+		if (rk_state_wait_until(state_id, td, h->act_until) == false) {
+			perror("rk_state_enter: rk_sema_wait(gate)");
+			return UINT_MAX;
+		}
+		break;
+
 	default:
 		fprintf(rk_log, "Invalid handler: %u\n", h->action);
 		assert(0);
 	}
 
+	if (h->evict && data != NULL) {
+		rk_evict(data, len);
+	}
+
 	return td;
 }
+
+uint32_t
+rk_state_enter_internal(struct rk_config *cfg, uint32_t state_id)
+{
+
+	return rk_state_enter_common(cfg, state_id, NULL, NULL, 0);
+}
+
+uint32_t
+rk_state_enter_data_internal(struct rk_config *cfg, uint32_t state_id,
+    void *data, size_t len)
+{
+
+	return rk_state_enter_common(cfg, state_id, NULL, data, len);
+}
+
+/*
+ * Enter a state on behalf of the object identified by key, such as its
+ * address or the bucket it hashes to.
+ */
+uint32_t
+rk_state_enter_key_internal(struct rk_config *cfg, uint32_t state_id,
+    uint64_t key)
+{
+
+	return rk_state_enter_common(cfg, state_id, &key, NULL, 0);
+}
+
+uint32_t
+rk_state_enter_key_data_internal(struct rk_config *cfg, uint32_t state_id,
+    uint64_t key, void *data, size_t len)
+{
+
+	return rk_state_enter_common(cfg, state_id, &key, data, len);
+}
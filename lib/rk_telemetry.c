@@ -0,0 +1,383 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <ck_epoch.h>
+#include <ck_pr.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+/*
+ * Telemetry frames. Every integer is big endian, like the rest of the
+ * protocol. A frame is a one byte type and a four byte length of what
+ * follows:
+ *
+ *     0x00 len  u32 n_states, n_states * (u16 name_len, name)
+ *
+ * is sent once to every client when it connects, and then every interval
+ *
+ *     0x01 len  u32 epoch, u32 command, u32 n_threads, u32 n_blocked,
+ *               u32 n_states, n_states * (u32 entered, u32 n_ranges,
+ *               n_ranges * (u32 tr_start, u32 tr_end, u32 parked)),
+ *               u32 wakeups, u32 wake_mean_ns, u32 wake_max_ns
+ *
+ * New fields only ever go at the end of a frame, so a client that reads
+ * what it knows and skips the rest of len keeps working.
+ *
+ * n_threads and n_blocked are only counted when the run accounts for
+ * blocked threads, for virtual time or the watchdog, and are zero
+ * otherwise. wakeups counts how often the scheduler has been woken by the
+ * program so far, and the wake times are from the thread letting it go on
+ * to it running; they saturate rather than wrap, and are only kept in
+ * low-latency mode. entered is the number of ordinals handed out since the
+ * state was last armed, over every key for a state armed per key. parked
+ * is only meaningful for wait ranges and is zero otherwise. Unarmed states
+ * have no ranges.
+ */
+#define RK_TELEMETRY_NAMES	0x00
+#define RK_TELEMETRY_SAMPLE	0x01
+#define RK_TELEMETRY_CLIENTS	8
+
+struct rk_telemetry_buf {
+	uint8_t		*b;
+	size_t		len;
+	size_t		cap;
+};
+
+static pthread_t rk_telemetry;
+static int rk_telemetry_clients[RK_TELEMETRY_CLIENTS];
+
+void
+rk_telemetry_internal(struct rk_config *cfg, const char *path,
+    uint32_t interval_ms)
+{
+
+	assert(cfg != NULL);
+	rk_config.telemetry_path = path;
+	rk_config.telemetry_ms = interval_ms == 0 ? 1 : interval_ms;
+}
+
+static uint32_t
+rk_telemetry_sat32(uint64_t v)
+{
+
+	return v > UINT32_MAX ? UINT32_MAX : (uint32_t)v;
+}
+
+static void
+rk_telemetry_put(struct rk_telemetry_buf *b, const void *p, size_t len)
+{
+
+	if (b->len + len > b->cap) {
+		size_t cap = b->cap ? b->cap : 256;
+		void *n;
+
+		while (cap < b->len + len) {
+			cap *= 2;
+		}
+
+		n = realloc(b->b, cap);
+		if (n == NULL) {
+			fprintf(rk_log, "Out of memory for telemetry frame\n");
+			assert(0);
+		}
+		b->b = n;
+		b->cap = cap;
+	}
+
+	memcpy(b->b + b->len, p, len);
+	b->len += len;
+}
+
+static void
+rk_telemetry_put32(struct rk_telemetry_buf *b, uint32_t v)
+{
+
+	v = htonl(v);
+	rk_telemetry_put(b, &v, sizeof (v));
+}
+
+static void
+rk_telemetry_begin(struct rk_telemetry_buf *b, uint8_t type)
+{
+
+	b->len = 0;
+	rk_telemetry_put(b, &type, sizeof (type));
+	rk_telemetry_put32(b, 0);
+}
+
+static void
+rk_telemetry_finish(struct rk_telemetry_buf *b)
+{
+	uint32_t len;
+
+	len = htonl(b->len - 5);
+	memcpy(b->b + 1, &len, sizeof (len));
+}
+
+static void
+rk_telemetry_names(struct rk_telemetry_buf *b)
+{
+	struct rk_state **states;
+	uint32_t n, i;
+
+	states = rk_array_first(&rk_config.states);
+	n = rk_array_len(&rk_config.states);
+
+	rk_telemetry_begin(b, RK_TELEMETRY_NAMES);
+	rk_telemetry_put32(b, n);
+	for (i = 0; i < n; i++) {
+		uint16_t len;
+
+		len = strlen(states[i]->state_name);
+		len = htons(len);
+		rk_telemetry_put(b, &len, sizeof (len));
+		rk_telemetry_put(b, states[i]->state_name, ntohs(len));
+	}
+	rk_telemetry_finish(b);
+}
+
+static void
+rk_telemetry_sample(struct rk_telemetry_buf *b)
+{
+	struct rk_state_snapshot *snap;
+	struct rk_state_handler *h;
+	ck_epoch_section_t section;
+	ck_epoch_record_t *record;
+	struct rk_state **states;
+	uint64_t wake_n;
+	uint32_t n, i, j;
+
+	states = rk_array_first(&rk_config.states);
+	n = rk_array_len(&rk_config.states);
+
+	rk_telemetry_begin(b, RK_TELEMETRY_SAMPLE);
+	rk_telemetry_put32(b, ck_pr_load_32(&rk_config.cur_epoch));
+	rk_telemetry_put32(b, ck_pr_load_32(&rk_config.cur_command));
+	rk_telemetry_put32(b, ck_pr_load_32(&rk_config.n_threads));
+	rk_telemetry_put32(b, ck_pr_load_32(&rk_config.n_blocked));
+	rk_telemetry_put32(b, n);
+
+	/*
+	 * Counts are read without park_lock; a sample is allowed to be a
+	 * little stale, but must not slow down the threads it is watching.
+	 */
+	record = rk_thread_record();
+	ck_epoch_begin(record, &section);
+	for (i = 0; i < n; i++) {
+		uint32_t n_handlers;
+
+		snap = ck_pr_load_ptr(&states[i]->snapshot);
+		if (snap == NULL) {
+			rk_telemetry_put32(b, 0);
+			rk_telemetry_put32(b, 0);
+			continue;
+		}
+
+		rk_telemetry_put32(b, rk_state_entered(snap));
+
+		h = rk_array_first(snap->handlers);
+		n_handlers = rk_array_len(snap->handlers);
+		rk_telemetry_put32(b, n_handlers);
+		for (j = 0; j < n_handlers; j++) {
+			rk_telemetry_put32(b, h[j].tr_start);
+			rk_telemetry_put32(b, h[j].tr_end);
+			rk_telemetry_put32(b, h[j].action == RK_HANDLER_WAIT ?
+			    ck_pr_load_32(&h[j].parked) : 0);
+		}
+	}
+	ck_epoch_end(record, &section);
+
+	wake_n = ck_pr_load_64(&rk_config.wake_n);
+	rk_telemetry_put32(b, rk_telemetry_sat32(wake_n));
+	rk_telemetry_put32(b, rk_telemetry_sat32(wake_n == 0 ? 0 :
+	    ck_pr_load_64(&rk_config.wake_total_ns) / wake_n));
+	rk_telemetry_put32(b,
+	    rk_telemetry_sat32(ck_pr_load_64(&rk_config.wake_max_ns)));
+
+	rk_telemetry_finish(b);
+}
+
+static bool
+rk_telemetry_send(int fd, struct rk_telemetry_buf *b)
+{
+	size_t off;
+	ssize_t r;
+
+	for (off = 0; off < b->len; off += r) {
+		r = send(fd, b->b + off, b->len - off, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void
+rk_telemetry_accept(int lfd, struct rk_telemetry_buf *b)
+{
+	int fd, i;
+
+	while ((fd = accept(lfd, NULL, NULL)) >= 0) {
+		for (i = 0; i < RK_TELEMETRY_CLIENTS; i++) {
+			if (rk_telemetry_clients[i] < 0) {
+				break;
+			}
+		}
+
+		rk_telemetry_names(b);
+		if (i == RK_TELEMETRY_CLIENTS ||
+		    rk_telemetry_send(fd, b) == false) {
+			close(fd);
+			continue;
+		}
+
+		rk_telemetry_clients[i] = fd;
+	}
+}
+
+/*
+ * Clients only ever read. A client that stops reading fills its socket
+ * buffer and blocks this thread, never the program under test.
+ */
+static void *
+rk_telemetry_thread(void *arg)
+{
+	struct rk_telemetry_buf b;
+	struct timespec ts;
+	int lfd, i;
+
+	lfd = (int)(intptr_t)arg;
+	memset(&b, 0, sizeof (b));
+
+	ts.tv_sec = rk_config.telemetry_ms / 1000;
+	ts.tv_nsec = (rk_config.telemetry_ms % 1000) * 1000000;
+
+	for (;;) {
+		rk_telemetry_accept(lfd, &b);
+
+		rk_telemetry_sample(&b);
+		for (i = 0; i < RK_TELEMETRY_CLIENTS; i++) {
+			if (rk_telemetry_clients[i] < 0) {
+				continue;
+			}
+
+			if (rk_telemetry_send(rk_telemetry_clients[i], &b) ==
+			    false) {
+				close(rk_telemetry_clients[i]);
+				rk_telemetry_clients[i] = -1;
+			}
+		}
+
+		nanosleep(&ts, NULL);
+	}
+
+	return NULL;
+}
+
+void
+rk_telemetry_start(void)
+{
+	struct sockaddr_un sun;
+	int fd, i;
+
+	if (rk_config.telemetry_path == NULL) {
+		return;
+	}
+
+	memset(&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(rk_config.telemetry_path) >= sizeof (sun.sun_path)) {
+		fprintf(rk_log, "rk_telemetry_start: path too long: %s\n",
+		    rk_config.telemetry_path);
+		return;
+	}
+	strcpy(sun.sun_path, rk_config.telemetry_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("rk_telemetry_start: socket");
+		return;
+	}
+
+	unlink(sun.sun_path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof (sun)) != 0) {
+		perror("rk_telemetry_start: bind");
+		close(fd);
+		return;
+	}
+
+	if (listen(fd, RK_TELEMETRY_CLIENTS) != 0) {
+		perror("rk_telemetry_start: listen");
+		close(fd);
+		return;
+	}
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+		perror("rk_telemetry_start: fcntl");
+		close(fd);
+		return;
+	}
+
+	for (i = 0; i < RK_TELEMETRY_CLIENTS; i++) {
+		rk_telemetry_clients[i] = -1;
+	}
+
+	if (pthread_create(&rk_telemetry, NULL, rk_telemetry_thread,
+	    (void *)(intptr_t)fd) != 0) {
+		perror("rk_telemetry_start: pthread_create");
+		close(fd);
+		return;
+	}
+	pthread_detach(rk_telemetry);
+}
@@ -0,0 +1,443 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <ck_epoch.h>
+#include <ck_pr.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+static pthread_key_t rk_thread_key;
+static pthread_once_t rk_thread_key_once = PTHREAD_ONCE_INIT;
+static __thread bool rk_thread_registered;
+
+static pthread_key_t rk_thread_record_key;
+static pthread_once_t rk_thread_record_once = PTHREAD_ONCE_INIT;
+static __thread ck_epoch_record_t *rk_thread_epoch_record;
+static __thread uint32_t rk_thread_tid;
+
+/*
+ * park_lock only covers this process. In shared mode, waiter counts live in
+ * the arena and are touched from every process, so the arena's lock is
+ * taken instead.
+ */
+void
+rk_thread_lock(void)
+{
+
+	if (rk_config.shm != NULL) {
+		rk_shm_lock();
+	} else {
+		pthread_mutex_lock(&rk_config.park_lock);
+	}
+}
+
+void
+rk_thread_unlock(void)
+{
+
+	if (rk_config.shm != NULL) {
+		rk_shm_unlock();
+	} else {
+		pthread_mutex_unlock(&rk_config.park_lock);
+	}
+}
+
+/*
+ * If every known thread is blocked inside the library and somebody is
+ * sleeping on a timer, nothing else can happen before that timer expires.
+ * Jump the clock to its deadline and release it. Sleepers are released one
+ * at a time; the released thread must block or exit before the next one is
+ * considered, which keeps the release order identical to the deadline order.
+ *
+ * Must be called under rk_thread_lock whenever a thread blocks or goes away.
+ */
+static void
+rk_thread_advance_locked(void)
+{
+	struct rk_timer *t;
+
+	if (rk_config.virtual_time == false ||
+	    rk_config.n_blocked < rk_config.n_threads) {
+		return;
+	}
+
+	t = rk_config.timers;
+	if (t == NULL) {
+		return;
+	}
+
+	rk_config.timers = t->next;
+	if (t->deadline > rk_config.vclock) {
+		rk_config.vclock = t->deadline;
+	}
+
+	t->fired = true;
+	rk_config.n_blocked--;
+	pthread_cond_broadcast(&rk_config.park_cv);
+}
+
+static void
+rk_thread_unregister(void *arg)
+{
+
+	rk_thread_lock();
+	rk_config.n_threads--;
+	rk_thread_advance_locked();
+	rk_thread_unlock();
+}
+
+static void
+rk_thread_key_init(void)
+{
+
+	if (pthread_key_create(&rk_thread_key, rk_thread_unregister) != 0) {
+		perror("rk_thread_key_init: pthread_key_create");
+	}
+}
+
+static void
+rk_thread_add(void)
+{
+
+	if (rk_thread_registered) {
+		return;
+	}
+
+	pthread_once(&rk_thread_key_once, rk_thread_key_init);
+	rk_thread_registered = true;
+
+	rk_thread_lock();
+	rk_config.n_threads++;
+	rk_thread_unlock();
+
+	/* The value only has to be non-NULL for the destructor to run. */
+	if (pthread_setspecific(rk_thread_key, &rk_thread_registered) != 0) {
+		perror("rk_thread_add: pthread_setspecific");
+	}
+}
+
+static void
+rk_thread_record_release(void *arg)
+{
+
+	/* Records are never freed; the next new thread recycles this one. */
+	ck_epoch_unregister(arg);
+}
+
+static void
+rk_thread_record_key_init(void)
+{
+
+	if (pthread_key_create(&rk_thread_record_key,
+	    rk_thread_record_release) != 0) {
+		perror("rk_thread_record_key_init: pthread_key_create");
+	}
+}
+
+/*
+ * The calling thread's epoch record, used to protect state snapshots while
+ * they are being looked at and to retire them once they have been replaced.
+ */
+ck_epoch_record_t *
+rk_thread_record(void)
+{
+	ck_epoch_record_t *r;
+
+	if (rk_thread_epoch_record != NULL) {
+		return rk_thread_epoch_record;
+	}
+
+	pthread_once(&rk_thread_record_once, rk_thread_record_key_init);
+
+	r = ck_epoch_recycle(&rk_config.reclaim, NULL);
+	if (r == NULL) {
+		r = malloc(sizeof (*r));
+		if (r == NULL) {
+			fprintf(rk_log, "Out of memory for epoch record\n");
+			assert(0);
+		}
+		ck_epoch_register(&rk_config.reclaim, r, NULL);
+	}
+
+	if (pthread_setspecific(rk_thread_record_key, r) != 0) {
+		perror("rk_thread_record: pthread_setspecific");
+	}
+
+	rk_thread_epoch_record = r;
+	return r;
+}
+
+/* An identifier for the calling OS thread, for logs. */
+uint32_t
+rk_thread_id(void)
+{
+
+	if (rk_thread_tid == 0) {
+#ifdef __linux__
+		rk_thread_tid = syscall(SYS_gettid);
+#else
+		rk_thread_tid = (uint32_t)(uintptr_t)pthread_self();
+#endif
+	}
+
+	return rk_thread_tid;
+}
+
+void
+rk_thread_register_internal(struct rk_config *cfg)
+{
+
+	assert(cfg != NULL);
+	rk_thread_add();
+}
+
+void
+rk_virtual_time_internal(struct rk_config *cfg)
+{
+
+	assert(cfg != NULL);
+	rk_config.accounting = true;
+	rk_config.virtual_time = true;
+}
+
+/*
+ * Threads entering an armed state are registered automatically. Threads
+ * that might be running application code before they first enter a state
+ * should call rk_thread_register themselves, or the clock may be advanced
+ * while they are still on their way.
+ */
+void
+rk_thread_enter(void)
+{
+
+	rk_thread_add();
+}
+
+bool
+rk_thread_park(struct rk_sema *s)
+{
+
+	if (rk_config.accounting == false) {
+		return rk_sema_wait(s);
+	}
+
+	rk_thread_lock();
+	if (s->n_credits > 0) {
+		/* Already posted; the wait below will not block. */
+		s->n_credits--;
+	} else {
+		s->n_waiters++;
+		rk_config.n_blocked++;
+		rk_thread_advance_locked();
+	}
+	rk_thread_unlock();
+
+	return rk_sema_wait(s);
+}
+
+/*
+ * Park on s for at most rel. Returns false with errno set to ETIMEDOUT if
+ * nobody posted it in time, and then counts the thread in *timed_out, so
+ * that the post which was meant for it isn't left for whoever parks next.
+ * Posts to s have to go through rk_thread_unpark_timed with the same
+ * counter.
+ */
+bool
+rk_thread_park_timed(struct rk_sema *s, const struct timespec *rel,
+    uint32_t *timed_out)
+{
+	bool posted;
+
+	rk_thread_lock();
+	if (rk_config.accounting && s->n_credits > 0) {
+		s->n_credits--;
+		rk_thread_unlock();
+		return rk_sema_wait(s);
+	}
+	rk_config.n_timed++;
+	if (rk_config.accounting) {
+		s->n_waiters++;
+		rk_config.n_blocked++;
+		rk_thread_advance_locked();
+	}
+	rk_thread_unlock();
+
+	posted = rk_sema_timedwait_ts(s, rel);
+	if (posted == false && errno != ETIMEDOUT) {
+		return false;
+	}
+
+	/*
+	 * Posts are made under the lock, so one that came in after the
+	 * deadline but before the lock was taken can still be claimed here;
+	 * as a post wakes any one waiter, it doesn't matter whose it was.
+	 * Otherwise take a waiter off the counts, as a post would have, and
+	 * leave the post that is still to come to be swallowed.
+	 */
+	rk_thread_lock();
+	rk_config.n_timed--;
+	if (posted == false) {
+		posted = rk_sema_trywait(s);
+	}
+	if (posted == false) {
+		(*timed_out)++;
+		if (rk_config.accounting) {
+			s->n_waiters--;
+			rk_config.n_blocked--;
+		}
+	}
+	rk_thread_unlock();
+
+	if (posted == false) {
+		errno = ETIMEDOUT;
+	}
+	return posted;
+}
+
+/*
+ * Whether parking on s would return at once. When accounting, a post made
+ * while nobody was parked is also held as a credit, which is read here
+ * without the lock; a stale answer only means polling a little longer.
+ */
+bool
+rk_thread_ready(struct rk_sema *s)
+{
+
+	if (rk_config.accounting && rk_config.shm == NULL &&
+	    ck_pr_load_32(&s->n_credits) == 0) {
+		return false;
+	}
+
+	return rk_sema_ready(s);
+}
+
+/*
+ * The waker, not the woken thread, takes the waiter off the blocked count.
+ * Otherwise there is a window where a thread that has been told to run is
+ * still counted as blocked and the clock could move underneath it.
+ */
+bool
+rk_thread_unpark(struct rk_sema *s)
+{
+
+	if (rk_config.accounting) {
+		rk_thread_lock();
+		if (s->n_waiters > 0) {
+			s->n_waiters--;
+			rk_config.n_blocked--;
+		} else {
+			s->n_credits++;
+		}
+		rk_thread_unlock();
+	}
+
+	return rk_sema_post(s);
+}
+
+/*
+ * Resume one thread parked by rk_thread_park_timed, unless one has given
+ * up waiting since, in which case this was the resume it gave up on.
+ */
+bool
+rk_thread_unpark_timed(struct rk_sema *s, uint32_t *timed_out)
+{
+	bool r;
+
+	rk_thread_lock();
+	if (*timed_out > 0) {
+		(*timed_out)--;
+		rk_thread_unlock();
+		return true;
+	}
+
+	if (rk_config.accounting) {
+		if (s->n_waiters > 0) {
+			s->n_waiters--;
+			rk_config.n_blocked--;
+		} else {
+			s->n_credits++;
+		}
+	}
+	r = rk_sema_post(s);
+	rk_thread_unlock();
+
+	return r;
+}
+
+void
+rk_thread_sleep(const struct timespec *ts)
+{
+	struct timespec rem;
+	struct rk_timer t, **tp;
+	int r;
+
+	if (rk_config.virtual_time == false) {
+		rem = *ts;
+		do {
+			r = nanosleep(&rem, &rem);
+		} while (r == -1 && errno == EINTR);
+		return;
+	}
+
+	t.deadline = (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+	t.fired = false;
+
+	pthread_mutex_lock(&rk_config.park_lock);
+	t.deadline += rk_config.vclock;
+
+	/* Equal deadlines are released in the order they went to sleep. */
+	for (tp = &rk_config.timers; *tp != NULL; tp = &(*tp)->next) {
+		if ((*tp)->deadline > t.deadline) {
+			break;
+		}
+	}
+	t.next = *tp;
+	*tp = &t;
+
+	rk_config.n_blocked++;
+	rk_thread_advance_locked();
+	while (t.fired == false) {
+		pthread_cond_wait(&rk_config.park_cv, &rk_config.park_lock);
+	}
+	pthread_mutex_unlock(&rk_config.park_lock);
+}
@@ -0,0 +1,333 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <ck_epoch.h>
+#include <ck_pr.h>
+
+#include "raikkonen.h"
+#include "raikkonen_internal.h"
+
+static pthread_t rk_watchdog;
+
+static const char *rk_action_names[] = {
+	[RK_HANDLER_CALLBACK] = "callback",
+	[RK_HANDLER_CONTINUE] = "continue",
+	[RK_HANDLER_PANIC] = "panic",
+	[RK_HANDLER_SLEEP] = "sleep",
+	[RK_HANDLER_WAIT] = "wait",
+	[RK_HANDLER_SPIN] = "spin",
+	[RK_HANDLER_JITTER] = "jitter",
+	[RK_HANDLER_PIN] = "pin",
+	[RK_HANDLER_PIN_SAME] = "pin-same",
+	[RK_HANDLER_PIN_FAR] = "pin-far",
+	[RK_HANDLER_WAIT_UNTIL] = "wait-until",
+};
+
+void
+rk_watchdog_internal(struct rk_config *cfg, uint32_t grace_ms)
+{
+
+	assert(cfg != NULL);
+	rk_config.accounting = true;
+	rk_config.watchdog_ms = grace_ms;
+}
+
+static uint64_t
+rk_watchdog_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Anything that changes when a thread gets somewhere: the scheduler moving
+ * to another command, or a thread taking an ordinal in an armed state.
+ */
+static uint64_t
+rk_watchdog_progress(void)
+{
+	struct rk_state_snapshot *snap;
+	ck_epoch_section_t section;
+	ck_epoch_record_t *record;
+	struct rk_state **states;
+	uint32_t n_states, i;
+	uint64_t p;
+
+	p = ((uint64_t)ck_pr_load_32(&rk_config.cur_epoch) << 32) |
+	    ck_pr_load_32(&rk_config.cur_command);
+
+	record = rk_thread_record();
+	ck_epoch_begin(record, &section);
+
+	states = rk_array_first(&rk_config.states);
+	n_states = rk_array_len(&rk_config.states);
+	for (i = 0; i < n_states; i++) {
+		snap = ck_pr_load_ptr(&states[i]->snapshot);
+		if (snap != NULL) {
+			p += (uintptr_t)snap + rk_state_entered(snap);
+		}
+	}
+
+	ck_epoch_end(record, &section);
+	return p;
+}
+
+static void
+rk_watchdog_report_command(struct rk_command *cmd)
+{
+	struct rk_state **states;
+
+	states = rk_array_first(&rk_config.states);
+	switch (cmd->command) {
+	case RK_COMMAND_INSTALLHANDLER:
+		fprintf(rk_log, "when %s\n",
+		    states[cmd->cmd_installhandler.state_id]->state_name);
+		break;
+
+	case RK_COMMAND_RESUME:
+		fprintf(rk_log, "resume %s[%" PRIu32 "-%" PRIu32 "]\n",
+		    states[cmd->cmd_resume.state_id]->state_name,
+		    cmd->cmd_resume.tr_start, cmd->cmd_resume.tr_end);
+		break;
+
+	case RK_COMMAND_TIMEOUT:
+		fprintf(rk_log, "timeout\n");
+		break;
+
+	case RK_COMMAND_WAITSTATE:
+		if (cmd->cmd_waitstate.handler == NULL) {
+			fprintf(rk_log, "waitstate\n");
+			break;
+		}
+
+		fprintf(rk_log, "waitstate %s[%" PRIu32 "-%" PRIu32 "]\n",
+		    states[cmd->cmd_waitstate.state_id]->state_name,
+		    cmd->cmd_waitstate.tr_start, cmd->cmd_waitstate.tr_end);
+		break;
+	}
+}
+
+static void
+rk_watchdog_report(uint64_t stuck_ms)
+{
+	struct rk_state_snapshot *snap;
+	struct rk_state_handler *h;
+	ck_epoch_section_t section;
+	ck_epoch_record_t *record;
+	struct rk_command *cmds;
+	struct rk_state **states;
+	struct rk_epoch *epochs;
+	uint32_t epoch, command;
+	uint32_t n, i, j;
+
+	epoch = ck_pr_load_32(&rk_config.cur_epoch);
+	command = ck_pr_load_32(&rk_config.cur_command);
+
+	fprintf(rk_log, "rk_watchdog: no progress for %" PRIu64 "ms with "
+	    "%" PRIu32 " of %" PRIu32 " threads blocked; aborting\n",
+	    stuck_ms, rk_config.n_blocked, rk_config.n_threads);
+
+	record = rk_thread_record();
+	ck_epoch_begin(record, &section);
+
+	states = rk_array_first(&rk_config.states);
+	n = rk_array_len(&rk_config.states);
+	for (i = 0; i < n; i++) {
+		uint32_t cur, cap;
+
+		snap = ck_pr_load_ptr(&states[i]->snapshot);
+		if (snap == NULL) {
+			continue;
+		}
+
+		cur = rk_state_entered(snap);
+		cap = ck_pr_load_32(&snap->cap_thread);
+		if (cap == UINT_MAX) {
+			fprintf(rk_log, "  %s: %" PRIu32 " entered\n",
+			    states[i]->state_name, cur);
+		} else {
+			fprintf(rk_log, "  %s: %" PRIu32 " entered, waiting "
+			    "for %" PRIu32 "\n", states[i]->state_name, cur,
+			    cap - 1);
+		}
+
+		h = rk_array_first(snap->handlers);
+		for (j = 0; j < rk_array_len(snap->handlers); j++) {
+			fprintf(rk_log, "    [%" PRIu32 "-%" PRIu32 "] %s",
+			    h[j].tr_start, h[j].tr_end,
+			    rk_action_names[h[j].action]);
+			if (h[j].evict) {
+				fprintf(rk_log, " evict");
+			}
+			if (h[j].action == RK_HANDLER_WAIT) {
+				fprintf(rk_log, ": %" PRIu32 " parked",
+				    h[j].act_sema.n_waiters);
+			}
+			if (h[j].gated) {
+				fprintf(rk_log, " (gate: %" PRIu32 " to come, %"
+				    PRIu32 " waiting)", h[j].gate_left,
+				    h[j].gate & ~RK_GATE_OPEN);
+			}
+			fprintf(rk_log, "\n");
+		}
+	}
+
+	ck_epoch_end(record, &section);
+
+	/* With the schedule over, nothing is left to resume anybody. */
+	if (ck_pr_load_8((uint8_t *)&rk_config.sched_done) == true) {
+		fprintf(rk_log, "  schedule finished\n");
+		return;
+	}
+
+	pthread_mutex_lock(&rk_config.epoch_lock);
+	if (epoch >= rk_array_len(&rk_config.epochs)) {
+		pthread_mutex_unlock(&rk_config.epoch_lock);
+		return;
+	}
+
+	epochs = rk_array_first(&rk_config.epochs);
+	cmds = rk_array_first(&epochs[epoch].commands);
+	n = rk_array_len(&epochs[epoch].commands);
+	fprintf(rk_log, "  epoch %" PRIu32 ", outstanding commands:\n",
+	    epochs[epoch].epoch);
+	for (i = command; i < n; i++) {
+		fprintf(rk_log, "    %s", i == command ? "-> " : "   ");
+		rk_watchdog_report_command(&cmds[i]);
+	}
+	pthread_mutex_unlock(&rk_config.epoch_lock);
+}
+
+/* Whether any process is parked in the arena. */
+static bool
+rk_watchdog_shm_parked(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < RK_SHM_WAITERS; i++) {
+		if (ck_pr_load_32(&rk_config.shm->waiters[i].busy) != 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * No progress is possible when every registered thread and the scheduler
+ * are parked and there is no timer or deadline that could release one of
+ * them. If that stays true for the whole grace period, the schedule is
+ * wrong; say where and bail instead of waiting for somebody's CI to time
+ * out.
+ *
+ * This goes on after the scheduler has run out of commands, since threads
+ * it left parked would otherwise wait forever. The scheduler is no longer
+ * counted then, so somebody has to be parked for the program to be stuck.
+ */
+static void *
+rk_watchdog_thread(void *arg)
+{
+	uint64_t last, stuck_since, now, interval;
+	struct timespec ts;
+	bool stuck, done;
+
+	interval = rk_config.watchdog_ms / 4;
+	if (interval < 10) {
+		interval = 10;
+	}
+	ts.tv_sec = interval / 1000;
+	ts.tv_nsec = (interval % 1000) * 1000000;
+
+	last = rk_watchdog_progress();
+	stuck_since = rk_watchdog_now();
+	for (;;) {
+		uint64_t p;
+
+		nanosleep(&ts, NULL);
+
+		/*
+		 * Threads in other processes aren't counted, so in shared
+		 * mode only a lack of progress counts, and once the schedule
+		 * is over, only while some process is parked. A thread in a
+		 * wait with a deadline, or the scheduler in a timeout, will
+		 * return of its own accord.
+		 */
+		done = ck_pr_load_8((uint8_t *)&rk_config.sched_done);
+		rk_thread_lock();
+		if (rk_config.shm != NULL) {
+			stuck = done == false || rk_watchdog_shm_parked();
+		} else {
+			stuck = rk_config.n_blocked >= rk_config.n_threads &&
+			    rk_config.n_blocked > 0 && rk_config.timers == NULL;
+		}
+		if (rk_config.n_timed > 0 ||
+		    ck_pr_load_8((uint8_t *)&rk_config.sched_sleeping)) {
+			stuck = false;
+		}
+		p = rk_watchdog_progress();
+		now = rk_watchdog_now();
+		if (stuck == false || p != last) {
+			last = p;
+			stuck_since = now;
+		} else if (now - stuck_since >= rk_config.watchdog_ms) {
+			rk_watchdog_report(now - stuck_since);
+			abort();
+		}
+		rk_thread_unlock();
+	}
+
+	return NULL;
+}
+
+void
+rk_watchdog_start(void)
+{
+
+	if (rk_config.watchdog_ms == 0) {
+		return;
+	}
+
+	if (pthread_create(&rk_watchdog, NULL, rk_watchdog_thread, NULL) != 0) {
+		perror("rk_watchdog_start: pthread_create");
+		return;
+	}
+	pthread_detach(rk_watchdog);
+}
@@ -0,0 +1,134 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Measures what entering a state costs once the interesting ordinals have
+ * been consumed. STATE_COLD is never armed and gives the baseline.
+ * STATE_HOT parks its first entrant and continues everybody else, so it is
+ * disarmed as soon as that ordinal is handed out. STATE_ARMED continues
+ * everybody but never runs out of ranges, so every entry pays for the
+ * shared counter and the handler scan.
+ */
+
+#include <arpa/inet.h>
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/raikkonen.h"
+
+#define N_THREADS	4
+#define N_ENTRIES	1000000
+
+static uint32_t rk_state_cold, rk_state_hot, rk_state_armed;
+static pthread_barrier_t phase;
+
+void *
+td(void *arg)
+{
+	struct rk_config *cfg = arg;
+	int i;
+
+	pthread_barrier_wait(&phase);
+	for (i = 0; i < N_ENTRIES; i++) {
+		rk_state_enter(cfg, rk_state_cold);
+	}
+	pthread_barrier_wait(&phase);
+
+	pthread_barrier_wait(&phase);
+	for (i = 0; i < N_ENTRIES; i++) {
+		rk_state_enter(cfg, rk_state_hot);
+	}
+	pthread_barrier_wait(&phase);
+
+	pthread_barrier_wait(&phase);
+	for (i = 0; i < N_ENTRIES; i++) {
+		rk_state_enter(cfg, rk_state_armed);
+	}
+	pthread_barrier_wait(&phase);
+
+	return NULL;
+}
+
+static double
+run_phase(const char *name)
+{
+	struct timespec start, end;
+	double ns;
+
+	pthread_barrier_wait(&phase);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_barrier_wait(&phase);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	ns /= (double)N_THREADS * N_ENTRIES;
+	printf("%-10s %8.2f ns/entry\n", name, ns);
+
+	return ns;
+}
+
+int
+main(void)
+{
+	union rk_sockaddr rksa;
+	struct sockaddr_in sin;
+	struct rk_config *cfg;
+	pthread_t t[N_THREADS];
+
+	cfg = rk_config_get();
+	rk_state_cold = rk_state_register(cfg, "STATE_COLD");
+	rk_state_hot = rk_state_register(cfg, "STATE_HOT");
+	rk_state_armed = rk_state_register(cfg, "STATE_ARMED");
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(28806);
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+	rksa.rk_sin4 = &sin;
+	rk_start(&rksa);
+
+	pthread_barrier_init(&phase, NULL, N_THREADS + 1);
+	for (int i = 0; i < N_THREADS; i++) {
+		pthread_create(&t[i], NULL, td, cfg);
+	}
+
+	run_phase("unarmed");
+	run_phase("saturated");
+	run_phase("armed");
+
+	for (int i = 0; i < N_THREADS; i++) {
+		pthread_join(t[i], NULL);
+	}
+
+	return 0;
+}
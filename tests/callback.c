@@ -0,0 +1,82 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include <arpa/inet.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "../include/raikkonen.h"
+
+struct account {
+	int	balance;
+};
+
+static uint32_t rk_state_check;
+static uint32_t rk_callback_check;
+
+static int
+check_balance(uint32_t state, void *ptr)
+{
+	struct account *a = ptr;
+
+	return a->balance < 0;
+}
+
+int
+main(void)
+{
+	struct account good = { 10 }, bad = { -5 };
+	union rk_sockaddr rksa;
+	struct sockaddr_in sin;
+	struct rk_config *cfg;
+
+	cfg = rk_config_get();
+	rk_state_check = rk_state_register(cfg, "STATE_CHECK");
+	rk_callback_check = rk_callback_register(cfg, "CB_CHECK",
+	    check_balance);
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(28806);
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+	rksa.rk_sin4 = &sin;
+	rk_start(&rksa);
+
+	rk_state_enter_data(cfg, rk_state_check, &good, sizeof (good));
+	rk_state_enter_data(cfg, rk_state_check, &bad, sizeof (bad));
+	rk_state_enter_data(cfg, rk_state_check, &bad, sizeof (bad));
+
+	/* The third entry isn't checked. */
+	fprintf(stderr, "%" PRIu64 " %" PRIu64 "\n",
+	    rk_callback_calls(cfg, rk_callback_check),
+	    rk_callback_failures(cfg, rk_callback_check));
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <sys/un.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/raikkonen.h"
+
+/*
+ * One of two processes run by rk_coordinate.pl: `cache NAME` or `origin
+ * NAME`, listening on the local socket NAME. Each is held in its state until
+ * the last epoch, so that both are still there to announce it.
+ */
+int
+main(int argc, char **argv)
+{
+	struct timespec ts = { 0, 100000000 };
+	union rk_sockaddr rksa;
+	struct sockaddr_un sun;
+	struct rk_config *cfg;
+	uint32_t state;
+	int cache;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: coord cache|origin path\n");
+		return 1;
+	}
+	cache = strcmp(argv[1], "cache") == 0;
+
+	cfg = rk_config_get();
+	state = rk_state_register(cfg, cache ? "STATE_LOOKUP" :
+	    "STATE_RESPOND");
+
+	memset(&sun, 0, sizeof (sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, argv[2], sizeof (sun.sun_path) - 1);
+
+	rksa.rk_sun = &sun;
+	rk_start(&rksa);
+
+	/*
+	 * The origin gets here first, but may only respond once the cache has
+	 * done its lookup.
+	 */
+	if (cache) {
+		nanosleep(&ts, NULL);
+		fprintf(stderr, "cache: lookup\n");
+		rk_state_enter(cfg, state);
+	} else {
+		rk_state_enter(cfg, state);
+		fprintf(stderr, "origin: respond\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <arpa/inet.h>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../include/raikkonen.h"
+
+static uint32_t rk_state_a;
+static uint32_t rk_state_b;
+
+/*
+ * Records entries into two states to the log named on the command line. The
+ * same program runs again under the schedule made from the first log.
+ */
+int
+main(int argc, char **argv)
+{
+	static const char order[] = "AABABB";
+	union rk_sockaddr rksa;
+	struct sockaddr_in sin;
+	struct rk_config *cfg;
+	const char *p;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: record log\n");
+		return 1;
+	}
+
+	cfg = rk_config_get();
+	rk_state_a = rk_state_register(cfg, "STATE_A");
+	rk_state_b = rk_state_register(cfg, "STATE_B");
+	rk_record(cfg, argv[1]);
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(28806);
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+	rksa.rk_sin4 = &sin;
+	rk_start(&rksa);
+
+	for (p = order; *p != '\0'; p++) {
+		fprintf(stderr, "%c %u\n", *p, rk_state_enter(cfg,
+		    *p == 'A' ? rk_state_a : rk_state_b));
+	}
+
+	return 0;
+}
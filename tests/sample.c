@@ -0,0 +1,106 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <arpa/inet.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../include/raikkonen.h"
+
+static uint32_t rk_state_hot;
+static uint32_t rk_state_bucket;
+static uint32_t rk_state_object;
+static uint32_t rk_callback_seen;
+
+static int
+seen(uint32_t state, void *ptr)
+{
+
+	fprintf(stderr, "seen %d\n", *(int *)ptr);
+	return 0;
+}
+
+int
+main(void)
+{
+	union rk_sockaddr rksa;
+	struct sockaddr_in sin;
+	struct rk_config *cfg;
+	uint32_t td;
+	int i;
+
+	cfg = rk_config_get();
+	rk_state_hot = rk_state_register(cfg, "STATE_HOT");
+	rk_state_bucket = rk_state_register(cfg, "STATE_BUCKET");
+	rk_state_object = rk_state_register(cfg, "STATE_OBJECT");
+	rk_callback_seen = rk_callback_register(cfg, "CB_SEEN", seen);
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(28806);
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+	rksa.rk_sin4 = &sin;
+	rk_start(&rksa);
+
+	for (i = 1; i <= 100; i++) {
+		td = rk_state_enter_data(cfg, rk_state_hot, &i, sizeof (i));
+		if (td != UINT_MAX) {
+			fprintf(stderr, "%d: %u\n", i, td);
+		}
+
+		/* Only the bucket the schedule names takes ordinals. */
+		td = rk_state_enter_key_data(cfg, rk_state_bucket, i % 8, &i,
+		    sizeof (i));
+		if (td != UINT_MAX) {
+			fprintf(stderr, "bucket %d: %u\n", i, td);
+		}
+
+		/* Every object counts its own ordinals. */
+		td = rk_state_enter_key_data(cfg, rk_state_object, i % 8, &i,
+		    sizeof (i));
+		if (i > 96) {
+			fprintf(stderr, "object %d: %u\n", i, td);
+		}
+	}
+
+	/*
+	 * Fill the rest of the table. Objects that don't fit pass as if the
+	 * state weren't armed; the ones that do go on counting.
+	 */
+	for (i = 8; i < 2048; i++) {
+		rk_state_enter_key(cfg, rk_state_object, i);
+	}
+	fprintf(stderr, "object 2048: %u\n",
+	    rk_state_enter_key(cfg, rk_state_object, 2048));
+	fprintf(stderr, "object 1: %u\n",
+	    rk_state_enter_key(cfg, rk_state_object, 1));
+
+	return 0;
+}
@@ -0,0 +1,90 @@
+/*-
+ * Copyright (c) 2014 Fastly, Inc.
+ * All rights reserved.
+ *
+ * Author: Devon H. O'Dell <dho@fastly.com>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "../include/raikkonen.h"
+
+#define N_WORKERS	2
+
+static uint32_t rk_state_accept, rk_state_done;
+
+static void
+worker(struct rk_config *cfg)
+{
+	uint32_t tdno;
+
+	tdno = rk_state_enter(cfg, rk_state_accept);
+	fprintf(stderr, "%d\n", tdno);
+	rk_state_enter(cfg, rk_state_done);
+}
+
+int
+main(void)
+{
+	union rk_sockaddr rksa;
+	struct sockaddr_in sin;
+	struct rk_config *cfg;
+	pid_t pid[N_WORKERS];
+
+	cfg = rk_config_get();
+	rk_shared(cfg);
+	rk_state_accept = rk_state_register(cfg, "STATE_ACCEPT");
+	rk_state_done = rk_state_register(cfg, "STATE_DONE");
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(28806);
+	inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+
+	rksa.rk_sin4 = &sin;
+	rk_start(&rksa);
+
+	/* Ordinals are counted across processes, like a pre-forking server. */
+	for (int i = 0; i < N_WORKERS; i++) {
+		pid[i] = fork();
+		if (pid[i] == 0) {
+			worker(cfg);
+			_exit(0);
+		}
+	}
+
+	for (int i = 0; i < N_WORKERS; i++) {
+		waitpid(pid[i], NULL, 0);
+	}
+
+	fprintf(stderr, "done\n");
+
+	return 0;
+}
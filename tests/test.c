@@ -62,6 +62,10 @@ main(void)
 
 	cfg = rk_config_get();
 	rk_state_preread = rk_state_register(cfg, "STATE_PREREAD");
+#ifdef LOW_LATENCY
+	/* Polling only, which needs no privileges and no spare CPU. */
+	rk_low_latency(cfg, -1, 0, 200);
+#endif
 
         sin.sin_family = AF_INET;
 	sin.sin_port = htons(28806);